@@ -46,12 +46,14 @@
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/stats.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -197,7 +199,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -210,16 +211,13 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* keeps the cached pages, so the next iteration does not start
+         * with a cold cache */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -329,6 +327,11 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
+/* One bit per chunk of guest RAM whose dirty tracking has not been
+ * re-armed since the last bitmap sync; see migration_bitmap_clear_chunk().
+ */
+static unsigned long *migration_clear_bitmap;
+static unsigned long migration_clear_chunks;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
@@ -436,52 +439,58 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
+/* Chunks of 1 << MIGRATION_CLEAR_CHUNK_SHIFT pages (1 GiB with 4 KiB
+ * pages) are re-armed at a time: small enough not to stall the guest,
+ * large enough to keep the number of calls into the accelerator low.
+ */
+#define MIGRATION_CLEAR_CHUNK_SHIFT 18
+#define MIGRATION_CLEAR_CHUNK_BITS  (TARGET_PAGE_BITS + \
+                                     MIGRATION_CLEAR_CHUNK_SHIFT)
+
+/*
+ * Re-arm dirty tracking for the chunk that contains @addr, the first time
+ * a page from it is about to be sent after a bitmap sync.  Doing it just
+ * before reading the pages, rather than for all of RAM in
+ * migration_bitmap_sync(), spreads the cost of write-protecting guest
+ * memory over the whole pass.
+ */
+static void migration_bitmap_clear_chunk(ram_addr_t addr)
 {
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    unsigned long chunk = addr >> MIGRATION_CLEAR_CHUNK_BITS;
+    ram_addr_t start = (ram_addr_t)chunk << MIGRATION_CLEAR_CHUNK_BITS;
+    ram_addr_t end = start + (1ULL << MIGRATION_CLEAR_CHUNK_BITS);
+    RAMBlock *block;
+
+    if (!test_and_clear_bit(chunk, migration_clear_bitmap)) {
+        return;
+    }
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    /* A chunk can span more than one block */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t block_start = block->mr->ram_addr;
+        ram_addr_t block_end = block_start + block->length;
 
-    if (!ret) {
-        migration_dirty_pages++;
+        if (block_end <= start || block_start >= end) {
+            continue;
+        }
+        memory_region_clear_dirty_bitmap(block->mr,
+                                         MAX(start, block_start) - block_start,
+                                         MIN(end, block_end)
+                                         - MAX(start, block_start));
     }
-    return ret;
 }
 
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
-            }
-        }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
-        }
-    }
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+
+    /* vCPU threads may set bits in src concurrently; they are either
+     * moved to migration_bitmap here or left for the next sync.
+     */
+    migration_dirty_pages +=
+        bitmap_merge_and_clear_atomic(migration_bitmap, src,
+                                      start >> TARGET_PAGE_BITS,
+                                      length >> TARGET_PAGE_BITS);
 }
 
 
@@ -520,6 +529,7 @@ static void migration_bitmap_sync(void)
 
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
+    bitmap_set(migration_clear_bitmap, 0, migration_clear_chunks);
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         migration_bitmap_sync_range(block->mr->ram_addr, block->length);
@@ -677,6 +687,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
                 ram_bulk_stage = false;
             }
         } else {
+            migration_bitmap_clear_chunk(mr->ram_addr + offset);
             bytes_sent = ram_save_page(f, block, offset, last_stage);
 
             /* if page is unmodified, continue to the next */
@@ -744,6 +755,8 @@ static void migration_end(void)
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
+        g_free(migration_clear_bitmap);
+        migration_clear_bitmap = NULL;
     }
 
     XBZRLE_cache_lock();
@@ -778,6 +791,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    Error *local_err = NULL;
 
     mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
@@ -822,6 +836,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_clear_chunks = DIV_ROUND_UP(ram_bitmap_pages,
+                                          1 << MIGRATION_CLEAR_CHUNK_SHIFT);
+    migration_clear_bitmap = bitmap_new(migration_clear_chunks);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -835,7 +852,18 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         migration_dirty_pages += block_pages;
     }
 
-    memory_global_dirty_log_start();
+    memory_global_dirty_log_start(&local_err);
+    if (local_err) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+        g_free(migration_clear_bitmap);
+        migration_clear_bitmap = NULL;
+        qemu_mutex_unlock_ramlist();
+        qemu_mutex_unlock_iothread();
+        return -1;
+    }
     migration_bitmap_sync();
     qemu_mutex_unlock_iothread();
 
@@ -1171,10 +1199,41 @@ static SaveVMHandlers savevm_ram_handlers = {
     .cancel = ram_migration_cancel,
 };
 
+/* The RAM part of query-migrate */
+static const StatsField ram_mig_stats_fields[] = {
+    { "transferred", STATS_KIND_CUMULATIVE },
+    { "remaining", STATS_KIND_INSTANT },
+    { "total", STATS_KIND_INSTANT },
+    { "duplicate", STATS_KIND_CUMULATIVE },
+    { "skipped", STATS_KIND_CUMULATIVE },
+    { "normal", STATS_KIND_CUMULATIVE },
+    { "normal-bytes", STATS_KIND_CUMULATIVE },
+    { "dirty-pages-rate", STATS_KIND_INSTANT },
+    { "dirty-sync-count", STATS_KIND_CUMULATIVE },
+};
+
+static void ram_mig_stats_collect(void *opaque, uint64_t *values)
+{
+    MigrationState *s = migrate_get_current();
+
+    values[0] = ram_bytes_transferred();
+    values[1] = ram_bytes_remaining();
+    values[2] = ram_bytes_total();
+    values[3] = dup_mig_pages_transferred();
+    values[4] = skipped_mig_pages_transferred();
+    values[5] = norm_mig_pages_transferred();
+    values[6] = norm_mig_bytes_transferred();
+    values[7] = s->dirty_pages_rate;
+    values[8] = s->dirty_sync_count;
+}
+
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
+    stats_register("migration.ram", ram_mig_stats_fields,
+                   ARRAY_SIZE(ram_mig_stats_fields), ram_mig_stats_collect,
+                   NULL);
 }
 
 struct soundhw {
@@ -1368,6 +1427,330 @@ int xen_available(void)
 }
 
 
+/*
+ * Dirty page rate measurement
+ *
+ * Dirty logging is enabled for the duration of the measurement, and the
+ * DIRTY_MEMORY_MIGRATION bitmap is collected and cleared once per sample
+ * period.  Migration uses the same bitmap, so the two are mutually
+ * exclusive.
+ *
+ * For the re-dirty histogram every page has a small saturating counter of
+ * the sample periods in which it was dirty.  The counters are stored as
+ * bit planes, one bitmap per counter bit, so that a whole word of dirty
+ * bits can be added at once.
+ */
+#define DIRTY_RATE_COUNTER_BITS 3
+#define DIRTY_RATE_COUNTER_MAX  ((1 << DIRTY_RATE_COUNTER_BITS) - 1)
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint64_t dirty_pages;
+} DirtyRateBlock;
+
+static struct {
+    DirtyRateStatus status;
+    int64_t calc_time;
+    int64_t sample_period;
+    int samples_left;
+    int64_t start_time;
+    int64_t end_time;
+    QEMUTimer *timer;
+    Error *blocker;
+    DirtyRateBlock *blocks;
+    int nb_blocks;
+    unsigned long *counter[DIRTY_RATE_COUNTER_BITS];
+    unsigned long nb_pages;
+    uint64_t histogram[DIRTY_RATE_COUNTER_MAX];
+} dirty_rate;
+
+/* Adds one to the counters of the pages set in @bits */
+static void dirty_rate_count(unsigned long word, unsigned long bits)
+{
+    unsigned long carry = bits, tmp;
+    int i;
+
+    for (i = 0; i < DIRTY_RATE_COUNTER_BITS; i++) {
+        tmp = dirty_rate.counter[i][word] & carry;
+        dirty_rate.counter[i][word] ^= carry;
+        carry = tmp;
+    }
+
+    /* counters that wrapped around saturate at DIRTY_RATE_COUNTER_MAX */
+    for (i = 0; carry && i < DIRTY_RATE_COUNTER_BITS; i++) {
+        dirty_rate.counter[i][word] |= carry;
+    }
+}
+
+/* Marks @block clean for the measurement.  Accelerators that do not
+ * write-protect pages when they report them dirty, like kvm with manual
+ * dirty log protection, would otherwise report the same pages again in
+ * every sample.
+ */
+static void dirty_rate_reset_block(RAMBlock *block)
+{
+    cpu_physical_memory_reset_dirty(block->offset, block->length,
+                                    DIRTY_MEMORY_MIGRATION);
+    memory_region_clear_dirty_bitmap(block->mr, 0, block->length);
+}
+
+static DirtyRateBlock *dirty_rate_find_block(RAMBlock *block)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nb_blocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+
+        if (b->offset == block->offset && b->length == block->length) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t dirty_rate_sample_block(RAMBlock *block)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    unsigned long page = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = page + (block->length >> TARGET_PAGE_BITS);
+    uint64_t dirty = 0;
+
+    while (page < end) {
+        if (page % BITS_PER_LONG == 0 && end - page >= BITS_PER_LONG) {
+            unsigned long bits = src[BIT_WORD(page)];
+
+            if (bits) {
+                dirty += ctpopl(bits);
+                dirty_rate_count(BIT_WORD(page), bits);
+            }
+            page += BITS_PER_LONG;
+        } else {
+            if (test_bit(page, src)) {
+                dirty++;
+                dirty_rate_count(BIT_WORD(page), BIT_MASK(page));
+            }
+            page++;
+        }
+    }
+
+    dirty_rate_reset_block(block);
+    return dirty;
+}
+
+static void dirty_rate_finish(void)
+{
+    unsigned long k, nr, mask;
+    int i, v;
+
+    dirty_rate.end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    memory_global_dirty_log_stop();
+
+    timer_free(dirty_rate.timer);
+    dirty_rate.timer = NULL;
+
+    memset(dirty_rate.histogram, 0, sizeof(dirty_rate.histogram));
+    nr = BITS_TO_LONGS(dirty_rate.nb_pages);
+    for (k = 0; k < nr; k++) {
+        for (v = 1; v <= DIRTY_RATE_COUNTER_MAX; v++) {
+            mask = ~0UL;
+            for (i = 0; i < DIRTY_RATE_COUNTER_BITS; i++) {
+                if (v & (1 << i)) {
+                    mask &= dirty_rate.counter[i][k];
+                } else {
+                    mask &= ~dirty_rate.counter[i][k];
+                }
+            }
+            dirty_rate.histogram[v - 1] += ctpopl(mask);
+        }
+    }
+
+    for (i = 0; i < DIRTY_RATE_COUNTER_BITS; i++) {
+        g_free(dirty_rate.counter[i]);
+        dirty_rate.counter[i] = NULL;
+    }
+
+    migrate_del_blocker(dirty_rate.blocker);
+    error_free(dirty_rate.blocker);
+    dirty_rate.blocker = NULL;
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+}
+
+static void dirty_rate_sample(void *opaque)
+{
+    RAMBlock *block;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    /* Blocks added or removed during the measurement are not sampled */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b = dirty_rate_find_block(block);
+
+        if (b) {
+            b->dirty_pages += dirty_rate_sample_block(block);
+        }
+    }
+
+    if (--dirty_rate.samples_left > 0) {
+        timer_mod(dirty_rate.timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                    dirty_rate.sample_period);
+        return;
+    }
+
+    dirty_rate_finish();
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_period,
+                         int64_t sample_period, Error **errp)
+{
+    RAMBlock *block;
+    Error *local_err = NULL;
+    int i;
+
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "Dirty page rate measurement already in progress");
+        return;
+    }
+
+    if (migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Guest is waiting for an incoming migration");
+        return;
+    }
+
+    if (calc_time <= 0 || calc_time > 3600) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a number of seconds between 1 and 3600");
+        return;
+    }
+
+    if (!has_sample_period) {
+        sample_period = 1000;
+    }
+    if (sample_period < 10 || sample_period > calc_time * 1000) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sample-period",
+                  "a number of milliseconds between 10 and calc-time");
+        return;
+    }
+
+    g_free(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+    dirty_rate.nb_blocks = 0;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        dirty_rate.nb_blocks++;
+    }
+    dirty_rate.blocks = g_new0(DirtyRateBlock, dirty_rate.nb_blocks);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        pstrcpy(dirty_rate.blocks[i].idstr,
+                sizeof(dirty_rate.blocks[i].idstr), block->idstr);
+        dirty_rate.blocks[i].offset = block->offset;
+        dirty_rate.blocks[i].length = block->length;
+        i++;
+    }
+
+    dirty_rate.nb_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    for (i = 0; i < DIRTY_RATE_COUNTER_BITS; i++) {
+        dirty_rate.counter[i] = bitmap_new(dirty_rate.nb_pages);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    error_setg(&dirty_rate.blocker,
+               "Dirty page rate measurement in progress");
+    migrate_add_blocker(dirty_rate.blocker);
+
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.sample_period = sample_period;
+    dirty_rate.samples_left = calc_time * 1000 / sample_period;
+
+    /* Start with a clean bitmap, so that only pages dirtied from now on
+     * are counted.
+     */
+    memory_global_dirty_log_start(&local_err);
+    if (local_err) {
+        for (i = 0; i < DIRTY_RATE_COUNTER_BITS; i++) {
+            g_free(dirty_rate.counter[i]);
+            dirty_rate.counter[i] = NULL;
+        }
+        migrate_del_blocker(dirty_rate.blocker);
+        error_free(dirty_rate.blocker);
+        dirty_rate.blocker = NULL;
+        error_propagate(errp, local_err);
+        return;
+    }
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        dirty_rate_reset_block(block);
+    }
+
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirty_rate.timer = timer_new_ms(QEMU_CLOCK_REALTIME, dirty_rate_sample,
+                                    NULL);
+    timer_mod(dirty_rate.timer, dirty_rate.start_time + sample_period);
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    DirtyRateBlockInfoList *block_list = NULL, *block_entry;
+    intList *histogram = NULL, *entry;
+    int64_t elapsed;
+    uint64_t total = 0;
+    int i;
+
+    info->status = dirty_rate.status;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    elapsed = MAX(dirty_rate.end_time - dirty_rate.start_time, 1);
+
+    for (i = dirty_rate.nb_blocks - 1; i >= 0; i--) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+
+        block_entry = g_malloc0(sizeof(*block_entry));
+        block_entry->value = g_malloc0(sizeof(*block_entry->value));
+        block_entry->value->id = g_strdup(b->idstr);
+        block_entry->value->size = b->length;
+        block_entry->value->dirty_pages = b->dirty_pages;
+        block_entry->value->dirty_pages_rate = b->dirty_pages * 1000 / elapsed;
+        block_entry->next = block_list;
+        block_list = block_entry;
+        total += b->dirty_pages;
+    }
+
+    for (i = DIRTY_RATE_COUNTER_MAX - 1; i >= 0; i--) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = dirty_rate.histogram[i];
+        entry->next = histogram;
+        histogram = entry;
+    }
+
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_sample_period = true;
+    info->sample_period = dirty_rate.sample_period;
+    info->has_dirty_pages_rate = true;
+    info->dirty_pages_rate = total * 1000 / elapsed;
+    info->has_page_size = true;
+    info->page_size = TARGET_PAGE_SIZE;
+    info->has_blocks = true;
+    info->blocks = block_list;
+    info->has_histogram = true;
+    info->histogram = histogram;
+
+    return info;
+}
+
 TargetInfo *qmp_query_target(Error **errp)
 {
     TargetInfo *info = g_malloc0(sizeof(*info));
@@ -62,6 +62,36 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v, void *opaque,
+                                         const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, &backend->prealloc_threads, name, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v, void *opaque,
+                                         const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value < 1 || value > MAX_MEM_PREALLOC_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_MEM_PREALLOC_THREADS);
+        return;
+    }
+    backend->prealloc_threads = value;
+}
+
 static void
 host_memory_backend_get_host_nodes(Object *obj, Visitor *v, void *opaque,
                                    const char *name, Error **errp)
@@ -192,6 +222,23 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz)
+{
+    int fd = memory_region_get_fd(&backend->mr);
+    int nthreads = backend->prealloc_threads ? backend->prealloc_threads
+                                             : smp_cpus;
+
+#ifdef CONFIG_NUMA
+    /* Touch pages from the nodes they are bound to */
+    if (backend->policy != MPOL_DEFAULT) {
+        os_mem_prealloc(fd, ptr, sz, nthreads, backend->host_nodes, MAX_NODES);
+        return;
+    }
+#endif
+    os_mem_prealloc(fd, ptr, sz, nthreads, NULL, 0);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -218,11 +265,10 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz);
+        host_memory_backend_prealloc(backend, ptr, sz);
         backend->prealloc = true;
     }
 }
@@ -246,6 +292,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "int",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -330,7 +380,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            host_memory_backend_prealloc(backend, ptr, sz);
         }
     }
 }
@@ -96,6 +96,7 @@ typedef struct BlkMigState {
     int transferred;
     int prev_progress;
     int bulk_completed;
+    BlkMigDevState *bulk_cursor;
 
     /* Lock must be taken _inside_ the iothread lock.  */
     QemuMutex lock;
@@ -122,8 +123,11 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
+    /* blk->buf is NULL if block status already told us the chunk reads
+     * as zeroes, in which case there is nothing to scan.
+     */
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        (!blk->buf || buffer_is_zero(blk->buf, BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -249,6 +253,29 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
+/* Called with iothread lock taken.
+ *
+ * Returns true if block status reports the whole chunk as reading zeroes,
+ * so that it can be sent as a zero block without reading it first.
+ */
+
+static bool mig_chunk_reads_as_zero(BlockDriverState *bs, int64_t sector,
+                                    int nr_sectors)
+{
+    int64_t ret;
+    int n;
+
+    while (nr_sectors > 0) {
+        ret = bdrv_get_block_status(bs, sector, nr_sectors, &n);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || n == 0) {
+            return false;
+        }
+        sector += n;
+        nr_sectors -= n;
+    }
+    return true;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -286,11 +313,32 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     }
 
     blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
+    if (block_mig_state.zero_blocks) {
+        qemu_mutex_lock_iothread();
+        if (mig_chunk_reads_as_zero(bs, cur_sector, nr_sectors)) {
+            bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+            qemu_mutex_unlock_iothread();
+
+            /* No read needed, queue the block for flush_blks directly */
+            blk->buf = NULL;
+            blk->ret = 0;
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done++;
+            blk_mig_unlock();
+
+            bmds->cur_sector = cur_sector + nr_sectors;
+            return (bmds->cur_sector >= total_sectors);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    blk->buf = g_malloc(BLOCK_SIZE);
+
     blk->iov.iov_base = blk->buf;
     blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
@@ -357,6 +405,7 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.bulk_cursor = NULL;
     block_mig_state.zero_blocks = migrate_zero_blocks();
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
@@ -393,27 +442,50 @@ static void init_blk_migration(QEMUFile *f)
     }
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Submits one chunk for the device after bulk_cursor, so that the bulk
+ * phase of all devices proceeds concurrently instead of one device
+ * after the other.
+ */
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
     int64_t completed_sector_sum = 0;
-    BlkMigDevState *bmds;
+    BlkMigDevState *bmds, *start;
     int progress;
     int ret = 0;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+    start = block_mig_state.bulk_cursor;
+    if (!start) {
+        start = QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+    }
+
+    bmds = start;
+    while (bmds) {
         if (bmds->bulk_completed == 0) {
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
             ret = 1;
             break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        bmds = QSIMPLEQ_NEXT(bmds, entry);
+        if (!bmds) {
+            bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+        }
+        if (bmds == start) {
+            break;
+        }
+    }
+
+    if (ret) {
+        block_mig_state.bulk_cursor = QSIMPLEQ_NEXT(bmds, entry);
+    }
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -52,3 +52,28 @@ void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
         stats->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 }
+
+const StatsField block_acct_stats_fields[BLOCK_ACCT_NR_STATS] = {
+    { "rd_bytes", STATS_KIND_CUMULATIVE },
+    { "wr_bytes", STATS_KIND_CUMULATIVE },
+    { "rd_operations", STATS_KIND_CUMULATIVE },
+    { "wr_operations", STATS_KIND_CUMULATIVE },
+    { "flush_operations", STATS_KIND_CUMULATIVE },
+    { "rd_total_time_ns", STATS_KIND_CUMULATIVE },
+    { "wr_total_time_ns", STATS_KIND_CUMULATIVE },
+    { "flush_total_time_ns", STATS_KIND_CUMULATIVE },
+    { "wr_highest_offset", STATS_KIND_INSTANT },
+};
+
+void block_acct_stats_values(const BlockAcctStats *stats, uint64_t *values)
+{
+    values[0] = stats->nr_bytes[BLOCK_ACCT_READ];
+    values[1] = stats->nr_bytes[BLOCK_ACCT_WRITE];
+    values[2] = stats->nr_ops[BLOCK_ACCT_READ];
+    values[3] = stats->nr_ops[BLOCK_ACCT_WRITE];
+    values[4] = stats->nr_ops[BLOCK_ACCT_FLUSH];
+    values[5] = stats->total_time_ns[BLOCK_ACCT_READ];
+    values[6] = stats->total_time_ns[BLOCK_ACCT_WRITE];
+    values[7] = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    values[8] = stats->wr_highest_sector * BDRV_SECTOR_SIZE;
+}
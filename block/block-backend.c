@@ -29,9 +29,12 @@ struct BlockBackend {
     /* TODO change to DeviceState when all users are qdevified */
     const BlockDevOps *dev_ops;
     void *dev_opaque;
+
+    StatsSource *stats;         /* "block.<name>" accounting counters */
 };
 
 static void drive_info_del(DriveInfo *dinfo);
+static void blk_stats_collect(void *opaque, uint64_t *values);
 
 /* All the BlockBackends (except for hidden ones) */
 static QTAILQ_HEAD(, BlockBackend) blk_backends =
@@ -47,6 +50,7 @@ static QTAILQ_HEAD(, BlockBackend) blk_backends =
 BlockBackend *blk_new(const char *name, Error **errp)
 {
     BlockBackend *blk;
+    char *prefix;
 
     assert(name && name[0]);
     if (!id_wellformed(name)) {
@@ -68,6 +72,11 @@ BlockBackend *blk_new(const char *name, Error **errp)
     blk->name = g_strdup(name);
     blk->refcnt = 1;
     QTAILQ_INSERT_TAIL(&blk_backends, blk, link);
+
+    prefix = g_strdup_printf("block.%s", name);
+    blk->stats = stats_register(prefix, block_acct_stats_fields,
+                                BLOCK_ACCT_NR_STATS, blk_stats_collect, blk);
+    g_free(prefix);
     return blk;
 }
 
@@ -95,6 +104,7 @@ static void blk_delete(BlockBackend *blk)
 {
     assert(!blk->refcnt);
     assert(!blk->dev);
+    stats_unregister(blk->stats);
     if (blk->bs) {
         assert(blk->bs->blk == blk);
         blk->bs->blk = NULL;
@@ -242,6 +252,8 @@ void blk_hide_on_behalf_of_do_drive_del(BlockBackend *blk)
 {
     QTAILQ_REMOVE(&blk_backends, blk, link);
     blk->name[0] = 0;
+    stats_unregister(blk->stats);
+    blk->stats = NULL;
     if (blk->bs) {
         bdrv_make_anon(blk->bs);
     }
@@ -624,6 +636,17 @@ BlockAcctStats *blk_get_stats(BlockBackend *blk)
     return bdrv_get_stats(blk->bs);
 }
 
+static void blk_stats_collect(void *opaque, uint64_t *values)
+{
+    BlockBackend *blk = opaque;
+
+    if (blk->bs) {
+        block_acct_stats_values(bdrv_get_stats(blk->bs), values);
+    } else {
+        memset(values, 0, BLOCK_ACCT_NR_STATS * sizeof(*values));
+    }
+}
+
 void *blk_aio_get(const AIOCBInfo *aiocb_info, BlockBackend *blk,
                   BlockCompletionFunc *cb, void *opaque)
 {
@@ -52,6 +52,7 @@
 #include "exec/ram_addr.h"
 
 #include "qemu/range.h"
+#include "qemu/rcu.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -118,13 +119,26 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+#define PHYS_CACHE_BITS 4
+#define PHYS_CACHE_SIZE (1 << PHYS_CACHE_BITS)
+
 struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
+    /* Direct-mapped cache of recent phys_page_find() results, indexed by
+     * page number.  It goes away together with the map, so there is
+     * nothing to invalidate when the memory topology changes.  Entries
+     * are single pointers, read and written atomically, so that lookups
+     * from several threads at once can race without harm; a hit is
+     * recognized by checking that the section covers the address.
+     */
+    MemoryRegionSection *cache[PHYS_CACHE_SIZE];
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -143,6 +157,7 @@ typedef struct subpage_t {
 static void io_mem_init(void);
 static void memory_map_init(void);
 static void tcg_commit(MemoryListener *listener);
+static AddressSpaceDispatch *mem_next_dispatch(AddressSpace *as);
 
 static MemoryRegion io_mem_watch;
 #endif
@@ -314,10 +329,24 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
+    hwaddr index = addr >> TARGET_PAGE_BITS;
+    MemoryRegionSection **entry = &d->cache[index & (PHYS_CACHE_SIZE - 1)];
     MemoryRegionSection *section;
     subpage_t *subpage;
 
-    section = phys_page_find(d->phys_map, addr, d->map.nodes, d->map.sections);
+    section = atomic_read(entry);
+    if (!section
+        || !range_covers_byte(section->offset_within_address_space,
+                              int128_get64(section->size), addr)) {
+        section = phys_page_find(d->phys_map, addr, d->map.nodes,
+                                 d->map.sections);
+        /* The dummy sections span the whole address space and cannot
+         * be checked with range_covers_byte(), so leave them out.
+         */
+        if (!section->size.hi) {
+            atomic_set(entry, section);
+        }
+    }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -366,7 +395,8 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     hwaddr len = *plen;
 
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -400,7 +430,9 @@ address_space_translate_for_iotlb(AddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
 {
     MemoryRegionSection *section;
-    section = address_space_translate_internal(as->dispatch, addr, xlat, plen, false);
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    section = address_space_translate_internal(d, addr, xlat, plen, false);
 
     assert(!section->mr->iommu_ops);
     return section;
@@ -845,16 +877,28 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 }
 
 /* Note: start and end must be within the same ram block.  */
-void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
-                                     unsigned client)
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
 {
-    if (length == 0)
-        return;
-    cpu_physical_memory_clear_dirty_range(start, length, client);
+    bool dirty;
+
+    if (length == 0) {
+        return false;
+    }
+    dirty = cpu_physical_memory_clear_dirty_range(start, length, client);
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, length);
     }
+    return dirty;
+}
+
+/* Note: start and end must be within the same ram block.  */
+void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
+                                     unsigned client)
+{
+    cpu_physical_memory_test_and_clear_dirty(start, length, client);
 }
 
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
@@ -1008,7 +1052,7 @@ static void register_multipage(AddressSpaceDispatch *d,
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
+    AddressSpaceDispatch *d = mem_next_dispatch(as);
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
@@ -1158,7 +1202,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, smp_cpus, NULL, 0);
     }
 
     block->fd = fd;
@@ -1905,12 +1949,20 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+/* The next dispatch map is only built for address spaces whose flat view
+ * changes in this transaction; all others keep their current map.
+ */
+static AddressSpaceDispatch *mem_next_dispatch(AddressSpace *as)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    AddressSpaceDispatch *d = as->next_dispatch;
     uint16_t n;
 
+    if (d) {
+        return d;
+    }
+
+    d = g_new0(AddressSpaceDispatch, 1);
+
     n = dummy_section(&d->map, as, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
     n = dummy_section(&d->map, as, &io_mem_notdirty);
@@ -1923,6 +1975,28 @@ static void mem_begin(MemoryListener *listener)
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
     as->next_dispatch = d;
+    return d;
+}
+
+static void mem_begin(MemoryListener *listener)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    as->next_dispatch = NULL;
+}
+
+static void mem_del(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    /* Removing the last section still needs an (empty) new map. */
+    mem_next_dispatch(as);
+}
+
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
 }
 
 static void mem_commit(MemoryListener *listener)
@@ -1931,13 +2005,16 @@ static void mem_commit(MemoryListener *listener)
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
+    if (!next) {
+        return;
+    }
+
     phys_page_compact_all(next, next->map.nodes_nb);
 
-    as->dispatch = next;
+    atomic_rcu_set(&as->dispatch, next);
 
     if (cur) {
-        phys_sections_free(&cur->map);
-        g_free(cur);
+        call_rcu(cur, address_space_dispatch_free, rcu);
     }
 }
 
@@ -1958,7 +2035,7 @@ static void tcg_commit(MemoryListener *listener)
     }
 }
 
-static void core_log_global_start(MemoryListener *listener)
+static void core_log_global_start(MemoryListener *listener, Error **errp)
 {
     cpu_physical_memory_set_dirty_tracking(true);
 }
@@ -1977,10 +2054,12 @@ static MemoryListener core_memory_listener = {
 void address_space_init_dispatch(AddressSpace *as)
 {
     as->dispatch = NULL;
+    as->next_dispatch = NULL;
     as->dispatch_listener = (MemoryListener) {
         .begin = mem_begin,
         .commit = mem_commit,
         .region_add = mem_add,
+        .region_del = mem_del,
         .region_nop = mem_add,
         .priority = 0,
     };
@@ -1992,8 +2071,10 @@ void address_space_destroy_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     memory_listener_unregister(&as->dispatch_listener);
-    g_free(d);
-    as->dispatch = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    if (d) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
 }
 
 static void memory_map_init(void)
@@ -2115,6 +2196,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     MemoryRegion *mr;
     bool error = false;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, is_write);
@@ -2193,6 +2275,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 
     return error;
 }
@@ -2228,6 +2311,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
     hwaddr addr1;
     MemoryRegion *mr;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, true);
@@ -2253,6 +2337,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -2330,12 +2415,14 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
     MemoryRegion *mr;
     hwaddr l, xlat;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &xlat, &l, is_write);
         if (!memory_access_is_direct(mr, is_write)) {
             l = memory_access_size(mr, l, addr);
             if (!memory_region_access_valid(mr, xlat, l, is_write)) {
+                rcu_read_unlock();
                 return false;
             }
         }
@@ -2343,6 +2430,7 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
         len -= l;
         addr += l;
     }
+    rcu_read_unlock();
     return true;
 }
 
@@ -94,24 +94,24 @@ static void handle_notify(EventNotifier *e)
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
 
     event_notifier_test_and_clear(&s->host_notifier);
+    virtio_queue_count_notification(s->vring.vq);
     blk_io_plug(s->conf->conf.blk);
     for (;;) {
         MultiReqBuffer mrb = {
             .num_writes = 0,
         };
-        int ret;
 
         /* Disable guest->host notifies to avoid unnecessary vmexits */
         vring_disable_notification(s->vdev, &s->vring);
 
         for (;;) {
-            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
+            VirtIOBlockReq *req;
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
-            if (ret < 0) {
-                virtio_blk_free_request(req);
+            req = vring_pop(s->vdev, &s->vring, sizeof(VirtIOBlockReq));
+            if (!req) {
                 break; /* no more requests */
             }
+            virtio_blk_init_request(vblk, req);
 
             trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
                                                         req->elem.in_num,
@@ -122,7 +122,7 @@ static void handle_notify(EventNotifier *e)
 
         virtio_submit_multiwrite(s->conf->conf.blk, &mrb);
 
-        if (likely(ret == -EAGAIN)) { /* vring emptied */
+        if (likely(!vring_is_broken(&s->vring))) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
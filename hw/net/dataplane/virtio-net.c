@@ -0,0 +1,637 @@
+/*
+ * Dedicated thread for virtio-net I/O processing
+ *
+ * Each active queue pair has its rx/tx virtqueues and the file descriptor
+ * of its tap backend serviced by the AioContext of an IOThread, outside
+ * the QEMU global mutex.  The control virtqueue stays in the main loop.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "virtio-net.h"
+#include "block/aio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/vhost_net.h"
+
+/* Maximum number of packets read from the tap device per callback */
+#define RX_BATCH 64
+
+typedef struct VirtIONetDataPlaneQueue {
+    VirtIONetDataPlane *s;
+    NetClientState *nc;             /* queue's NIC net client */
+    int fd;                         /* tap file descriptor */
+
+    Vring rx_vring;
+    Vring tx_vring;
+    EventNotifier *rx_guest_notifier;
+    EventNotifier *tx_guest_notifier;
+    EventNotifier rx_host_notifier;
+    EventNotifier tx_host_notifier;
+    QEMUBH *bh;                     /* bh for guest notification */
+    bool rx_notify;                 /* rx buffers used since the last irq */
+    bool tx_notify;                 /* tx buffers used since the last irq */
+
+    bool rx_waiting;                /* out of rx buffers, tap not polled */
+    size_t rx_len;                  /* packet in rx_buf, 0 if none */
+    uint8_t rx_buf[NET_BUFSIZE];
+
+    VirtQueueElement *tx_elem;      /* waiting for the tap to drain */
+    bool tx_error;                  /* a write error was reported */
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool disabled;
+
+    virtio_net_conf *conf;
+
+    VirtIODevice *vdev;
+    IOThread *iothread;
+    AioContext *ctx;
+
+    int queues;                     /* queue pairs in use while started */
+    VirtIONetDataPlaneQueue **vqs;
+};
+
+static void update_fd_handler(VirtIONetDataPlaneQueue *q);
+
+/* Packets are dropped while either end of the link is down, like
+ * qemu_deliver_packet() and qemu_net_queue_send_iov() do.
+ */
+static bool link_down(VirtIONetDataPlaneQueue *q)
+{
+    return q->nc->link_down || q->nc->peer->link_down;
+}
+
+/* Raise interrupts to signal guest, if necessary */
+static void notify_guest_bh(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIODevice *vdev = q->s->vdev;
+
+    if (q->rx_notify) {
+        q->rx_notify = false;
+        if (vring_should_notify(vdev, &q->rx_vring)) {
+            event_notifier_set(q->rx_guest_notifier);
+        }
+    }
+    if (q->tx_notify) {
+        q->tx_notify = false;
+        if (vring_should_notify(vdev, &q->tx_vring)) {
+            event_notifier_set(q->tx_guest_notifier);
+        }
+    }
+}
+
+/* Copy the packet in rx_buf to the guest.  Returns false, leaving the
+ * packet in place, if there are not enough receive buffers.
+ */
+static bool receive_packet(VirtIONetDataPlaneQueue *q)
+{
+    VirtIODevice *vdev = q->s->vdev;
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    size_t size = q->rx_len, room = 0, offset;
+    size_t needed = size - n->host_hdr_len + n->guest_hdr_len;
+    unsigned int i, num = 0;
+
+    if (!virtio_net_receive_filter(n, q->rx_buf, size)) {
+        q->rx_len = 0;
+        return true;
+    }
+
+    while (room < needed) {
+        VirtQueueElement *elem;
+
+        if (num == ARRAY_SIZE(elems) || (num && !n->mergeable_rx_bufs)) {
+            /* Truncated packet, drop it */
+            while (num) {
+                vring_discard(&q->rx_vring, elems[--num]);
+                g_free(elems[num]);
+            }
+            q->rx_len = 0;
+            return true;
+        }
+
+        elem = vring_pop(vdev, &q->rx_vring, sizeof(VirtQueueElement));
+        if (!elem) {
+            while (num) {
+                vring_discard(&q->rx_vring, elems[--num]);
+                g_free(elems[num]);
+            }
+            return false;
+        }
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+
+        elems[num++] = elem;
+        room += iov_size(elem->in_sg, elem->in_num);
+    }
+
+    virtio_net_receive_header(n, elems[0]->in_sg, elems[0]->in_num,
+                              q->rx_buf, size);
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        virtio_stw_p(vdev, &num_buffers, num);
+        iov_from_buf(elems[0]->in_sg, elems[0]->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    offset = n->host_hdr_len;
+    for (i = 0; i < num; i++) {
+        size_t guest_offset = i ? 0 : n->guest_hdr_len;
+        size_t len;
+
+        len = iov_from_buf(elems[i]->in_sg, elems[i]->in_num, guest_offset,
+                           q->rx_buf + offset, size - offset);
+        offset += len;
+        vring_fill(&q->rx_vring, elems[i], guest_offset + len, i);
+        g_free(elems[i]);
+    }
+    vring_flush(&q->rx_vring, num);
+    qemu_net_client_count_rx(q->nc, size);
+
+    q->rx_len = 0;
+    q->rx_notify = true;
+    qemu_bh_schedule(q->bh);
+    return true;
+}
+
+static void handle_rx(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIODevice *vdev = q->s->vdev;
+    int packets = 0;
+
+    while (packets < RX_BATCH) {
+        if (!q->rx_len) {
+            ssize_t len;
+
+            do {
+                len = read(q->fd, q->rx_buf, sizeof(q->rx_buf));
+            } while (len == -1 && errno == EINTR);
+            if (len <= 0) {
+                break;
+            }
+            q->rx_len = len;
+        }
+
+        if (link_down(q)) {
+            q->rx_len = 0;
+            packets++;
+            continue;
+        }
+
+        if (receive_packet(q)) {
+            packets++;
+            continue;
+        }
+
+        /* Wait for the guest to add buffers, unless it has snuck some in
+         * meanwhile.
+         */
+        if (vring_is_broken(&q->rx_vring) ||
+            vring_enable_notification(vdev, &q->rx_vring)) {
+            q->rx_waiting = true;
+            update_fd_handler(q);
+            break;
+        }
+        vring_disable_notification(vdev, &q->rx_vring);
+    }
+}
+
+static void handle_rx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx_host_notifier);
+
+    event_notifier_test_and_clear(e);
+    virtio_queue_count_notification(q->rx_vring.vq);
+    if (!q->rx_waiting) {
+        return;
+    }
+
+    vring_disable_notification(q->s->vdev, &q->rx_vring);
+    q->rx_waiting = false;
+    update_fd_handler(q);
+    handle_rx(q);
+}
+
+/* Write one guest packet to the tap device.  Returns the number of bytes
+ * written, 0 if the packet was dropped, or -1 with errno set.
+ */
+static ssize_t send_packet(VirtIONetDataPlaneQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = VIRTIO_NET(q->s->vdev);
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec *out_sg = elem->out_sg;
+    unsigned int out_num = elem->out_num;
+    ssize_t len;
+
+    if (link_down(q)) {
+        return 0;
+    }
+
+    /* Like virtio_net_flush_tx(), pass on only the part of the guest
+     * header that the tap device expects.
+     */
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        out_num = iov_copy(sg, ARRAY_SIZE(sg), elem->out_sg, elem->out_num,
+                           0, n->host_hdr_len);
+        out_num += iov_copy(sg + out_num, ARRAY_SIZE(sg) - out_num,
+                            elem->out_sg, elem->out_num,
+                            n->guest_hdr_len, -1);
+        out_sg = sg;
+    }
+
+    do {
+        len = writev(q->fd, out_sg, out_num);
+    } while (len == -1 && errno == EINTR);
+    return len;
+}
+
+/* Write out guest packets.  Returns false if the tap device is full. */
+static bool flush_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIODevice *vdev = q->s->vdev;
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    for (;;) {
+        VirtQueueElement *elem = q->tx_elem;
+        ssize_t len;
+
+        if (!elem) {
+            elem = vring_pop(vdev, &q->tx_vring, sizeof(VirtQueueElement));
+            if (!elem) {
+                return true;
+            }
+            if (elem->out_num < 1 ||
+                elem->out_sg[0].iov_len < n->guest_hdr_len) {
+                error_report("virtio-net header incorrect");
+                exit(1);
+            }
+            if (n->has_vnet_hdr) {
+                virtio_net_hdr_swap(vdev, elem->out_sg[0].iov_base);
+            }
+        }
+
+        len = send_packet(q, elem);
+        if (len == -1 && errno == EAGAIN) {
+            q->tx_elem = elem;
+            return false;
+        }
+        if (len == -1) {
+            /* The packet is lost, as when tap_write_packet() fails, but the
+             * buffer still goes back to the guest.  Only the first error of
+             * a series is reported.
+             */
+            if (!q->tx_error) {
+                error_report("virtio-net: failed to send packet: %s",
+                             strerror(errno));
+                q->tx_error = true;
+            }
+        } else if (len > 0) {
+            q->tx_error = false;
+            qemu_net_client_count_rx(q->nc->peer, len);
+        }
+
+        q->tx_elem = NULL;
+        vring_push(&q->tx_vring, elem, 0);
+        g_free(elem);
+
+        q->tx_notify = true;
+        qemu_bh_schedule(q->bh);
+    }
+}
+
+static void handle_tx(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIODevice *vdev = q->s->vdev;
+    bool waiting = q->tx_elem != NULL;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->tx_vring);
+
+        if (!flush_tx(q)) {
+            break; /* the tap fd becoming writable restarts processing */
+        }
+
+        /* Re-enable guest->host notifies and stop processing the vring.
+         * But if the guest has snuck in more descriptors, keep processing.
+         */
+        if (vring_is_broken(&q->tx_vring) ||
+            vring_enable_notification(vdev, &q->tx_vring)) {
+            break;
+        }
+    }
+
+    if (waiting != (q->tx_elem != NULL)) {
+        update_fd_handler(q);
+    }
+}
+
+static void handle_tx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx_host_notifier);
+
+    event_notifier_test_and_clear(e);
+    virtio_queue_count_notification(q->tx_vring.vq);
+    handle_tx(q);
+}
+
+static void update_fd_handler(VirtIONetDataPlaneQueue *q)
+{
+    aio_set_fd_handler(q->s->ctx, q->fd,
+                       q->rx_waiting ? NULL : handle_rx,
+                       q->tx_elem ? handle_tx : NULL,
+                       q);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetDataPlane *s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    *dataplane = NULL;
+
+    if (!conf->iothread) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_setg(errp, "iothread requires a tap network backend");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread is incompatible with vhost");
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->vdev = vdev;
+    s->conf = conf;
+    s->iothread = conf->iothread;
+    object_ref(OBJECT(s->iothread));
+    s->ctx = iothread_get_aio_context(s->iothread);
+
+    s->vqs = g_new0(VirtIONetDataPlaneQueue *, n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetDataPlaneQueue *q = g_new0(VirtIONetDataPlaneQueue, 1);
+
+        q->s = s;
+        q->nc = qemu_get_subqueue(n->nic, i);
+        q->bh = aio_bh_new(s->ctx, notify_guest_bh, q);
+        s->vqs[i] = q;
+    }
+
+    *dataplane = s;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    VirtIONet *n;
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    n = VIRTIO_NET(s->vdev);
+    virtio_net_data_plane_stop(s);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_bh_delete(s->vqs[i]->bh);
+        g_free(s->vqs[i]);
+    }
+    g_free(s->vqs);
+    object_unref(OBJECT(s->iothread));
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_start(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int queues = n->multiqueue ? n->curr_queues : 1;
+    int i, r;
+
+    if (s->started || s->disabled) {
+        return;
+    }
+
+    if (s->starting) {
+        return;
+    }
+
+    s->starting = true;
+
+    for (i = 0; i < queues; i++) {
+        if (!vring_setup(&s->vqs[i]->rx_vring, s->vdev, 2 * i)) {
+            goto fail_vring;
+        }
+        if (!vring_setup(&s->vqs[i]->tx_vring, s->vdev, 2 * i + 1)) {
+            vring_teardown(&s->vqs[i]->rx_vring, s->vdev, 2 * i);
+            goto fail_vring;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    /* Set up virtqueue notify */
+    for (r = 0; r < queues * 2; r++) {
+        if (k->set_host_notifier(qbus->parent, r, true) != 0) {
+            error_report("virtio-net failed to set host notifier");
+            goto fail_host_notifier;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetDataPlaneQueue *q = s->vqs[i];
+        VirtQueue *rx_vq = virtio_get_queue(s->vdev, 2 * i);
+        VirtQueue *tx_vq = virtio_get_queue(s->vdev, 2 * i + 1);
+        NetClientState *peer = q->nc->peer;
+
+        q->rx_guest_notifier = virtio_queue_get_guest_notifier(rx_vq);
+        q->tx_guest_notifier = virtio_queue_get_guest_notifier(tx_vq);
+        q->rx_host_notifier = *virtio_queue_get_host_notifier(rx_vq);
+        q->tx_host_notifier = *virtio_queue_get_host_notifier(tx_vq);
+
+        /* Packets queued in the net layer would be delivered out of
+         * order, drop them.  Then take the tap fd away from the main loop.
+         */
+        qemu_net_queue_purge(peer->incoming_queue, q->nc);
+        qemu_net_queue_purge(q->nc->incoming_queue, peer);
+        if (peer->info->poll) {
+            peer->info->poll(peer, false);
+        }
+        q->fd = tap_get_fd(peer);
+        q->rx_waiting = false;
+        q->rx_len = 0;
+    }
+
+    s->queues = queues;
+    s->starting = false;
+    s->started = true;
+    n->dataplane_started = true;
+    trace_virtio_net_data_plane_start(s, queues);
+
+    /* Get this show started by hooking up our callbacks */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetDataPlaneQueue *q = s->vqs[i];
+
+        vring_disable_notification(s->vdev, &q->rx_vring);
+        aio_set_event_notifier(s->ctx, &q->rx_host_notifier,
+                               handle_rx_notify);
+        aio_set_event_notifier(s->ctx, &q->tx_host_notifier,
+                               handle_tx_notify);
+        update_fd_handler(q);
+
+        /* Kick right away to begin processing packets already in vring */
+        event_notifier_set(&q->tx_host_notifier);
+    }
+    aio_context_release(s->ctx);
+    return;
+
+  fail_host_notifier:
+    while (--r >= 0) {
+        k->set_host_notifier(qbus->parent, r, false);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+  fail_guest_notifiers:
+    i = queues;
+  fail_vring:
+    while (--i >= 0) {
+        vring_teardown(&s->vqs[i]->tx_vring, s->vdev, 2 * i + 1);
+        vring_teardown(&s->vqs[i]->rx_vring, s->vdev, 2 * i);
+    }
+    s->disabled = true;
+    s->starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int i;
+
+    /* Better luck next time. */
+    if (s->disabled) {
+        s->disabled = false;
+        return;
+    }
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    aio_context_acquire(s->ctx);
+
+    /* Stop notifications for new packets from guest and tap */
+    for (i = 0; i < s->queues; i++) {
+        VirtIONetDataPlaneQueue *q = s->vqs[i];
+
+        aio_set_event_notifier(s->ctx, &q->rx_host_notifier, NULL);
+        aio_set_event_notifier(s->ctx, &q->tx_host_notifier, NULL);
+        aio_set_fd_handler(s->ctx, q->fd, NULL, NULL, NULL);
+        qemu_bh_cancel(q->bh);
+
+        /* Give the pending packet back to the ring so that the main loop
+         * pops it again, with its header as the guest wrote it.
+         */
+        if (q->tx_elem) {
+            virtio_net_hdr_swap(s->vdev, q->tx_elem->out_sg[0].iov_base);
+            vring_discard(&q->tx_vring, q->tx_elem);
+            g_free(q->tx_elem);
+            q->tx_elem = NULL;
+        }
+    }
+
+    aio_context_release(s->ctx);
+
+    for (i = 0; i < s->queues; i++) {
+        VirtIONetDataPlaneQueue *q = s->vqs[i];
+        NetClientState *peer = q->nc->peer;
+
+        /* Sync vring state back to virtqueue so that non-dataplane packet
+         * processing can continue when we disable the host notifiers below.
+         */
+        vring_teardown(&q->rx_vring, s->vdev, 2 * i);
+        vring_teardown(&q->tx_vring, s->vdev, 2 * i + 1);
+
+        if (peer->info->poll) {
+            peer->info->poll(peer, true);
+        }
+    }
+
+    for (i = 0; i < s->queues * 2; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->queues * 2, false);
+
+    n->dataplane_started = false;
+    s->started = false;
+    s->stopping = false;
+
+    /* A packet read from the tap device but not yet received goes through
+     * the net layer, which queues it if the guest has no buffers.
+     */
+    for (i = 0; i < s->queues; i++) {
+        VirtIONetDataPlaneQueue *q = s->vqs[i];
+
+        if (q->rx_len) {
+            qemu_send_packet(q->nc->peer, q->rx_buf, q->rx_len);
+            q->rx_len = 0;
+        }
+    }
+}
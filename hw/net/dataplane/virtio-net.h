@@ -0,0 +1,23 @@
+/*
+ * Dedicated thread for virtio-net I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+void virtio_net_data_plane_start(VirtIONetDataPlane *s);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
@@ -157,6 +157,14 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    /* vhost_net_start() sets the final value; vhost-user queue pairs share
+     * one connection and need to know it from the start.
+     */
+    if (options->backend_type == VHOST_BACKEND_TYPE_USER) {
+        net->dev.vq_index = net->nc->queue_index * net->dev.nvqs;
+    } else {
+        net->dev.vq_index = 0;
+    }
 
     r = vhost_dev_init(&net->dev, options->opaque,
                        options->backend_type, options->force);
@@ -189,6 +197,15 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
+int vhost_net_get_max_queues(VHostNetState *net)
+{
+    if (net->dev.vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER) {
+        return net->dev.max_queues;
+    }
+
+    return 1;
+}
+
 static void vhost_net_set_vq_index(struct vhost_net *net, int vq_index)
 {
     net->dev.vq_index = vq_index;
@@ -407,6 +424,11 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
+int vhost_net_get_max_queues(VHostNetState *net)
+{
+    return 1;
+}
+
 int vhost_net_start(VirtIODevice *dev,
                     NetClientState *ncs,
                     int total_queues)
@@ -24,6 +24,8 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "dataplane/virtio-net.h"
+#include "migration/migration.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -155,6 +157,26 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (virtio_net_started(n, status) &&
+        !qemu_get_queue(n->nic)->peer->link_down) {
+        virtio_net_data_plane_start(n->dataplane);
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
+}
+
+static void virtio_net_rx_notify(VirtIONetQueue *q)
+{
+    q->rx_notify_pending = true;
+    qemu_bh_schedule(q->rx_notify_bh);
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -163,6 +185,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -173,11 +196,16 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             queue_status = status;
         }
 
+        if (q->rx_notify_pending && vdev->vm_running) {
+            qemu_bh_schedule(q->rx_notify_bh);
+        }
+
         if (!q->tx_waiting) {
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !n->dataplane_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -783,6 +811,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
         return VIRTIO_NET_ERR;
     }
 
+    /* the data plane picks up the new number of queues when restarted */
+    if (n->dataplane) {
+        virtio_net_data_plane_stop(n->dataplane);
+    }
     n->curr_queues = queues;
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
@@ -796,22 +828,36 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    AioContext *ctx = NULL;
+
+    /* The data plane reads the receive filters and offloads */
+    if (n->dataplane) {
+        ctx = iothread_get_aio_context(n->net_conf.iothread);
+    }
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov_cnt = elem.out_num;
-        iov2 = iov = g_memdup(elem.out_sg, sizeof(struct iovec) * elem.out_num);
+        iov_cnt = elem->out_num;
+        iov2 = iov = g_memdup(elem->out_sg,
+                              sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+        if (ctx) {
+            aio_context_acquire(ctx);
+        }
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -827,23 +873,44 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        if (ctx) {
+            aio_context_release(ctx);
+        }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0,
+                         &status, sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
+        g_free(elem);
     }
 }
 
 /* RX */
 
+/* Without ioeventfd, e.g. under TCG, guest notifications still arrive here
+ * while the data plane owns the virtqueues.  Pass them on to it.
+ */
+static bool virtio_net_dataplane_kick(VirtIONet *n, VirtQueue *vq)
+{
+    if (!n->dataplane_started) {
+        return false;
+    }
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    return true;
+}
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+    if (virtio_net_dataplane_kick(n, vq)) {
+        return;
+    }
+
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -892,7 +959,7 @@ static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
     return 1;
 }
 
-static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
+void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
 {
     virtio_tswap16s(vdev, &hdr->hdr_len);
     virtio_tswap16s(vdev, &hdr->gso_size);
@@ -914,21 +981,27 @@ static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
+static bool is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+           (size > 27 && size < 1500) && /* normal sized MTU */
+           (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
+           (buf[23] == 17) && /* ip.protocol == UDP */
+           (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
 static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
                                         uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
-        (size > 27 && size < 1500) && /* normal sized MTU */
-        (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
-        (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
 }
 
-static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -946,7 +1019,7 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
     }
 }
 
-static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
+int virtio_net_receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 {
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
@@ -1016,19 +1089,20 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return 0;
     }
 
-    if (!receive_filter(n, buf, size))
+    if (!virtio_net_receive_filter(n, buf, size))
         return size;
 
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1039,21 +1113,22 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            virtio_net_receive_header(n, sg, elem->in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1062,7 +1137,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -1077,11 +1152,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            virtqueue_discard(q->rx_vq, elem, total);
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        g_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1092,11 +1170,256 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+
+    /* Backends deliver packets in bursts; notify the guest once the
+     * whole burst has been received rather than once per packet.
+     */
+    virtio_net_rx_notify(q);
 
     return size;
 }
 
+static void virtio_net_rx_notify_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    /* A stopped VM gets the notification when it runs again, possibly
+     * on the migration destination; see virtio_net_set_status().
+     */
+    if (!vdev->vm_running) {
+        return;
+    }
+    q->rx_notify_pending = false;
+
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+        !virtio_queue_ready(q->rx_vq)) {
+        return;
+    }
+    virtio_notify(vdev, q->rx_vq);
+}
+
+/* Copy between @buf and the buffers lent to the peer, viewed as a single
+ * stream that starts with the guest header.
+ */
+static size_t virtio_net_rx_loan_copy(VirtIONetQueue *q, size_t offset,
+                                      void *buf, size_t bytes, bool to_guest)
+{
+    size_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < q->rx_loan.num && done < bytes; i++) {
+        VirtQueueElement *elem = q->rx_loan.elems[i];
+        size_t esize = iov_size(elem->in_sg, elem->in_num);
+
+        if (offset >= esize) {
+            offset -= esize;
+            continue;
+        }
+        if (to_guest) {
+            done += iov_from_buf(elem->in_sg, elem->in_num, offset,
+                                 buf + done, bytes - done);
+        } else {
+            done += iov_to_buf(elem->in_sg, elem->in_num, offset,
+                               buf + done, bytes - done);
+        }
+        offset = 0;
+    }
+    return done;
+}
+
+/* Give back the buffers from index @first on, most recently popped first. */
+static void virtio_net_rx_loan_return(VirtIONetQueue *q, unsigned int first)
+{
+    while (q->rx_loan.num > first) {
+        VirtQueueElement *elem = q->rx_loan.elems[--q->rx_loan.num];
+
+        virtqueue_discard(q->rx_vq, elem, 0);
+        g_free(elem);
+    }
+}
+
+static int virtio_net_get_rx_buffers(NetClientState *nc, size_t hdr_len,
+                                     size_t size, struct iovec *iov,
+                                     int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    size_t hdr_skip, need;
+    int cnt = 0;
+
+    assert(q->rx_loan.num == 0);
+
+    /* The peer either writes the header the guest expects, or none at
+     * all and we fill it in.
+     */
+    if (!virtio_net_can_receive(nc) || hdr_len != n->host_hdr_len ||
+        (hdr_len && hdr_len != n->guest_hdr_len)) {
+        return 0;
+    }
+    hdr_skip = n->guest_hdr_len - hdr_len;
+
+    /* Once read, the packet cannot be queued for later anymore.  With
+     * mergeable buffers it may be a GSO frame of up to 64 KiB, so only
+     * lend buffers if the ring has room for that.
+     */
+    need = size + hdr_skip;
+    if (n->mergeable_rx_bufs) {
+        need = MAX(need, n->guest_hdr_len + (64 << 10));
+    }
+    if (!virtio_net_has_buffers(q, need)) {
+        return 0;
+    }
+
+    q->rx_loan.size = 0;
+    do {
+        VirtQueueElement *elem;
+        size_t skip = q->rx_loan.num ? 0 : hdr_skip;
+        size_t esize;
+
+        if (q->rx_loan.num == ARRAY_SIZE(q->rx_loan.elems)) {
+            break;
+        }
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+
+        esize = iov_size(elem->in_sg, elem->in_num);
+        if (esize <= skip || cnt + elem->in_num > iovcnt) {
+            virtqueue_discard(q->rx_vq, elem, 0);
+            g_free(elem);
+            break;
+        }
+
+        q->rx_loan.elems[q->rx_loan.num++] = elem;
+        cnt += iov_copy(iov + cnt, iovcnt - cnt, elem->in_sg, elem->in_num,
+                        skip, -1);
+        q->rx_loan.size += esize - skip;
+    } while (n->mergeable_rx_bufs && q->rx_loan.size < size);
+
+    if (!cnt) {
+        virtio_net_rx_loan_return(q, 0);
+    }
+    return cnt;
+}
+
+static void virtio_net_put_rx_buffers(NetClientState *nc, size_t len,
+                                      const uint8_t *spill)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    size_t hdr_skip = n->guest_hdr_len - n->host_hdr_len;
+    uint8_t peek[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 36] = { };
+    size_t total, frame_len, offset;
+    unsigned int i, used;
+
+    if (len <= n->host_hdr_len) {
+        virtio_net_rx_loan_return(q, 0);
+        return;
+    }
+
+    /* Move whatever did not fit in the lent buffers to further ones */
+    if (len > q->rx_loan.size) {
+        size_t done = 0;
+
+        if (!n->mergeable_rx_bufs) {
+            /* Truncated non-mergeable packet, drop it */
+            virtio_net_rx_loan_return(q, 0);
+            return;
+        }
+        while (done < len - q->rx_loan.size) {
+            VirtQueueElement *elem = NULL;
+
+            if (q->rx_loan.num < ARRAY_SIZE(q->rx_loan.elems)) {
+                elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+            }
+            if (!elem) {
+                /* Only if the guest reset the ring meanwhile */
+                virtio_net_rx_loan_return(q, 0);
+                return;
+            }
+            q->rx_loan.elems[q->rx_loan.num++] = elem;
+            done += iov_from_buf(elem->in_sg, elem->in_num, 0, spill + done,
+                                 len - q->rx_loan.size - done);
+        }
+    }
+
+    total = hdr_skip + len;
+    frame_len = len - n->host_hdr_len;
+
+    /* The filter and the header fixups only need the start of the frame */
+    virtio_net_rx_loan_copy(q, hdr_skip, peek,
+                            n->host_hdr_len + MIN(frame_len, 36), false);
+    if (!virtio_net_receive_filter(n, peek, len)) {
+        virtio_net_rx_loan_return(q, 0);
+        return;
+    }
+
+    if (n->has_vnet_hdr) {
+        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)peek;
+
+        if (is_broken_dhclient_packet(hdr, peek + n->host_hdr_len,
+                                      frame_len)) {
+            uint8_t *frame = g_malloc(frame_len);
+
+            virtio_net_rx_loan_copy(q, n->guest_hdr_len, frame, frame_len,
+                                    false);
+            work_around_broken_dhclient(hdr, frame, frame_len);
+            virtio_net_rx_loan_copy(q, n->guest_hdr_len, frame, frame_len,
+                                    true);
+            g_free(frame);
+        }
+        virtio_net_hdr_swap(vdev, hdr);
+        virtio_net_rx_loan_copy(q, 0, hdr, sizeof(*hdr), true);
+    } else {
+        struct virtio_net_hdr hdr = {
+            .flags = 0,
+            .gso_type = VIRTIO_NET_HDR_GSO_NONE
+        };
+        virtio_net_rx_loan_copy(q, 0, &hdr, sizeof(hdr), true);
+    }
+
+    /* Return the buffers that the packet did not need */
+    offset = 0;
+    for (used = 0; offset < total; used++) {
+        VirtQueueElement *elem = q->rx_loan.elems[used];
+
+        offset += iov_size(elem->in_sg, elem->in_num);
+    }
+    virtio_net_rx_loan_return(q, used);
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        virtio_stw_p(vdev, &num_buffers, used);
+        virtio_net_rx_loan_copy(q,
+                                offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                         num_buffers),
+                                &num_buffers, sizeof(num_buffers), true);
+    }
+
+    offset = 0;
+    for (i = 0; i < used; i++) {
+        VirtQueueElement *elem = q->rx_loan.elems[i];
+        size_t fill = MIN(iov_size(elem->in_sg, elem->in_num),
+                          total - offset);
+
+        virtqueue_fill(q->rx_vq, elem, fill, i);
+        offset += fill;
+        g_free(elem);
+    }
+    q->rx_loan.num = 0;
+
+    virtqueue_flush(q->rx_vq, used);
+    virtio_net_rx_notify(q);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1105,37 +1428,54 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    g_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
 /* TX */
+static void virtio_net_tx_flush_used(VirtIONetQueue *q, int32_t num_packets)
+{
+    if (num_packets) {
+        virtqueue_flush(q->tx_vq, num_packets);
+        virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    for (;;) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+        unsigned int out_num;
+        struct iovec sg[VIRTQUEUE_MAX_SIZE], *out_sg;
+
+        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        out_num = elem->out_num;
+        out_sg = elem->out_sg;
 
         if (out_num < 1) {
             error_report("virtio-net header not in first element");
@@ -1175,18 +1515,21 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            virtio_net_tx_flush_used(q, num_packets);
             return -EBUSY;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        /* Completed buffers are returned to the guest once per burst */
+        virtqueue_fill(q->tx_vq, elem, 0, num_packets);
+        g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_flush_used(q, num_packets);
     return num_packets;
 }
 
@@ -1195,6 +1538,10 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    if (virtio_net_dataplane_kick(n, vq)) {
+        return;
+    }
+
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
         q->tx_waiting = 1;
@@ -1219,6 +1566,10 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    if (virtio_net_dataplane_kick(n, vq)) {
+        return;
+    }
+
     if (unlikely(q->tx_waiting)) {
         return;
     }
@@ -1254,6 +1605,26 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
+/* In adaptive mode, follow the depth of the tx queue: grow the burst while
+ * the guest keeps it full so that fewer bottom halves and guest kicks are
+ * needed, and shrink it again when the queue drains to return to the main
+ * loop sooner.
+ */
+static void virtio_net_tx_adapt_burst(VirtIONetQueue *q, int32_t sent)
+{
+    VirtIONet *n = q->n;
+
+    if (!n->tx_adaptive) {
+        return;
+    }
+
+    if (sent >= q->tx_burst) {
+        q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst);
+    } else if (sent < q->tx_burst / 4) {
+        q->tx_burst = MAX(q->tx_burst / 2, MIN(TX_BURST_MIN, n->tx_burst));
+    }
+}
+
 static void virtio_net_tx_bh(void *opaque)
 {
     VirtIONetQueue *q = opaque;
@@ -1282,11 +1653,13 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= q->tx_burst) {
+        virtio_net_tx_adapt_burst(q, ret);
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
     }
+    virtio_net_tx_adapt_burst(q, ret);
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
@@ -1299,6 +1672,14 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_init_tx_queue(VirtIONet *n, VirtIONetQueue *q)
+{
+    q->tx_waiting = 0;
+    q->tx_burst = n->tx_adaptive ? MIN(TX_BURST_MIN, n->tx_burst)
+                                 : n->tx_burst;
+    q->n = n;
+}
+
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1324,8 +1705,7 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
             n->vqs[i].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[i]);
         }
 
-        n->vqs[i].tx_waiting = 0;
-        n->vqs[i].n = n;
+        virtio_net_init_tx_queue(n, &n->vqs[i]);
     }
 
     /* Note: Minux Guests (version 3.2.1) use ctrl vq but don't ack
@@ -1498,6 +1878,13 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     virtio_net_set_queues(n);
 
+    /* A notification still pending on the source is not migrated; notify
+     * every queue once the VM runs here.
+     */
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_notify_pending = true;
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -1534,6 +1921,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .get_rx_buffers = virtio_net_get_rx_buffers,
+    .put_rx_buffers = virtio_net_put_rx_buffers,
     .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
@@ -1583,29 +1972,69 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+/* Disable dataplane thread during live migration since it does not
+ * update the dirty memory bitmap.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+    Error *err = NULL;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(vdev, &n->net_conf, &n->dataplane,
+                                     &err);
+        if (err != NULL) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+        virtio_net_set_status(vdev, vdev->status);
+    }
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_notify_bh = qemu_bh_new(virtio_net_rx_notify_bh,
+                                             &n->vqs[i]);
+    }
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
     n->vqs[0].n = n;
     n->tx_timeout = n->net_conf.txtimer;
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
-                       && strcmp(n->net_conf.tx, "bh")) {
+                       && strcmp(n->net_conf.tx, "bh")
+                       && strcmp(n->net_conf.tx, "adaptive")) {
         error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                     n->net_conf.tx);
+                     "Unknown option tx=%s, valid options: \"timer\" \"bh\" "
+                     "\"adaptive\"", n->net_conf.tx);
         error_report("Defaulting to \"bh\"");
     }
+    n->tx_adaptive = n->net_conf.tx && !strcmp(n->net_conf.tx, "adaptive");
 
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[0].tx_vq = virtio_add_queue(vdev, 256,
@@ -1647,8 +2076,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
-    n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
+    virtio_net_init_tx_queue(n, &n->vqs[0]);
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1659,6 +2088,28 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    virtio_net_data_plane_create(vdev, &n->net_conf, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        g_free(n->mac_table.macs);
+        g_free(n->vlans);
+        timer_free(n->announce_timer);
+        for (i = 0; i < n->max_queues; i++) {
+            qemu_bh_delete(n->vqs[i].rx_notify_bh);
+        }
+        if (n->vqs[0].tx_timer) {
+            timer_free(n->vqs[0].tx_timer);
+        } else {
+            qemu_bh_delete(n->vqs[0].tx_bh);
+        }
+        g_free(n->vqs);
+        qemu_del_nic(n->nic);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+
     n->qdev = dev;
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
@@ -1673,6 +2124,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+
     unregister_savevm(dev, "virtio-net", n);
 
     g_free(n->netclient_name);
@@ -1688,6 +2143,9 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         qemu_purge_queued_packets(nc);
+        g_free(q->async_tx.elem);
+        q->async_tx.elem = NULL;
+        qemu_bh_delete(q->rx_notify_bh);
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1713,6 +2171,10 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
@@ -70,6 +70,7 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     void *vring_ptr;
 
     vring->broken = false;
+    vring->vq = virtio_get_queue(vdev, n);
 
     vring_ptr = vring_map(&vring->mr, vring_addr, vring_size, true);
     if (!vring_ptr) {
@@ -124,7 +125,7 @@ bool vring_enable_notification(VirtIODevice *vdev, Vring *vring)
 }
 
 /* This is stolen from linux/drivers/vhost/vhost.c:vhost_notify() */
-bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
+static bool vring_needs_notify(VirtIODevice *vdev, Vring *vring)
 {
     uint16_t old, new;
     bool v;
@@ -153,42 +154,43 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
     return vring_need_event(vring_used_event(&vring->vr), new, old);
 }
 
+/* Callers raise the guest interrupt if this returns true */
+bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
+{
+    if (!vring_needs_notify(vdev, vring)) {
+        return false;
+    }
+    virtio_queue_count_interrupt(vring->vq);
+    return true;
+}
+
 
-static int get_desc(Vring *vring, VirtQueueElement *elem,
+static int get_desc(Vring *vring, struct iovec *iov, hwaddr *addr,
+                    unsigned int *out_num, unsigned int *in_num,
                     struct vring_desc *desc)
 {
-    unsigned *num;
-    struct iovec *iov;
-    hwaddr *addr;
+    unsigned int n = *out_num + *in_num;
     MemoryRegion *mr;
 
-    if (desc->flags & VRING_DESC_F_WRITE) {
-        num = &elem->in_num;
-        iov = &elem->in_sg[*num];
-        addr = &elem->in_addr[*num];
-    } else {
-        num = &elem->out_num;
-        iov = &elem->out_sg[*num];
-        addr = &elem->out_addr[*num];
-
+    if (!(desc->flags & VRING_DESC_F_WRITE)) {
         /* If it's an output descriptor, they're all supposed
          * to come before any input descriptors. */
-        if (unlikely(elem->in_num)) {
+        if (unlikely(*in_num)) {
             error_report("Descriptor has out after in");
             return -EFAULT;
         }
     }
 
     /* Stop for now if there are not enough iovecs available. */
-    if (*num >= VIRTQUEUE_MAX_SIZE) {
-        error_report("Invalid SG num: %u", *num);
+    if (n >= VIRTQUEUE_MAX_SIZE) {
+        error_report("Invalid SG num: %u", n);
         return -EFAULT;
     }
 
     /* TODO handle non-contiguous memory across region boundaries */
-    iov->iov_base = vring_map(&mr, desc->addr, desc->len,
-                              desc->flags & VRING_DESC_F_WRITE);
-    if (!iov->iov_base) {
+    iov[n].iov_base = vring_map(&mr, desc->addr, desc->len,
+                                desc->flags & VRING_DESC_F_WRITE);
+    if (!iov[n].iov_base) {
         error_report("Failed to map descriptor addr %#" PRIx64 " len %u",
                      (uint64_t)desc->addr, desc->len);
         return -EFAULT;
@@ -196,14 +198,19 @@ static int get_desc(Vring *vring, VirtQueueElement *elem,
 
     /* The MemoryRegion is looked up again and unref'ed later, leave the
      * ref in place.  */
-    iov->iov_len = desc->len;
-    *addr = desc->addr;
-    *num += 1;
+    iov[n].iov_len = desc->len;
+    addr[n] = desc->addr;
+    if (desc->flags & VRING_DESC_F_WRITE) {
+        *in_num += 1;
+    } else {
+        *out_num += 1;
+    }
     return 0;
 }
 
 /* This is stolen from linux/drivers/vhost/vhost.c. */
-static int get_indirect(Vring *vring, VirtQueueElement *elem,
+static int get_indirect(Vring *vring, struct iovec *iov, hwaddr *addr,
+                        unsigned int *out_num, unsigned int *in_num,
                         struct vring_desc *indirect)
 {
     struct vring_desc desc;
@@ -263,7 +270,7 @@ static int get_indirect(Vring *vring, VirtQueueElement *elem,
             return -EFAULT;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, iov, addr, out_num, in_num, &desc);
         if (ret < 0) {
             vring->broken |= (ret == -EFAULT);
             return ret;
@@ -273,7 +280,8 @@ static int get_indirect(Vring *vring, VirtQueueElement *elem,
     return 0;
 }
 
-static void vring_unmap_element(VirtQueueElement *elem)
+static void vring_unmap_iovecs(struct iovec *iov, unsigned int out_num,
+                               unsigned int in_num)
 {
     int i;
 
@@ -281,6 +289,19 @@ static void vring_unmap_element(VirtQueueElement *elem)
      * the end of the valid area.  This is true if iovec manipulations
      * are done with iov_discard_front and iov_discard_back.
      */
+    for (i = 0; i < out_num; i++) {
+        vring_unmap(iov[i].iov_base, false);
+    }
+
+    for (i = out_num; i < out_num + in_num; i++) {
+        vring_unmap(iov[i].iov_base, true);
+    }
+}
+
+static void vring_unmap_element(VirtQueueElement *elem)
+{
+    int i;
+
     for (i = 0; i < elem->out_num; i++) {
         vring_unmap(elem->out_sg[i].iov_base, false);
     }
@@ -295,23 +316,23 @@ static void vring_unmap_element(VirtQueueElement *elem)
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * This function returns a newly allocated element of @sz bytes, sized to
+ * the number of descriptors found, or NULL if none was found or on error.
+ * After a fatal error, the vring is marked as broken.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VirtQueueElement *elem = NULL;
+    unsigned int out_num = 0, in_num = 0;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
     int ret;
 
-    /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
-
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
         ret = -EFAULT;
@@ -343,8 +364,6 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring->vr.avail->ring[last_avail_idx % num];
 
-    elem->index = head;
-
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
         error_report("Guest says index %u > %u is available", head, num);
@@ -371,14 +390,14 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vring, elem, &desc);
+            ret = get_indirect(vring, iov, addr, &out_num, &in_num, &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, iov, addr, &out_num, &in_num, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -388,30 +407,51 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
 
     /* On success, increment avail index. */
     vring->last_avail_idx++;
+    virtio_queue_count_descriptors(vring->vq, out_num + in_num);
     if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(&vring->vr) = vring->last_avail_idx;
     }
 
-    return head;
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+        elem->out_addr[i] = addr[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+        elem->in_addr[i] = addr[out_num + i];
+    }
+
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
+    vring_unmap_iovecs(iov, out_num, in_num);
+    return NULL;
+}
+
+/* Give back the most recently popped element so that it is returned again
+ * by the next vring_pop().  Elements must be discarded in reverse order.
+ */
+void vring_discard(Vring *vring, VirtQueueElement *elem)
+{
     vring_unmap_element(elem);
-    return ret;
+    vring->last_avail_idx--;
 }
 
-/* After we've used one of their buffers, we tell them about it.
- *
- * Stolen from linux/drivers/vhost/vhost.c.
+/* Record @elem as used at position @idx past the used index, without making
+ * it visible to the guest until vring_flush().
  */
-void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx)
 {
     struct vring_used_elem *used;
     unsigned int head = elem->index;
-    uint16_t new;
 
     vring_unmap_element(elem);
 
@@ -422,15 +462,39 @@ void vring_push(Vring *vring, VirtQueueElement *elem, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used = &vring->vr.used->ring[(vring->last_used_idx + idx) %
+                                 vring->vr.num];
     used->id = head;
     used->len = len;
+}
+
+/* Publish @count elements recorded with vring_fill() */
+void vring_flush(Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    /* Don't touch vring if a fatal error occurred */
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx += count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+/* After we've used one of their buffers, we tell them about it.
+ *
+ * Stolen from linux/drivers/vhost/vhost.c.
+ */
+void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+{
+    vring_fill(vring, elem, len, 0);
+    vring_flush(vring, 1);
+}
@@ -13,6 +13,7 @@
 #include "qemu/error-report.h"
 
 #include <sys/ioctl.h>
+#include <linux/vhost.h>
 
 static int vhost_kernel_call(struct vhost_dev *dev, unsigned long int request,
                              void *arg)
@@ -42,11 +43,32 @@ static int vhost_kernel_cleanup(struct vhost_dev *dev)
     return close(fd);
 }
 
+static int vhost_kernel_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    return idx - dev->vq_index;
+}
+
+static int vhost_kernel_set_log_base(struct vhost_dev *dev, uint64_t base,
+                                     uint64_t size, int fd)
+{
+    return vhost_kernel_call(dev, VHOST_SET_LOG_BASE, &base) < 0 ? -errno : 0;
+}
+
+static bool vhost_kernel_requires_shm_log(struct vhost_dev *dev)
+{
+    return false;
+}
+
 static const VhostOps kernel_ops = {
         .backend_type = VHOST_BACKEND_TYPE_KERNEL,
         .vhost_call = vhost_kernel_call,
         .vhost_backend_init = vhost_kernel_init,
-        .vhost_backend_cleanup = vhost_kernel_cleanup
+        .vhost_backend_cleanup = vhost_kernel_cleanup,
+        .vhost_backend_get_vq_index = vhost_kernel_get_vq_index,
+        .vhost_backend_set_log_base = vhost_kernel_set_log_base,
+        .vhost_requires_shm_log = vhost_kernel_requires_shm_log
 };
 
 int vhost_set_backend_type(struct vhost_dev *dev, VhostBackendType backend_type)
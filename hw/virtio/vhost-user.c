@@ -24,6 +24,14 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ        0
+#define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +49,9 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -57,6 +68,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -71,6 +87,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserLog log;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -104,7 +121,10 @@ static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
     VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
     VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
     VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
-    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+    VHOST_SET_VRING_ERR,    /* VHOST_USER_SET_VRING_ERR */
+    -1,                     /* VHOST_USER_GET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_SET_PROTOCOL_FEATURES */
+    -1                      /* VHOST_USER_GET_QUEUE_NUM */
 };
 
 static VhostUserRequest vhost_user_request_translate(unsigned long int request)
@@ -120,6 +140,28 @@ static VhostUserRequest vhost_user_request_translate(unsigned long int request)
     return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
 }
 
+/* With several queue pairs sharing one connection, each pair has its own
+ * vhost_dev.  Requests that apply to the whole connection are only sent
+ * by the first of them. */
+static bool vhost_user_one_time_request(VhostUserRequest request)
+{
+    switch (request) {
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_SET_LOG_BASE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool vhost_user_has_protocol_feature(struct vhost_dev *dev,
+                                            unsigned int feature)
+{
+    return dev->protocol_features & (1ULL << feature);
+}
+
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
     CharDriverState *chr = dev->opaque;
@@ -194,6 +236,10 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     msg_request = vhost_user_request_translate(request);
+    if (vhost_user_one_time_request(msg_request) && dev->vq_index != 0) {
+        return 0;
+    }
+
     msg.request = msg_request;
     msg.flags = VHOST_USER_VERSION;
     msg.size = 0;
@@ -204,8 +250,9 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
 
     case VHOST_SET_FEATURES:
-    case VHOST_SET_LOG_BASE:
         msg.u64 = *((__u64 *) arg);
+        /* Keep the protocol feature extension enabled if it was offered */
+        msg.u64 |= dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
         msg.size = sizeof(m.u64);
         break;
 
@@ -307,6 +354,11 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
                 return -1;
             }
             *((__u64 *) arg) = msg.u64;
+            /* Dirty pages can only be reported through a shared log */
+            if (!vhost_user_has_protocol_feature(dev,
+                                    VHOST_USER_PROTOCOL_F_LOG_SHMFD)) {
+                *((__u64 *) arg) &= ~(1ULL << VHOST_F_LOG_ALL);
+            }
             break;
         case VHOST_USER_GET_VRING_BASE:
             if (msg.size != sizeof(m.state)) {
@@ -325,11 +377,86 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     return 0;
 }
 
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0 ||
+        vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d\n", request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.\n");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .u64 = u64,
+        .size = sizeof(m.u64),
+    };
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    uint64_t features, queues;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     dev->opaque = opaque;
+    dev->protocol_features = 0;
+    dev->max_queues = 1;
+
+    if (vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features) < 0) {
+        return -1;
+    }
+
+    if (!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    if (vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                           &features) < 0) {
+        return -1;
+    }
+
+    dev->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+    if (vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                           dev->protocol_features) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_MQ)) {
+        if (vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM, &queues) < 0) {
+            return -1;
+        }
+        if (queues == 0) {
+            error_report("vhost-user slave reported no queue pairs");
+            return -1;
+        }
+        dev->max_queues = queues;
+    }
 
     return 0;
 }
@@ -343,9 +470,68 @@ static int vhost_user_cleanup(struct vhost_dev *dev)
     return 0;
 }
 
+static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    /* All queue pairs share the connection, so rings use global indices */
+    return idx;
+}
+
+static int vhost_user_set_log_base(struct vhost_dev *dev, uint64_t base,
+                                   uint64_t size, int fd)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_LOG_BASE,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.log),
+    };
+
+    /* The slave logs every queue into the first queue pair's log */
+    if (dev->vq_index != 0) {
+        return 0;
+    }
+
+    if (fd < 0 ||
+        !vhost_user_has_protocol_feature(dev,
+                                         VHOST_USER_PROTOCOL_F_LOG_SHMFD)) {
+        error_report("vhost-user slave cannot share a dirty log\n");
+        return -ENOTSUP;
+    }
+
+    msg.log.mmap_size = size * sizeof(vhost_log_chunk_t);
+    msg.log.mmap_offset = 0;
+    if (vhost_user_write(dev, &msg, &fd, 1) < 0) {
+        return -EIO;
+    }
+
+    /* Wait until the slave has switched logs, the old one is freed next */
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -EIO;
+    }
+
+    if (msg.request != VHOST_USER_SET_LOG_BASE) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d\n",
+                     VHOST_USER_SET_LOG_BASE, msg.request);
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+static bool vhost_user_requires_shm_log(struct vhost_dev *dev)
+{
+    /* Only the first queue pair's log is visible to the slave */
+    return dev->vq_index == 0;
+}
+
 const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_get_vq_index = vhost_user_get_vq_index,
+        .vhost_backend_set_log_base = vhost_user_set_log_base,
+        .vhost_requires_shm_log = vhost_user_requires_shm_log
         };
@@ -17,7 +17,9 @@
 #include "hw/hw.h"
 #include "qemu/atomic.h"
 #include "qemu/range.h"
+#include "qemu/error-report.h"
 #include <linux/vhost.h>
+#include <sys/mman.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
@@ -281,23 +283,112 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
-static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
+/* Allocate a zeroed log of @size chunks in @log.  Backends living in
+ * another process get it from a shared mapping whose file descriptor is
+ * returned in @fd; otherwise @fd is set to -1.  Returns 0 or -errno. */
+static int vhost_log_alloc(struct vhost_dev *dev, uint64_t size,
+                           vhost_log_chunk_t **log, int *fd)
+{
+    uint64_t logsize = size * sizeof(vhost_log_chunk_t);
+    char *fname;
+    void *map;
+    int r;
+
+    *log = NULL;
+    *fd = -1;
+    if (!size) {
+        return 0;
+    }
+    if (!dev->vhost_ops->vhost_requires_shm_log(dev)) {
+        *log = g_malloc0(logsize);
+        return 0;
+    }
+
+    fname = g_strdup_printf("%s/vhost-log.XXXXXX", g_get_tmp_dir());
+    *fd = mkstemp(fname);
+    if (*fd < 0) {
+        r = -errno;
+        error_report("vhost: cannot create dirty log file: %s",
+                     strerror(errno));
+        g_free(fname);
+        return r;
+    }
+    unlink(fname);
+    g_free(fname);
+
+    /* A freshly truncated file reads as zeroes */
+    if (ftruncate(*fd, logsize) < 0) {
+        r = -errno;
+        error_report("vhost: cannot size dirty log: %s", strerror(errno));
+        goto fail;
+    }
+    map = mmap(NULL, logsize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        r = -errno;
+        error_report("vhost: cannot map dirty log: %s", strerror(errno));
+        goto fail;
+    }
+    *log = map;
+    return 0;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return r;
+}
+
+static void vhost_log_free(vhost_log_chunk_t *log, uint64_t size, int fd)
+{
+    if (fd < 0) {
+        g_free(log);
+        return;
+    }
+    munmap(log, size * sizeof(vhost_log_chunk_t));
+    close(fd);
+}
+
+static int vhost_dev_set_log_base(struct vhost_dev *dev,
+                                  vhost_log_chunk_t *log,
+                                  uint64_t size, int fd)
+{
+    uint64_t log_base = (uint64_t)(unsigned long)log;
+
+    return dev->vhost_ops->vhost_backend_set_log_base(dev, log_base,
+                                                      size, fd);
+}
+
+static int vhost_dev_log_resize(struct vhost_dev *dev, uint64_t size)
 {
     vhost_log_chunk_t *log;
-    uint64_t log_base;
+    int log_fd;
     int r;
 
-    log = g_malloc0(size * sizeof *log);
-    log_base = (uint64_t)(unsigned long)log;
-    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
-    assert(r >= 0);
+    r = vhost_log_alloc(dev, size, &log, &log_fd);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_dev_set_log_base(dev, log, size, log_fd);
+    if (r < 0) {
+        vhost_log_free(log, size, log_fd);
+        return r;
+    }
     /* Sync only the range covered by the old log */
     if (dev->log_size) {
         vhost_log_sync_range(dev, 0, dev->log_size * VHOST_LOG_CHUNK - 1);
     }
-    g_free(dev->log);
+    vhost_log_free(dev->log, dev->log_size, dev->log_fd);
     dev->log = log;
     dev->log_size = size;
+    dev->log_fd = log_fd;
+    return 0;
+}
+
+static void vhost_dev_log_release(struct vhost_dev *dev)
+{
+    vhost_log_free(dev->log, dev->log_size, dev->log_fd);
+    dev->log = NULL;
+    dev->log_size = 0;
+    dev->log_fd = -1;
 }
 
 static int vhost_verify_ring_mappings(struct vhost_dev *dev,
@@ -469,11 +560,13 @@ static void vhost_commit(MemoryListener *listener)
 #define VHOST_LOG_BUFFER (0x1000 / sizeof *dev->log)
     /* To log more, must increase log size before table update. */
     if (dev->log_size < log_size) {
-        vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+        r = vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+        assert(r >= 0);
     }
     r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
-    /* To log less, can only decrease log size after table update. */
+    /* To log less, can only decrease log size after table update.  If
+     * that fails, the larger log simply stays. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
         vhost_dev_log_resize(dev, log_size);
     }
@@ -601,13 +694,15 @@ static int vhost_migration_log(MemoryListener *listener, int enable)
         if (r < 0) {
             return r;
         }
-        g_free(dev->log);
-        dev->log = NULL;
-        dev->log_size = 0;
+        vhost_dev_log_release(dev);
     } else {
-        vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        r = vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        if (r < 0) {
+            return r;
+        }
         r = vhost_dev_set_log(dev, true);
         if (r < 0) {
+            vhost_dev_log_release(dev);
             return r;
         }
     }
@@ -615,13 +710,13 @@ static int vhost_migration_log(MemoryListener *listener, int enable)
     return 0;
 }
 
-static void vhost_log_global_start(MemoryListener *listener)
+static void vhost_log_global_start(MemoryListener *listener, Error **errp)
 {
     int r;
 
     r = vhost_migration_log(listener, true);
     if (r < 0) {
-        abort();
+        error_setg_errno(errp, -r, "vhost: cannot start dirty logging");
     }
 }
 
@@ -654,7 +749,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 {
     hwaddr s, l, a;
     int r;
-    int vhost_vq_index = idx - dev->vq_index;
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_file file = {
         .index = vhost_vq_index
     };
@@ -747,11 +842,11 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
                                     struct vhost_virtqueue *vq,
                                     unsigned idx)
 {
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_state state = {
-        .index = idx - dev->vq_index
+        .index = vhost_vq_index
     };
     int r;
-    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
     r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
@@ -785,8 +880,9 @@ static void vhost_eventfd_del(MemoryListener *listener,
 static int vhost_virtqueue_init(struct vhost_dev *dev,
                                 struct vhost_virtqueue *vq, int n)
 {
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, n);
     struct vhost_vring_file file = {
-        .index = n,
+        .index = vhost_vq_index,
     };
     int r = event_notifier_init(&vq->masked_notifier, 0);
     if (r < 0) {
@@ -821,9 +917,10 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
         return -1;
     }
 
-    if (hdev->vhost_ops->vhost_backend_init(hdev, opaque) < 0) {
-        close((uintptr_t)opaque);
-        return -errno;
+    r = hdev->vhost_ops->vhost_backend_init(hdev, opaque);
+    if (r < 0) {
+        hdev->vhost_ops->vhost_backend_cleanup(hdev);
+        return r;
     }
 
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
@@ -837,7 +934,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vhost_virtqueue_init(hdev, hdev->vqs + i, i);
+        r = vhost_virtqueue_init(hdev, hdev->vqs + i, hdev->vq_index + i);
         if (r < 0) {
             goto fail_vq;
         }
@@ -870,6 +967,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     hdev->mem_sections = NULL;
     hdev->log = NULL;
     hdev->log_size = 0;
+    hdev->log_fd = -1;
     hdev->log_enabled = false;
     hdev->started = false;
     hdev->memory_changed = false;
@@ -992,7 +1090,7 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     assert(n >= hdev->vq_index && n < hdev->vq_index + hdev->nvqs);
 
     struct vhost_vring_file file = {
-        .index = index
+        .index = hdev->vhost_ops->vhost_backend_get_vq_index(hdev, n)
     };
     if (mask) {
         file.fd = event_notifier_get_fd(&hdev->vqs[index].masked_notifier);
@@ -1058,17 +1156,20 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 
     if (hdev->log_enabled) {
         hdev->log_size = vhost_get_log_size(hdev);
-        hdev->log = hdev->log_size ?
-            g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE, hdev->log);
+        r = vhost_log_alloc(hdev, hdev->log_size, &hdev->log, &hdev->log_fd);
+        if (r < 0) {
+            goto fail_log;
+        }
+        r = vhost_dev_set_log_base(hdev, hdev->log, hdev->log_size,
+                                   hdev->log_fd);
         if (r < 0) {
-            r = -errno;
             goto fail_log;
         }
     }
 
     return 0;
 fail_log:
+    vhost_dev_log_release(hdev);
 fail_vq:
     while (--i >= 0) {
         vhost_virtqueue_stop(hdev,
@@ -1098,8 +1199,6 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     vhost_log_sync_range(hdev, 0, ~0x0ull);
 
     hdev->started = false;
-    g_free(hdev->log);
-    hdev->log = NULL;
-    hdev->log_size = 0;
+    vhost_dev_log_release(hdev);
 }
 
@@ -25,6 +25,7 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "hw/pci/pci.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
 #include "hw/loader.h"
@@ -104,13 +105,143 @@ static inline VirtIOPCIProxy *to_virtio_pci_proxy_fast(DeviceState *d)
     return container_of(d, VirtIOPCIProxy, pci_dev.qdev);
 }
 
+/* Adaptive coalescing never waits less than this before an interrupt */
+#define VIRTIO_PCI_IRQ_COALESCE_MIN_USECS 8
+
+static void virtio_pci_irq_coalesce_fire(VirtIOIRQCoalesce *c, int64_t now)
+{
+    timer_del(c->timer);
+    c->pending = 0;
+    c->last_ns = now;
+    msix_notify(&c->proxy->pci_dev, c->vector);
+}
+
+static void virtio_pci_irq_coalesce_timer(void *opaque)
+{
+    VirtIOIRQCoalesce *c = opaque;
+    VirtIOPCIProxy *proxy = c->proxy;
+
+    if (proxy->irq_coalesce_adaptive) {
+        /* A lone notification waited for nothing: cut latency.  Several
+         * of them mean the delay saves interrupts: wait longer. */
+        if (c->pending <= 1) {
+            c->usecs /= 2;
+            if (c->usecs < VIRTIO_PCI_IRQ_COALESCE_MIN_USECS) {
+                c->usecs = 0;
+            }
+        } else {
+            c->usecs = MIN(c->usecs * 2, proxy->irq_coalesce_usecs);
+        }
+    }
+    virtio_pci_irq_coalesce_fire(c, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+/* Returns true if the interrupt for @vector was deferred. */
+static bool virtio_pci_irq_coalesce(VirtIOPCIProxy *proxy, uint16_t vector)
+{
+    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    VirtIOIRQCoalesce *c;
+    int64_t now;
+
+    /* Configuration changes are rare and should be seen at once */
+    if (!proxy->irq_coalesce || vector >= proxy->nvectors ||
+        vector == vdev->config_vector) {
+        return false;
+    }
+
+    c = &proxy->irq_coalesce[vector];
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!c->usecs) {
+        /* The queue looked idle: deliver at once until interrupts come
+         * faster than the configured delay again. */
+        if (now - c->last_ns >=
+            (int64_t)proxy->irq_coalesce_usecs * SCALE_US) {
+            c->last_ns = now;
+            return false;
+        }
+        c->usecs = MIN(VIRTIO_PCI_IRQ_COALESCE_MIN_USECS,
+                       proxy->irq_coalesce_usecs);
+    }
+
+    c->pending++;
+    if (proxy->irq_coalesce_frames &&
+        c->pending >= proxy->irq_coalesce_frames) {
+        virtio_pci_irq_coalesce_fire(c, now);
+    } else if (!timer_pending(c->timer)) {
+        timer_mod(c->timer, now + (int64_t)c->usecs * SCALE_US);
+    }
+    return true;
+}
+
+/* Deliver interrupts held back by coalescing, or drop them if @deliver
+ * is false because the device is being reset. */
+static void virtio_pci_irq_coalesce_flush(VirtIOPCIProxy *proxy, bool deliver)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i;
+
+    if (!proxy->irq_coalesce) {
+        return;
+    }
+
+    for (i = 0; i < proxy->nvectors; i++) {
+        VirtIOIRQCoalesce *c = &proxy->irq_coalesce[i];
+
+        if (c->pending && deliver) {
+            virtio_pci_irq_coalesce_fire(c, now);
+        }
+        timer_del(c->timer);
+        c->pending = 0;
+        c->usecs = proxy->irq_coalesce_usecs;
+    }
+}
+
+static void virtio_pci_irq_coalesce_init(VirtIOPCIProxy *proxy)
+{
+    int i;
+
+    if (!proxy->irq_coalesce_usecs || !proxy->nvectors) {
+        return;
+    }
+
+    proxy->irq_coalesce = g_new0(VirtIOIRQCoalesce, proxy->nvectors);
+    for (i = 0; i < proxy->nvectors; i++) {
+        VirtIOIRQCoalesce *c = &proxy->irq_coalesce[i];
+
+        c->proxy = proxy;
+        c->vector = i;
+        c->usecs = proxy->irq_coalesce_usecs;
+        c->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                virtio_pci_irq_coalesce_timer, c);
+    }
+}
+
+static void virtio_pci_irq_coalesce_cleanup(VirtIOPCIProxy *proxy)
+{
+    int i;
+
+    if (!proxy->irq_coalesce) {
+        return;
+    }
+
+    for (i = 0; i < proxy->nvectors; i++) {
+        timer_del(proxy->irq_coalesce[i].timer);
+        timer_free(proxy->irq_coalesce[i].timer);
+    }
+    g_free(proxy->irq_coalesce);
+    proxy->irq_coalesce = NULL;
+}
+
 static void virtio_pci_notify(DeviceState *d, uint16_t vector)
 {
     VirtIOPCIProxy *proxy = to_virtio_pci_proxy_fast(d);
 
-    if (msix_enabled(&proxy->pci_dev))
-        msix_notify(&proxy->pci_dev, vector);
-    else {
+    if (msix_enabled(&proxy->pci_dev)) {
+        if (!virtio_pci_irq_coalesce(proxy, vector)) {
+            msix_notify(&proxy->pci_dev, vector);
+        }
+    } else {
         VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
         pci_set_irq(&proxy->pci_dev, vdev->isr & 1);
     }
@@ -225,7 +356,9 @@ static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
             goto assign_error;
         }
     }
+    qemu_mutex_lock(&proxy->notify_lock);
     proxy->ioeventfd_started = true;
+    qemu_mutex_unlock(&proxy->notify_lock);
     return;
 
 assign_error:
@@ -251,6 +384,13 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         return;
     }
 
+    /* Stop unlocked notifications before tearing the notifiers down;
+     * kicks that already happened are drained by the teardown.
+     */
+    qemu_mutex_lock(&proxy->notify_lock);
+    proxy->ioeventfd_started = false;
+    qemu_mutex_unlock(&proxy->notify_lock);
+
     for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
         if (!virtio_queue_get_num(vdev, n)) {
             continue;
@@ -259,7 +399,6 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         r = virtio_pci_set_host_notifier_internal(proxy, n, false, false);
         assert(r >= 0);
     }
-    proxy->ioeventfd_started = false;
 }
 
 static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
@@ -453,9 +592,68 @@ static void virtio_pci_config_write(void *opaque, hwaddr addr,
     }
 }
 
+/* The legacy BAR is dispatched without the BQL.  While ioeventfd is active,
+ * a queue notification that still reaches us (e.g. because KVM could not
+ * match it) only needs to kick the host notifier; anything else takes the
+ * BQL here.
+ */
+static bool virtio_pci_queue_notify_unlocked(VirtIOPCIProxy *proxy,
+                                             uint64_t n)
+{
+    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    bool kicked = false;
+
+    if (n >= VIRTIO_PCI_QUEUE_MAX) {
+        return false;
+    }
+
+    qemu_mutex_lock(&proxy->notify_lock);
+    if (proxy->ioeventfd_started && virtio_queue_get_num(vdev, n)) {
+        VirtQueue *vq = virtio_get_queue(vdev, n);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+        kicked = true;
+    }
+    qemu_mutex_unlock(&proxy->notify_lock);
+    return kicked;
+}
+
+static uint64_t virtio_pci_bar_read(void *opaque, hwaddr addr, unsigned size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+    uint64_t val;
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    val = virtio_pci_config_read(opaque, addr, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
+}
+
+static void virtio_pci_bar_write(void *opaque, hwaddr addr, uint64_t val,
+                                 unsigned size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    if (!locked) {
+        if (addr == VIRTIO_PCI_QUEUE_NOTIFY &&
+            virtio_pci_queue_notify_unlocked(opaque, val)) {
+            return;
+        }
+        qemu_mutex_lock_iothread();
+    }
+    virtio_pci_config_write(opaque, addr, val, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static const MemoryRegionOps virtio_pci_config_ops = {
-    .read = virtio_pci_config_read,
-    .write = virtio_pci_config_write,
+    .read = virtio_pci_bar_read,
+    .write = virtio_pci_bar_write,
     .impl = {
         .min_access_size = 1,
         .max_access_size = 4,
@@ -789,8 +987,11 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(vdev);
     int r, n;
+    /* Interrupts injected by KVM from an irqfd cannot be coalesced, so
+     * route them through virtio_pci_notify() when coalescing is on.  This
+     * covers dataplane and vhost backends as well. */
     bool with_irqfd = msix_enabled(&proxy->pci_dev) &&
-        kvm_msi_via_irqfd_enabled();
+        kvm_msi_via_irqfd_enabled() && !proxy->irq_coalesce;
 
     nvqs = MIN(nvqs, VIRTIO_PCI_QUEUE_MAX);
 
@@ -896,6 +1097,8 @@ static void virtio_pci_vmstate_change(DeviceState *d, bool running)
         virtio_pci_start_ioeventfd(proxy);
     } else {
         virtio_pci_stop_ioeventfd(proxy);
+        /* Don't leave interrupts behind in timers that are not migrated */
+        virtio_pci_irq_coalesce_flush(proxy, true);
     }
 }
 
@@ -989,6 +1192,7 @@ static void virtio_pci_device_plugged(DeviceState *d)
 
     memory_region_init_io(&proxy->bar, OBJECT(proxy), &virtio_pci_config_ops,
                           proxy, "virtio-pci", size);
+    memory_region_clear_global_locking(&proxy->bar);
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
@@ -1000,6 +1204,8 @@ static void virtio_pci_device_plugged(DeviceState *d)
     proxy->host_features |= 0x1 << VIRTIO_F_BAD_FEATURE;
     proxy->host_features = virtio_bus_get_vdev_features(bus,
                                                       proxy->host_features);
+
+    virtio_pci_irq_coalesce_init(proxy);
 }
 
 static void virtio_pci_device_unplugged(DeviceState *d)
@@ -1007,12 +1213,14 @@ static void virtio_pci_device_unplugged(DeviceState *d)
     VirtIOPCIProxy *proxy = VIRTIO_PCI(d);
 
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_irq_coalesce_cleanup(proxy);
 }
 
 static int virtio_pci_init(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *dev = VIRTIO_PCI(pci_dev);
     VirtioPCIClass *k = VIRTIO_PCI_GET_CLASS(pci_dev);
+    qemu_mutex_init(&dev->notify_lock);
     virtio_pci_bus_new(&dev->bus, sizeof(dev->bus), dev);
     if (k->init != NULL) {
         return k->init(dev);
@@ -1022,7 +1230,10 @@ static int virtio_pci_init(PCIDevice *pci_dev)
 
 static void virtio_pci_exit(PCIDevice *pci_dev)
 {
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(pci_dev);
+
     msix_uninit_exclusive_bar(pci_dev);
+    qemu_mutex_destroy(&proxy->notify_lock);
 }
 
 static void virtio_pci_reset(DeviceState *qdev)
@@ -1030,6 +1241,7 @@ static void virtio_pci_reset(DeviceState *qdev)
     VirtIOPCIProxy *proxy = VIRTIO_PCI(qdev);
     VirtioBusState *bus = VIRTIO_BUS(&proxy->bus);
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_irq_coalesce_flush(proxy, false);
     virtio_bus_reset(bus);
     msix_unuse_all_vectors(&proxy->pci_dev);
 }
@@ -1037,6 +1249,12 @@ static void virtio_pci_reset(DeviceState *qdev)
 static Property virtio_pci_properties[] = {
     DEFINE_PROP_BIT("virtio-pci-bus-master-bug-migration", VirtIOPCIProxy, flags,
                     VIRTIO_PCI_FLAG_BUS_MASTER_BUG_MIGRATION_BIT, false),
+    DEFINE_PROP_UINT32("irq-coalesce-usecs", VirtIOPCIProxy,
+                       irq_coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("irq-coalesce-frames", VirtIOPCIProxy,
+                       irq_coalesce_frames, 0),
+    DEFINE_PROP_BOOL("irq-coalesce-adaptive", VirtIOPCIProxy,
+                     irq_coalesce_adaptive, false),
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1461,6 +1679,8 @@ static void virtio_net_pci_instance_init(Object *obj)
 
     virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev),
                                 TYPE_VIRTIO_NET);
+    object_property_add_alias(obj, "iothread", OBJECT(&dev->vdev), "iothread",
+                              &error_abort);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
 }
@@ -15,6 +15,7 @@
 #ifndef QEMU_VIRTIO_PCI_H
 #define QEMU_VIRTIO_PCI_H
 
+#include "qemu/thread.h"
 #include "hw/pci/msi.h"
 #include "hw/virtio/virtio-blk.h"
 #include "hw/virtio/virtio-net.h"
@@ -69,6 +70,18 @@ typedef struct {
     unsigned int users;
 } VirtIOIRQFD;
 
+/* Host-side interrupt coalescing state of one MSI-X vector */
+typedef struct {
+    VirtIOPCIProxy *proxy;
+    QEMUTimer *timer;
+    uint16_t vector;
+    /* notifications held back since the last interrupt */
+    uint32_t pending;
+    /* current delay, between 0 and the configured limit when adaptive */
+    uint32_t usecs;
+    int64_t last_ns;
+} VirtIOIRQCoalesce;
+
 /*
  * virtio-pci: This is the PCIDevice which has a virtio-pci-bus.
  */
@@ -94,8 +107,14 @@ struct VirtIOPCIProxy {
     uint32_t host_features;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
+    /* Protects ioeventfd_started against unlocked queue notifications */
+    QemuMutex notify_lock;
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
+    uint32_t irq_coalesce_usecs;
+    uint32_t irq_coalesce_frames;
+    bool irq_coalesce_adaptive;
+    VirtIOIRQCoalesce *irq_coalesce;
     VirtioBusState bus;
 };
 
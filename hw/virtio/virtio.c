@@ -18,9 +18,12 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/range.h"
+#include "qemu/stats.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -57,6 +60,18 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* Host mapping of one part of a vring.  ptr is NULL when the part is not
+ * contained in a single RAM region; accesses then go through the memory
+ * API.  The mappings are refreshed when a change to the memory map
+ * touches the vring.
+ */
+typedef struct VRingCache
+{
+    MemoryRegion *mr;
+    hwaddr offset;
+    void *ptr;
+} VRingCache;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -64,6 +79,9 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
 } VRing;
 
 struct VirtQueue
@@ -84,14 +102,86 @@ struct VirtQueue
 
     int inuse;
 
+    /* The memory map under the vring changed, remap it on commit */
+    bool rings_stale;
+
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* Also updated by dataplane code in an iothread, hence atomics */
+    uint64_t notifications;
+    uint64_t descriptors;
+    uint64_t interrupts;
+    StatsSource *stats;
 };
 
 /* virt queue functions */
+static void vring_cache_map(VRingCache *cache, hwaddr pa, hwaddr len,
+                            bool is_write)
+{
+    MemoryRegionSection section;
+
+    if (!pa || !len || xen_enabled()) {
+        return;
+    }
+
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr) {
+        return;
+    }
+    if (int128_get64(section.size) < len ||
+        !memory_region_is_ram(section.mr) ||
+        (is_write && section.readonly)) {
+        memory_region_unref(section.mr);
+        return;
+    }
+
+    cache->mr = section.mr;
+    cache->offset = section.offset_within_region;
+    cache->ptr = memory_region_get_ram_ptr(section.mr) +
+                 section.offset_within_region;
+}
+
+static void vring_cache_unmap(VRingCache *cache)
+{
+    memory_region_unref(cache->mr);
+    cache->mr = NULL;
+    cache->ptr = NULL;
+}
+
+static void virtqueue_unmap_rings(VirtQueue *vq)
+{
+    vring_cache_unmap(&vq->vring.desc_cache);
+    vring_cache_unmap(&vq->vring.avail_cache);
+    vring_cache_unmap(&vq->vring.used_cache);
+}
+
+static void virtqueue_map_rings(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    vq->rings_stale = false;
+    virtqueue_unmap_rings(vq);
+    if (!vq->vring.desc || !num) {
+        return;
+    }
+
+    /* The avail and used rings are followed by the used_event and
+     * avail_event fields respectively.
+     */
+    vring_cache_map(&vq->vring.desc_cache, vq->vring.desc,
+                    num * sizeof(VRingDesc), false);
+    vring_cache_map(&vq->vring.avail_cache, vq->vring.avail,
+                    offsetof(VRingAvail, ring[num]) + sizeof(uint16_t),
+                    false);
+    vring_cache_map(&vq->vring.used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[num]) + sizeof(uint16_t),
+                    true);
+}
+
 static void virtqueue_init(VirtQueue *vq)
 {
     hwaddr pa = vq->pa;
@@ -101,58 +191,77 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    virtqueue_map_rings(vq);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline uint16_t vring_lduw(VirtIODevice *vdev, VRingCache *cache,
+                                  hwaddr pa, hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    if (likely(cache->ptr)) {
+        return virtio_lduw_p(vdev, cache->ptr + offset);
+    }
+    return virtio_lduw_phys(vdev, pa + offset);
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static inline void vring_stw(VirtIODevice *vdev, VRingCache *cache,
+                             hwaddr pa, hwaddr offset, uint16_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    if (likely(cache->ptr)) {
+        virtio_stw_p(vdev, cache->ptr + offset, val);
+        memory_region_set_dirty(cache->mr, cache->offset + offset,
+                                sizeof(val));
+        return;
+    }
+    virtio_stw_phys(vdev, pa + offset, val);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline void vring_stl(VirtIODevice *vdev, VRingCache *cache,
+                             hwaddr pa, hwaddr offset, uint32_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    if (likely(cache->ptr)) {
+        virtio_stl_p(vdev, cache->ptr + offset, val);
+        memory_region_set_dirty(cache->mr, cache->offset + offset,
+                                sizeof(val));
+        return;
+    }
+    virtio_stl_phys(vdev, pa + offset, val);
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Read descriptor @i of the table at @desc_pa.  @cache is the mapping of
+ * the table, or NULL for indirect tables.
+ */
+static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+                            VRingCache *cache, hwaddr desc_pa, int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    if (cache && likely(cache->ptr)) {
+        memcpy(desc, cache->ptr + sizeof(VRingDesc) * i, sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + sizeof(VRingDesc) * i,
+                           (uint8_t *)desc, sizeof(VRingDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->vring.avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -162,56 +271,55 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq->vdev, &vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq->vdev, &vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->vring.used_cache, vq->vring.used,
+                      offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq->vdev, &vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    VRingCache *cache = &vq->vring.used_cache;
+    hwaddr offset = offsetof(VRingUsed, flags);
+    uint16_t flags = vring_lduw(vdev, cache, vq->vring.used, offset);
+
+    vring_stw(vdev, cache, vq->vring.used, offset, flags | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    VRingCache *cache = &vq->vring.used_cache;
+    hwaddr offset = offsetof(VRingUsed, flags);
+    uint16_t flags = vring_lduw(vdev, cache, vq->vring.used, offset);
+
+    vring_stw(vdev, cache, vq->vring.used, offset, flags & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq->vdev, &vq->vring.used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -240,14 +348,12 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
+                               unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -263,6 +369,26 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give an element back to the guest unused, as if it had never been
+ * popped.  Only the most recently popped elements can be discarded, in
+ * reverse order.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    vq->last_avail_idx--;
+    vq->inuse--;
+    virtqueue_unmap_sg(vq, elem, len);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -328,18 +454,19 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+                                         VRingCache *cache, hwaddr desc_pa,
+                                         unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -348,6 +475,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vdev, desc, cache, desc_pa, next);
     return next;
 }
 
@@ -364,6 +492,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingCache *cache = &vq->vring.desc_cache;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -371,9 +501,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vdev, &desc, cache, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -386,9 +517,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            cache = NULL;
             num_bufs = i = 0;
+            vring_desc_read(vdev, &desc, cache, desc_pa, i);
         }
 
         do {
@@ -398,15 +531,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, cache, desc_pa,
+                                               max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -453,17 +587,57 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+void virtqueue_map(VirtQueueElement *elem)
+{
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+}
+
+/*
+ * Allocates an element of @sz bytes (at least sizeof(VirtQueueElement),
+ * more if it is the first field of a device request) followed by the
+ * address and scatter-gather arrays for @out_num and @in_num descriptors,
+ * all in a single block.
+ */
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(out_sg_end);
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
+    VRingCache *cache = &vq->vring.desc_cache;
     VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    VRingDesc desc;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
@@ -472,57 +646,148 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vdev, &desc, cache, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        cache = NULL;
         i = 0;
+        vring_desc_read(vdev, &desc, cache, desc_pa, i);
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors.  Writable descriptors must come after
+     * all the readable ones, so both can be gathered in the same arrays
+     * and split afterwards.
+     */
     do {
-        struct iovec *sg;
+        unsigned int n = out_num + in_num;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+        if (n >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Too many descriptors in indirect table");
+            exit(1);
+        }
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            out_num++;
         }
-
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        addr[n] = desc.addr;
+        iov[n].iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
-
-    /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, cache, desc_pa,
+                                           max)) != max);
 
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+    virtqueue_map(elem);
 
     vq->inuse++;
+    virtio_queue_count_descriptors(vq, out_num + in_num);
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what QEMU has always done by mistake.  We can change it sooner
+ * or later by bumping the version number of the affected vm states.
+ * In the meanwhile, since the in-memory layout of VirtQueueElement
+ * has changed, we need to marshal to and from the layout that was
+ * used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElement *elem;
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    int i;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+
+    if (data->in_num > VIRTQUEUE_MAX_SIZE ||
+        data->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream: "
+                     "%u in, %u out", data->in_num, data->out_num);
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+        /* Base is overwritten by virtqueue_map.  */
+        elem->in_sg[i].iov_base = 0;
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+        elem->out_sg[i].iov_base = 0;
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+
+    g_free(data);
+    virtqueue_map(elem);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+    int i;
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data->in_addr[i] = elem->in_addr[i];
+        /* Do not save iov_base as above.  */
+        data->in_sg[i].iov_len = elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        data->out_addr[i] = elem->out_addr[i];
+        data->out_sg[i].iov_len = elem->out_sg[i].iov_len;
+    }
+
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    g_free(data);
 }
 
 /* virtio device */
@@ -603,6 +868,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        virtqueue_unmap_rings(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
@@ -762,6 +1028,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        virtio_queue_count_notification(vq);
         vq->handle_output(vdev, vq);
     }
 }
@@ -783,6 +1050,68 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
         vdev->vq[n].vector = vector;
 }
 
+static const StatsField virtqueue_stats_fields[] = {
+    { "notifications", STATS_KIND_CUMULATIVE },
+    { "descriptors", STATS_KIND_CUMULATIVE },
+    { "interrupts", STATS_KIND_CUMULATIVE },
+};
+
+static void virtqueue_stats_collect(void *opaque, uint64_t *values)
+{
+    VirtQueue *vq = opaque;
+
+    values[0] = atomic_read(&vq->notifications);
+    values[1] = atomic_read(&vq->descriptors);
+    values[2] = atomic_read(&vq->interrupts);
+}
+
+/* Queues are named after the transport device, by id if it has one */
+static void virtqueue_stats_register(VirtQueue *vq)
+{
+    DeviceState *proxy = qdev_get_parent_bus(DEVICE(vq->vdev))->parent;
+    char *name, *prefix;
+
+    if (proxy->id) {
+        name = g_strdup(proxy->id);
+    } else {
+        name = object_get_canonical_path_component(OBJECT(proxy));
+    }
+    prefix = g_strdup_printf("virtio.%s.%d", name, vq->queue_index);
+    vq->stats = stats_register(prefix, virtqueue_stats_fields,
+                               ARRAY_SIZE(virtqueue_stats_fields),
+                               virtqueue_stats_collect, vq);
+    g_free(prefix);
+    g_free(name);
+}
+
+static void virtqueue_stats_unregister(VirtQueue *vq)
+{
+    stats_unregister(vq->stats);
+    vq->stats = NULL;
+}
+
+/* Count a notification from the guest, handled either by handle_output or
+ * by dataplane code.
+ */
+void virtio_queue_count_notification(VirtQueue *vq)
+{
+    atomic_inc(&vq->notifications);
+}
+
+/* Count @num descriptors popped from the queue */
+void virtio_queue_count_descriptors(VirtQueue *vq, unsigned int num)
+{
+    atomic_add(&vq->descriptors, num);
+}
+
+/* Count an interrupt raised for the queue, by virtio_notify() or by
+ * dataplane code.
+ */
+void virtio_queue_count_interrupt(VirtQueue *vq)
+{
+    atomic_inc(&vq->interrupts);
+}
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             void (*handle_output)(VirtIODevice *, VirtQueue *))
 {
@@ -799,6 +1128,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    virtqueue_stats_register(&vdev->vq[i]);
 
     return &vdev->vq[i];
 }
@@ -810,6 +1140,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_unmap_rings(&vdev->vq[n]);
+    virtqueue_stats_unregister(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -862,6 +1194,7 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     trace_virtio_notify(vdev, vq);
+    virtio_queue_count_interrupt(vq);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -1097,6 +1430,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap_rings(&vdev->vq[i]);
+        virtqueue_stats_unregister(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1123,6 +1462,55 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+/* The vrings of a queue lie between the descriptor table and the end of
+ * the used ring, including avail_event.
+ */
+static bool virtqueue_rings_overlap(VirtQueue *vq,
+                                    MemoryRegionSection *section)
+{
+    hwaddr end = vq->vring.used +
+                 offsetof(VRingUsed, ring[vq->vring.num]) + sizeof(uint16_t);
+
+    if (!vq->vring.desc || !vq->vring.num) {
+        return false;
+    }
+    if (int128_ge(section->size, int128_2_64())) {
+        return true;
+    }
+    return ranges_overlap(section->offset_within_address_space,
+                          int128_get64(section->size),
+                          vq->vring.desc, end - vq->vring.desc);
+}
+
+/* Guest memory was added, removed or remapped.  The new memory map is only
+ * visible to memory_region_find() at commit time, so just take note of the
+ * queues whose rings are affected.
+ */
+static void virtio_memory_listener_update(MemoryListener *listener,
+                                          MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (virtqueue_rings_overlap(&vdev->vq[i], section)) {
+            vdev->vq[i].rings_stale = true;
+        }
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].rings_stale) {
+            virtqueue_map_rings(&vdev->vq[i]);
+        }
+    }
+}
+
 void virtio_instance_init_common(Object *proxy_obj, void *data,
                                  size_t vdev_size, const char *vdev_name)
 {
@@ -1308,6 +1696,17 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
             return;
         }
     }
+
+    /* Registered only once realize succeeded, so that its error paths
+     * cannot leave a freed device on the listener list.
+     */
+    vdev->listener = (MemoryListener) {
+        .region_add = virtio_memory_listener_update,
+        .region_del = virtio_memory_listener_update,
+        .commit = virtio_memory_listener_commit,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
+
     virtio_bus_device_plugged(vdev);
 }
 
@@ -1318,6 +1717,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 
     virtio_bus_device_unplugged(vdev);
+    memory_listener_unregister(&vdev->listener);
 
     if (vdc->unrealize != NULL) {
         vdc->unrealize(dev, &err);
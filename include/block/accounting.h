@@ -27,6 +27,7 @@
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
+#include "qemu/stats.h"
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -54,4 +55,9 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
 
+/* The fields of query-blockstats, for the statistics registry */
+#define BLOCK_ACCT_NR_STATS 9
+extern const StatsField block_acct_stats_fields[BLOCK_ACCT_NR_STATS];
+void block_acct_stats_values(const BlockAcctStats *stats, uint64_t *values);
+
 #endif
@@ -157,12 +157,15 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool global_locking;
     MemoryRegion *alias;
     hwaddr alias_offset;
     int32_t priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    QTAILQ_HEAD(aliases, MemoryRegion) aliases;
+    QTAILQ_ENTRY(MemoryRegion) aliases_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
     const char *name;
     uint8_t dirty_log_mask;
@@ -186,7 +189,8 @@ struct MemoryListener {
     void (*log_start)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
-    void (*log_global_start)(MemoryListener *listener);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_global_start)(MemoryListener *listener, Error **errp);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
                         bool match_data, uint64_t data, EventNotifier *e);
@@ -215,6 +219,9 @@ struct AddressSpace {
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
+    /* Hull of the addresses touched by the pending transaction */
+    Int128 dirty_start;
+    Int128 dirty_end;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
@@ -646,6 +653,26 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty tracking in accelerators
+ *                                   for a range of a region
+ *
+ * Accelerators that report dirty pages without write-protecting them again
+ * (e.g. kvm with manual dirty log protection) only start tracking further
+ * writes to the range after this call.  Call it for a range after the
+ * dirty state returned by memory_region_sync_dirty_bitmap() has been
+ * consumed, and before the contents of the range are read.
+ *
+ * Unlike the other dirty logging functions, this can be called without
+ * the iothread mutex.
+ *
+ * @mr: the region being re-armed.
+ * @start: the start of the range, relative to the start of the region.
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -748,6 +775,22 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Allow accesses to bypass the BQL.
+ *
+ * By default, accesses to a memory region are dispatched with the global
+ * (iothread) mutex held.  After this call, accelerators may dispatch
+ * accesses to the region from vCPU threads without taking it; see
+ * address_space_rw_unlocked().  The ->read and ->write callbacks must
+ * then synchronize with the rest of the device themselves, for example
+ * by taking the BQL when qemu_mutex_iothread_locked() returns false.
+ *
+ * Only useful for IO regions that do not request coalesced MMIO flushing.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -981,8 +1024,13 @@ void memory_listener_unregister(MemoryListener *listener);
 
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * If a listener cannot start logging, the ones that did are stopped again
+ * and an error is returned in @errp.
+ *
+ * @errp: pointer to Error*, to store an error if it happens.
  */
-void memory_global_dirty_log_start(void);
+void memory_global_dirty_log_start(Error **errp);
 
 /**
  * memory_global_dirty_log_stop: end dirty logging for all regions
@@ -1027,6 +1075,25 @@ void address_space_destroy(AddressSpace *as);
 bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write);
 
+/**
+ * address_space_rw_unlocked: access a BQL-free region without the BQL.
+ *
+ * Performs a single access of 1, 2, 4 or 8 bytes if it falls entirely
+ * within a region that had memory_region_clear_global_locking() called
+ * on it.  Otherwise nothing is done and the caller must take the BQL and
+ * use address_space_rw().  May be called without the BQL.
+ *
+ * Return true if the access was performed.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @buf: buffer with the data transferred
+ * @len: the access size
+ * @is_write: indicates the transfer direction
+ */
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write);
+
 /**
  * address_space_write: write to address space.
  *
@@ -1055,6 +1122,9 @@ bool address_space_read(AddressSpace *as, hwaddr addr, uint8_t *buf, int len);
 /* address_space_translate: translate an address range into an address space
  * into a MemoryRegion and an address range into that section
  *
+ * Must be called with either the BQL or rcu_read_lock() held; the
+ * returned #MemoryRegion is only guaranteed to stay alive while it is.
+ *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
  * @xlat: pointer to address within the returned memory region section's
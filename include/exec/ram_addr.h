@@ -93,7 +93,7 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    set_bit_atomic(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
 }
 
 static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
@@ -103,8 +103,10 @@ static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA],
+                      page, end - page);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -114,9 +116,12 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA],
+                      page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_CODE],
+                      page, end - page);
     xen_modified_memory(start, length);
 }
 
@@ -142,10 +147,41 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         for (k = 0; k < nr; k++) {
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
+                int client;
 
-                ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
+                for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                    atomic_or(&ram_list.dirty_memory[client][page + k], temp);
+                }
+            }
+        }
+        xen_modified_memory(start, pages);
+    } else if (hpratio == 1) {
+        /*
+         * Unaligned start: still merge a word at a time, splitting each
+         * source word across the two destination words it straddles.
+         */
+        unsigned long shift = (start >> TARGET_PAGE_BITS) % BITS_PER_LONG;
+        unsigned long lo, hi;
+        long k;
+        long nr = BITS_TO_LONGS(pages);
+        int client;
+
+        for (k = 0; k < nr; k++) {
+            if (bitmap[k]) {
+                unsigned long temp = leul_to_cpu(bitmap[k]);
+
+                if (k == nr - 1) {
+                    temp &= BITMAP_LAST_WORD_MASK(pages);
+                }
+                lo = temp << shift;
+                hi = shift ? temp >> (BITS_PER_LONG - shift) : 0;
+                for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                    atomic_or(&ram_list.dirty_memory[client][page + k], lo);
+                    if (hi) {
+                        atomic_or(&ram_list.dirty_memory[client][page + k + 1],
+                                  hi);
+                    }
+                }
             }
         }
         xen_modified_memory(start, pages);
@@ -172,7 +208,7 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
 }
 #endif /* not _WIN32 */
 
-static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
+static inline bool cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length,
                                                          unsigned client)
 {
@@ -181,11 +217,20 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     assert(client < DIRTY_MEMORY_NUM);
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_clear(ram_list.dirty_memory[client], page, end - page);
+    return bitmap_test_and_clear_atomic(ram_list.dirty_memory[client],
+                                        page, end - page);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+/* Like cpu_physical_memory_reset_dirty(), but return whether any page in
+ * the range was dirty.  Test and clear are a single atomic step, so a page
+ * dirtied concurrently is either reported or left dirty.
+ */
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client);
+
 #endif
 #endif
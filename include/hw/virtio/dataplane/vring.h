@@ -23,6 +23,7 @@
 
 typedef struct {
     MemoryRegion *mr;               /* memory region containing the vring */
+    VirtQueue *vq;                  /* queue to account pops to */
     struct vring vr;                /* virtqueue vring mapped to host memory */
     uint16_t last_avail_idx;        /* last processed avail ring index */
     uint16_t last_used_idx;         /* last processed used ring index */
@@ -48,12 +49,22 @@ static inline void vring_set_broken(Vring *vring)
     vring->broken = true;
 }
 
+/* Did vring_pop() or vring_push() fail with a fatal error? */
+static inline bool vring_is_broken(Vring *vring)
+{
+    return vring->broken;
+}
+
 bool vring_setup(Vring *vring, VirtIODevice *vdev, int n);
 void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
-int vring_pop(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem);
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz);
+void vring_discard(Vring *vring, VirtQueueElement *elem);
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx);
+void vring_flush(Vring *vring, unsigned int count);
 void vring_push(Vring *vring, VirtQueueElement *elem, int len);
 
 #endif /* VRING_H */
@@ -24,12 +24,20 @@ typedef int (*vhost_call)(struct vhost_dev *dev, unsigned long int request,
              void *arg);
 typedef int (*vhost_backend_init)(struct vhost_dev *dev, void *opaque);
 typedef int (*vhost_backend_cleanup)(struct vhost_dev *dev);
+typedef int (*vhost_backend_get_vq_index)(struct vhost_dev *dev, int idx);
+/* Returns 0 or a negative errno value */
+typedef int (*vhost_backend_set_log_base)(struct vhost_dev *dev,
+             uint64_t base, uint64_t size, int fd);
+typedef bool (*vhost_requires_shm_log)(struct vhost_dev *dev);
 
 typedef struct VhostOps {
     VhostBackendType backend_type;
     vhost_call vhost_call;
     vhost_backend_init vhost_backend_init;
     vhost_backend_cleanup vhost_backend_cleanup;
+    vhost_backend_get_vq_index vhost_backend_get_vq_index;
+    vhost_backend_set_log_base vhost_backend_set_log_base;
+    vhost_requires_shm_log vhost_requires_shm_log;
 } VhostOps;
 
 extern const VhostOps user_ops;
@@ -41,10 +41,15 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* vhost-user protocol features and queue pairs offered by the slave */
+    uint64_t protocol_features;
+    unsigned int max_queues;
     bool started;
     bool log_enabled;
     vhost_log_chunk_t *log;
     unsigned long long log_size;
+    /* file descriptor backing @log when it is shared with the backend */
+    int log_fd;
     Error *migration_blocker;
     bool force;
     bool memory_changed;
@@ -140,8 +140,8 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 typedef struct VirtIOBlockReq {
-    VirtIOBlock *dev;
     VirtQueueElement elem;
+    VirtIOBlock *dev;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
     QEMUIOVector qiov;
@@ -149,7 +149,7 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
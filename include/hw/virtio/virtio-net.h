@@ -16,6 +16,8 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "net/tap.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -66,12 +68,15 @@
  * length of the TX queue and shows a good balance of performance
  * and latency. */
 #define TX_BURST 256
+/* Smallest burst used by tx=adaptive */
+#define TX_BURST_MIN 16
 
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -145,12 +150,21 @@ struct virtio_net_ctrl_mac {
 
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
+    QEMUBH *rx_notify_bh;
+    bool rx_notify_pending;     /* delivered by rx_notify_bh once running */
+    /* Guest buffers lent to the peer for zero-copy receive */
+    struct {
+        VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+        unsigned int num;
+        size_t size;
+    } rx_loan;
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
     struct VirtIONet *n;
@@ -165,6 +179,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    bool tx_adaptive;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -197,6 +212,9 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    struct VirtIONetDataPlane *dataplane;
+    bool dataplane_started;
+    Notifier migration_state_notifier;
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -287,6 +305,10 @@ struct virtio_net_ctrl_mq {
     DEFINE_PROP_STRING("tx", _state, _field.tx)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
+void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr);
+void virtio_net_receive_header(VirtIONet *n, const struct iovec *iov,
+                               int iov_cnt, const void *buf, size_t size);
+int virtio_net_receive_filter(VirtIONet *n, const uint8_t *buf, int size);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
 
@@ -47,14 +47,15 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr.  This counts as a
+ * use of the page for the replacement policy.
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
@@ -69,8 +70,9 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache. In case of size reduction the least
+ * recently used pages will be freed.  Cached pages are moved to the
+ * resized cache without copying their contents
  *
  * Returns -1 on error new cache size on success
  *
@@ -79,4 +81,11 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_num_items: Returns the number of pages currently cached
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_num_items(const PageCache *cache);
+
 #endif
@@ -2,6 +2,7 @@
 #define QEMU_NET_H
 
 #include "qemu/queue.h"
+#include "qemu/stats.h"
 #include "qemu-common.h"
 #include "qapi/qmp/qdict.h"
 #include "qemu/option.h"
@@ -55,6 +56,9 @@ typedef bool (HasVnetHdrLen)(NetClientState *, int);
 typedef void (UsingVnetHdr)(NetClientState *, bool);
 typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
+typedef int (GetRxBuffers)(NetClientState *, size_t, size_t,
+                           struct iovec *, int);
+typedef void (PutRxBuffers)(NetClientState *, size_t, const uint8_t *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -73,6 +77,8 @@ typedef struct NetClientInfo {
     UsingVnetHdr *using_vnet_hdr;
     SetOffload *set_offload;
     SetVnetHdrLen *set_vnet_hdr_len;
+    GetRxBuffers *get_rx_buffers;
+    PutRxBuffers *put_rx_buffers;
 } NetClientInfo;
 
 struct NetClientState {
@@ -88,6 +94,9 @@ struct NetClientState {
     NetClientDestructor *destructor;
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    StatsSource *stats;
 };
 
 typedef struct NICState {
@@ -104,6 +113,11 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
                                     NetClientState *peer,
                                     const char *model,
                                     const char *name);
+NetClientState *qemu_new_net_subqueue(NetClientInfo *info,
+                                      NetClientState *peer,
+                                      const char *model,
+                                      const char *name,
+                                      unsigned int queue_index);
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
@@ -138,6 +152,11 @@ void qemu_using_vnet_hdr(NetClientState *nc, bool enable);
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
                       int ecn, int ufo);
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
+int qemu_peer_get_rx_buffers(NetClientState *nc, size_t hdr_len, size_t size,
+                             struct iovec *iov, int iovcnt);
+void qemu_peer_put_rx_buffers(NetClientState *nc, size_t len,
+                              const uint8_t *spill);
+void qemu_net_client_count_rx(NetClientState *nc, size_t len);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
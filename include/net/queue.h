@@ -38,6 +38,9 @@ NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
 
+void qemu_net_queue_get_stats(NetQueue *queue, uint32_t *len,
+                              uint32_t *maxlen, uint64_t *dropped);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -30,6 +30,7 @@ typedef enum json_token_type {
 
 typedef struct JSONLexer JSONLexer;
 
+/* The token is only valid during the call; it is reused afterwards */
 typedef void (JSONLexerEmitter)(JSONLexer *, QString *, JSONTokenType, int x, int y);
 
 struct JSONLexer
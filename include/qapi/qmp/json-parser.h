@@ -15,10 +15,39 @@
 #define QEMU_JSON_PARSER_H
 
 #include "qemu-common.h"
-#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
+#include "qapi/qmp/json-lexer.h"
 #include "qapi/error.h"
 
-QObject *json_parser_parse(QList *tokens, va_list *ap);
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp);
+typedef struct JSONParserFrame JSONParserFrame;
+
+/*
+ * A push parser: tokens are fed one at a time as the lexer produces them,
+ * and the QObject is built as they arrive, so no token outlives the call
+ * that feeds it.  After the first error the rest of the message is
+ * skipped.
+ */
+typedef struct JSONParser
+{
+    va_list *ap;
+    Error *err;
+    QObject *result;
+    JSONParserFrame *stack;
+    size_t depth;
+    size_t stack_size;
+    int state;
+} JSONParser;
+
+void json_parser_init(JSONParser *parser, va_list *ap);
+
+void json_parser_feed(JSONParser *parser, const QString *token,
+                      JSONTokenType type);
+
+/* Return the value of the message fed so far, or NULL and set @errp, and
+ * get ready for the next message.
+ */
+QObject *json_parser_finish(JSONParser *parser, Error **errp);
+
+void json_parser_destroy(JSONParser *parser);
 
 #endif
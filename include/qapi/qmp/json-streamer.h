@@ -14,21 +14,26 @@
 #ifndef QEMU_JSON_STREAMER_H
 #define QEMU_JSON_STREAMER_H
 
-#include "qapi/qmp/qlist.h"
 #include "qapi/qmp/json-lexer.h"
+#include "qapi/qmp/json-parser.h"
 
 typedef struct JSONMessageParser
 {
-    void (*emit)(struct JSONMessageParser *parser, QList *tokens);
+    /* Called for each message with either its value or an error; the
+     * callee owns whichever is not NULL.
+     */
+    void (*emit)(struct JSONMessageParser *parser, QObject *obj, Error *err);
     JSONLexer lexer;
+    JSONParser parser;
     int brace_count;
     int bracket_count;
-    QList *tokens;
     uint64_t token_size;
 } JSONMessageParser;
 
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *));
+                              void (*func)(JSONMessageParser *, QObject *,
+                                           Error *),
+                              va_list *ap);
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size);
@@ -466,6 +466,10 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool test_buffer_find_nonzero_offset_accel(unsigned int accel);
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+bool host_cpu_has_avx2(void);
+#endif
 
 /*
  * helper to parse debug environment variables
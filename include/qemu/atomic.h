@@ -167,6 +167,27 @@
 } while (0)
 #endif
 
+/* atomic_rcu_read: read an RCU-protected pointer into a local variable.
+ * It must be called within an RCU read-side critical section, and the
+ * pointer is only valid until rcu_read_unlock().  Pairs with
+ * atomic_rcu_set(), which makes the pointed-to data visible before the
+ * pointer itself.
+ */
+#ifndef atomic_rcu_read
+#define atomic_rcu_read(ptr)   ({           \
+    typeof(*ptr) _val = atomic_read(ptr);   \
+    smp_read_barrier_depends();             \
+    _val;                                   \
+})
+#endif
+
+#ifndef atomic_rcu_set
+#define atomic_rcu_set(ptr, i) do {         \
+    smp_wmb();                              \
+    atomic_set(ptr, i);                     \
+} while (0)
+#endif
+
 #ifndef atomic_xchg
 #if defined(__clang__)
 #define atomic_xchg(ptr, i)    __sync_swap(ptr, i)
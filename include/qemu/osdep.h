@@ -257,6 +257,26 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz);
+/* Touching guest RAM is bounded by memory bandwidth; more threads than
+ * this don't start a VM any faster. */
+#define MAX_MEM_PREALLOC_THREADS 16
+
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1
+ * @area: start of the memory to preallocate
+ * @sz: size of @area
+ * @nthreads: number of threads touching the pages in parallel, clamped
+ * to 1..MAX_MEM_PREALLOC_THREADS
+ * @host_nodes: bitmap of host NUMA nodes @area is bound to, or NULL
+ * @maxnode: number of bits in @host_nodes
+ *
+ * Touch every page of @area so that the host allocates it now rather
+ * than when the guest first uses it.  Exits if the host runs out of
+ * memory.  When @host_nodes is given, every node gets at least one
+ * thread running on its CPUs.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int nthreads,
+                     const unsigned long *host_nodes, unsigned long maxnode);
 
 #endif
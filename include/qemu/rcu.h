@@ -0,0 +1,115 @@
+/*
+ * Read-copy-update
+ *
+ * Readers access shared data inside rcu_read_lock()/rcu_read_unlock()
+ * without taking locks or touching shared cache lines.  Updaters publish
+ * a new version with atomic_rcu_set() and release the old one with
+ * call_rcu() or after synchronize_rcu(), once no reader can still see it.
+ * See docs/rcu.txt.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+
+/* The global grace period counter.  Bit 0 is always set, so that a
+ * reader's snapshot of it is never zero; zero means "not in a critical
+ * section".
+ */
+#define RCU_GP_LOCKED  1UL
+#define RCU_GP_CTR     2UL
+
+extern unsigned long rcu_gp_ctr;
+
+extern QemuEvent rcu_gp_event;
+
+struct rcu_reader_data {
+    /* Written by the reader, read by synchronize_rcu() */
+    unsigned long ctr;
+    bool waiting;
+
+    /* Only used by the reader */
+    unsigned depth;
+
+    /* Protected by the registry lock */
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern __thread struct rcu_reader_data rcu_reader;
+
+/* Threads created with qemu_thread_create() and the main thread are
+ * registered automatically; other threads must call these around any
+ * use of rcu_read_lock().
+ */
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    atomic_xchg(&p_rcu_reader->ctr, atomic_read(&rcu_gp_ctr));
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    atomic_xchg(&p_rcu_reader->ctr, 0);
+    if (unlikely(atomic_read(&p_rcu_reader->waiting))) {
+        atomic_set(&p_rcu_reader->waiting, false);
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+/* Wait until every read-side critical section that was running when the
+ * function was called has finished.  Must not be called from inside one.
+ */
+void synchronize_rcu(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/* Run @func(@head) after a grace period has elapsed.  The callbacks run
+ * in a separate thread, with the BQL held.
+ */
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+/* call_rcu(ptr, func, field): call @func(@ptr) after a grace period.
+ * @field is the struct rcu_head member of *@ptr and must be its first
+ * member, so that @func can take a pointer to the containing type.
+ */
+#define call_rcu(head, func, field)                                       \
+    call_rcu1(({                                                          \
+         char __attribute__((unused))                                     \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)],       \
+            func_type_invalid = (func) - (void (*)(typeof(head)))(func);  \
+         &(head)->field;                                                  \
+      }),                                                                 \
+      (RCUCBFunc *)(func))
+
+#endif
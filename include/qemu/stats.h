@@ -0,0 +1,76 @@
+/*
+ * Statistics registry
+ *
+ * Subsystems register groups of 64-bit counters ("sources") under a name
+ * prefix, together with a function that reads their current values.  All
+ * counters can then be read in one pass into a flat array, whose layout
+ * is described separately by the schema and only changes when a source
+ * comes or goes, as signalled by stats_generation().  See docs/stats.txt.
+ *
+ * Sources are registered, unregistered and read under the BQL.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STATS_H
+#define QEMU_STATS_H
+
+#include <stdint.h>
+#include "qapi-types.h"
+
+typedef struct StatsField {
+    const char *name;
+    StatsKind kind;
+} StatsField;
+
+typedef struct StatsSource StatsSource;
+
+/* Store the current value of each of the source's fields in @values */
+typedef void StatsCollectFunc(void *opaque, uint64_t *values);
+
+typedef void StatsFieldFunc(const char *prefix, const StatsField *field,
+                            void *opaque);
+
+StatsSource *stats_register(const char *prefix, const StatsField *fields,
+                            int nr_fields, StatsCollectFunc *collect,
+                            void *opaque);
+void stats_unregister(StatsSource *src);
+
+uint64_t stats_generation(void);
+int stats_nr_fields(void);
+void stats_foreach_field(StatsFieldFunc *fn, void *opaque);
+
+/* Read every field, in schema order, into @values, which has room for
+ * stats_nr_fields() values.
+ */
+void stats_collect(uint64_t *values);
+
+/*
+ * Layout of the file exported by stats-shm-start.  All fields are in host
+ * byte order.  The writer makes @seq odd while it updates the file, so a
+ * reader must retry if @seq was odd or changed across its copy.
+ */
+#define STATS_SHM_MAGIC     0x41545351  /* "QSTA" */
+#define STATS_SHM_VERSION   1
+#define STATS_SHM_NAME_MAX  56
+
+typedef struct StatsShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t nr_fields;
+    uint64_t generation;
+    int64_t timestamp_ns;       /* QEMU_CLOCK_REALTIME of the last update */
+    uint64_t size;              /* file size; grows, never shrinks */
+    uint64_t fields_offset;     /* nr_fields StatsShmField */
+    uint64_t values_offset;     /* nr_fields uint64_t */
+} StatsShmHeader;
+
+typedef struct StatsShmField {
+    char name[STATS_SHM_NAME_MAX];  /* prefix.name, truncated, NUL-padded */
+    uint32_t kind;                  /* StatsKind */
+    uint32_t reserved;
+} StatsShmField;
+
+#endif
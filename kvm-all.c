@@ -22,6 +22,7 @@
 
 #include "qemu-common.h"
 #include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "sysemu/sysemu.h"
@@ -67,6 +68,11 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* With manual dirty log protection, the bitmap returned by the last
+     * KVM_GET_DIRTY_LOG.  Pages set here have been reported to the memory
+     * API but are still writable, until kvm_log_clear() re-protects them.
+     */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
@@ -77,6 +83,12 @@ struct KVMState
 
     KVMSlot *slots;
     int nr_slots;
+    /* Protects the slot layout and the slots' dirty_bmap.  Slots are
+     * changed with the iothread mutex held, but kvm_log_clear() is called
+     * from the migration thread.
+     */
+    QemuMutex slots_lock;
+    bool manual_dirty_log_protect;
     int fd;
     int vmfd;
     int coalesced_mmio;
@@ -346,8 +358,10 @@ static void kvm_log_start(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_dirty_pages_log_change(section->offset_within_address_space,
                                    int128_get64(section->size), true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -358,8 +372,10 @@ static void kvm_log_stop(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_dirty_pages_log_change(section->offset_within_address_space,
                                    int128_get64(section->size), false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -403,12 +419,59 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/* Re-protect the pages of @mem in [start_addr, end_addr) that the last
+ * KVM_GET_DIRTY_LOG reported as dirty.  Pages dirtied after that call are
+ * left alone, or their dirty bit would be lost.
+ */
+static int kvm_slot_clear_dirty(KVMState *s, KVMSlot *mem,
+                                hwaddr start_addr, hwaddr end_addr)
+{
+    struct kvm_clear_dirty_log d;
+    uint64_t first, last, nr_pages;
+    uint8_t *bmap;
+
+    /* The kernel wants the first page aligned to 64, and the number of
+     * pages too unless the range ends at the end of the slot.  Clearing
+     * a few more pages than asked for is harmless: their dirty state has
+     * already been transferred to the memory API.
+     */
+    nr_pages = mem->memory_size >> TARGET_PAGE_BITS;
+    first = QEMU_ALIGN_DOWN((start_addr - mem->start_addr) >> TARGET_PAGE_BITS,
+                            64);
+    last = QEMU_ALIGN_UP((end_addr - mem->start_addr) >> TARGET_PAGE_BITS, 64);
+    last = MIN(last, nr_pages);
+    if (first >= last) {
+        return 0;
+    }
+
+    /* The bitmap is little-endian with 64-bit granularity, so the
+     * subrange starts at a byte boundary.
+     */
+    bmap = (uint8_t *)mem->dirty_bmap + first / 8;
+
+    d.slot = mem->slot;
+    d.first_page = first;
+    d.num_pages = last - first;
+    d.dirty_bitmap = bmap;
+    if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) == -1) {
+        DPRINTF("ioctl failed %d\n", errno);
+        return -1;
+    }
+
+    memset(bmap, 0, DIV_ROUND_UP(last - first, 8));
+    return 0;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * Without manual dirty log protection, the kernel write-protects the
+ * whole slot again before returning.  With it, the pages stay writable
+ * until kvm_log_clear() is called for them.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -418,11 +481,11 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
     unsigned long size, allocated_size = 0;
     KVMDirtyLog d;
     KVMSlot *mem;
+    void *scratch = NULL;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
@@ -443,13 +506,22 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            /* Keep the bitmap, kvm_log_clear() needs it */
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!scratch) {
+                scratch = g_malloc(size);
+            } else if (size > allocated_size) {
+                scratch = g_realloc(scratch, size);
+            }
+            allocated_size = size;
+            memset(scratch, 0, allocated_size);
+            d.dirty_bitmap = scratch;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot;
 
@@ -460,13 +532,59 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+
+        /* Only migration knows when it is safe to re-protect the pages
+         * in chunks; for everybody else do it right away, like
+         * KVM_GET_DIRTY_LOG does without manual protection.
+         */
+        if (s->manual_dirty_log_protect && !s->migration_log &&
+            kvm_slot_clear_dirty(s, mem, MAX(start_addr, mem->start_addr),
+                                 MIN(end_addr,
+                                     mem->start_addr + mem->memory_size))) {
+            ret = -1;
+            break;
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(scratch);
 
     return ret;
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    KVMSlot *mem;
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+    int r;
+
+    if (!s->manual_dirty_log_protect) {
+        /* KVM_GET_DIRTY_LOG already re-protected everything */
+        return;
+    }
+
+    qemu_mutex_lock(&s->slots_lock);
+    while (start_addr < end_addr) {
+        mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
+        if (mem == NULL) {
+            break;
+        }
+
+        if ((mem->flags & KVM_MEM_LOG_DIRTY_PAGES) && mem->dirty_bmap) {
+            r = kvm_slot_clear_dirty(s, mem, MAX(start_addr, mem->start_addr),
+                                     MIN(end_addr,
+                                         mem->start_addr + mem->memory_size));
+            if (r < 0) {
+                abort();
+            }
+        }
+        start_addr = mem->start_addr + mem->memory_size;
+    }
+    qemu_mutex_unlock(&s->slots_lock);
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -699,6 +817,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(s, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -801,13 +921,17 @@ static void kvm_region_add(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -816,17 +940,22 @@ static void kvm_log_sync(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
-static void kvm_log_global_start(struct MemoryListener *listener)
+static void kvm_log_global_start(struct MemoryListener *listener,
+                                 Error **errp)
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_set_migration_log(1);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     assert(r >= 0);
 }
 
@@ -834,7 +963,9 @@ static void kvm_log_global_stop(struct MemoryListener *listener)
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_set_migration_log(0);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     assert(r >= 0);
 }
 
@@ -913,6 +1044,7 @@ static MemoryListener kvm_memory_listener = {
     .log_start = kvm_log_start,
     .log_stop = kvm_log_stop,
     .log_sync = kvm_log_sync,
+    .log_clear = kvm_log_clear,
     .log_global_start = kvm_log_global_start,
     .log_global_stop = kvm_log_global_stop,
     .eventfd_add = kvm_mem_ioeventfd_add,
@@ -1471,6 +1603,7 @@ static int kvm_init(MachineState *ms)
     }
 
     s->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
+    qemu_mutex_init(&s->slots_lock);
 
     for (i = 0; i < s->nr_slots; i++) {
         s->slots[i].slot = i;
@@ -1584,6 +1717,16 @@ static int kvm_init(MachineState *ms)
     kvm_eventfds_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD) > 0);
 
+    /* Let migration re-protect dirty pages in chunks, as it sends them,
+     * instead of having KVM_GET_DIRTY_LOG stall the guest while it
+     * write-protects whole slots.
+     */
+    if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) &&
+        kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                          KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) == 0) {
+        s->manual_dirty_log_protect = true;
+    }
+
     ret = kvm_arch_init(s);
     if (ret < 0) {
         goto err;
@@ -1735,6 +1878,45 @@ void kvm_cpu_clean_state(CPUState *cpu)
     cpu->kvm_vcpu_dirty = false;
 }
 
+/* Complete I/O exits that hit regions dispatched without the BQL, so that
+ * the vCPU can go straight back into the guest.  Returns false if the exit
+ * has to be handled by kvm_cpu_exec() with the BQL held.
+ *
+ * Skipping kvm_arch_pre_run() and kvm_arch_post_run() is only safe with an
+ * in-kernel irqchip; pending interrupts and kicks still make KVM_RUN
+ * return -EINTR.
+ */
+static bool kvm_handle_exit_unlocked(CPUState *cpu, struct kvm_run *run)
+{
+    if (cpu->exit_request || !kvm_irqchip_in_kernel()) {
+        return false;
+    }
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->io.count != 1 ||
+            !address_space_rw_unlocked(&address_space_io, run->io.port,
+                                       (uint8_t *)run + run->io.data_offset,
+                                       run->io.size,
+                                       run->io.direction == KVM_EXIT_IO_OUT)) {
+            return false;
+        }
+        break;
+    case KVM_EXIT_MMIO:
+        if (!address_space_rw_unlocked(&address_space_memory,
+                                       run->mmio.phys_addr, run->mmio.data,
+                                       run->mmio.len, run->mmio.is_write)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+    return true;
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
@@ -1765,7 +1947,9 @@ int kvm_cpu_exec(CPUState *cpu)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        do {
+            run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        } while (run_ret == 0 && kvm_handle_exit_unlocked(cpu, run));
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
@@ -18,6 +18,8 @@
 #include "exec/ioport.h"
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 #include "trace.h"
 #include <assert.h>
@@ -33,26 +35,23 @@ static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
-/* flat_view_mutex is taken around reading as->current_map; the critical
- * section is extremely short, so I'm using a single mutex for every AS.
- * We could also RCU for the read-side.
- *
- * The BQL is taken around transaction commits, hence both locks are taken
- * while writing to as->current_map (with the BQL taken outside).
- */
-static QemuMutex flat_view_mutex;
-
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
-static QTAILQ_HEAD(, AddressSpace) address_spaces
-    = QTAILQ_HEAD_INITIALIZER(address_spaces);
+/* Changes to memory_listeners are made with the iothread mutex held, and
+ * also under this lock for memory_region_clear_dirty_bitmap(), which walks
+ * the list from the migration thread.
+ */
+static QemuMutex memory_listeners_lock;
 
-static void memory_init(void)
+static void __attribute__((__constructor__)) memory_listeners_lock_init(void)
 {
-    qemu_mutex_init(&flat_view_mutex);
+    qemu_mutex_init(&memory_listeners_lock);
 }
 
+static QTAILQ_HEAD(, AddressSpace) address_spaces
+    = QTAILQ_HEAD_INITIALIZER(address_spaces);
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -242,6 +241,7 @@ struct FlatRange {
  * order.
  */
 struct FlatView {
+    struct rcu_head rcu;
     unsigned ref;
     FlatRange *ranges;
     unsigned nr;
@@ -497,6 +497,60 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+static void address_space_mark_dirty(AddressSpace *as, AddrRange range)
+{
+    if (int128_ge(as->dirty_start, as->dirty_end)) {
+        as->dirty_start = range.start;
+        as->dirty_end = addrrange_end(range);
+    } else {
+        as->dirty_start = int128_min(as->dirty_start, range.start);
+        as->dirty_end = int128_max(as->dirty_end, addrrange_end(range));
+    }
+}
+
+static void address_space_mark_all_dirty(AddressSpace *as)
+{
+    address_space_mark_dirty(as, addrrange_make(int128_zero(),
+                                                int128_2_64()));
+}
+
+/* Record that @range, relative to the start of @mr, may have changed in
+ * every address space where @mr is visible, directly or through aliases.
+ * The next commit only re-renders the marked part of those address spaces.
+ */
+static void memory_region_mark_dirty(MemoryRegion *mr, AddrRange range)
+{
+    AddrRange extent = addrrange_make(int128_zero(), mr->size);
+    MemoryRegion *alias;
+    AddressSpace *as;
+
+    if (!addrrange_intersects(range, extent)) {
+        return;
+    }
+    range = addrrange_intersection(range, extent);
+
+    QTAILQ_FOREACH(alias, &mr->aliases, aliases_link) {
+        Int128 delta = int128_neg(int128_make64(alias->alias_offset));
+
+        memory_region_mark_dirty(alias, addrrange_shift(range, delta));
+    }
+    if (mr->container) {
+        memory_region_mark_dirty(mr->container,
+                                 addrrange_shift(range,
+                                                 int128_make64(mr->addr)));
+    }
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root == mr) {
+            address_space_mark_dirty(as, range);
+        }
+    }
+}
+
+static void memory_region_mark_all_dirty(MemoryRegion *mr)
+{
+    memory_region_mark_dirty(mr, addrrange_make(int128_zero(), mr->size));
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -584,23 +638,88 @@ static void render_memory_region(FlatView *view,
     }
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+/* Render a memory topology into a list of disjoint absolute ranges.  Only
+ * @range is rendered from @mr; everything outside it is copied from @old_view.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          FlatView *old_view,
+                                          AddrRange range)
 {
-    FlatView *view;
+    Int128 start = range.start;
+    Int128 end = addrrange_end(range);
+    FlatView *view, *part;
+    FlatRange fr;
+    unsigned i, above;
 
     view = g_new(FlatView, 1);
     flatview_init(view);
 
+    /* Old ranges below the dirty range, trimmed at its start. */
+    for (i = 0; i < old_view->nr; i++) {
+        fr = old_view->ranges[i];
+        if (int128_ge(fr.addr.start, start)) {
+            break;
+        }
+        if (int128_gt(addrrange_end(fr.addr), start)) {
+            fr.addr.size = int128_sub(start, fr.addr.start);
+        }
+        flatview_insert(view, view->nr, &fr);
+    }
+    above = i ? i - 1 : 0;
+
+    part = g_new(FlatView, 1);
+    flatview_init(part);
     if (mr) {
-        render_memory_region(view, mr, int128_zero(),
-                             addrrange_make(int128_zero(), int128_2_64()), false);
+        render_memory_region(part, mr, int128_zero(), range, false);
+    }
+    for (i = 0; i < part->nr; i++) {
+        flatview_insert(view, view->nr, &part->ranges[i]);
+    }
+    flatview_unref(part);
+
+    /* Old ranges above the dirty range, trimmed at its end. */
+    for (i = above; i < old_view->nr; i++) {
+        fr = old_view->ranges[i];
+        if (int128_le(addrrange_end(fr.addr), end)) {
+            continue;
+        }
+        if (int128_lt(fr.addr.start, end)) {
+            Int128 skip = int128_sub(end, fr.addr.start);
+
+            fr.offset_in_region += int128_get64(skip);
+            fr.addr = addrrange_make(end, int128_sub(fr.addr.size, skip));
+        }
+        flatview_insert(view, view->nr, &fr);
     }
     flatview_simplify(view);
 
     return view;
 }
 
+/* Find the ranges of @view that overlap or abut [@start, @end]; they are
+ * [*@first, *@last).  Only those can differ between two views that were
+ * rendered identically outside [@start, @end).
+ */
+static void flatview_find_window(FlatView *view, Int128 start, Int128 end,
+                                 unsigned *first, unsigned *last)
+{
+    unsigned lo = 0, hi = view->nr, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (int128_lt(addrrange_end(view->ranges[mid].addr), start)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *first = lo;
+    while (lo < view->nr && int128_le(view->ranges[lo].addr.start, end)) {
+        ++lo;
+    }
+    *last = lo;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -654,10 +773,10 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
 {
     FlatView *view;
 
-    qemu_mutex_lock(&flat_view_mutex);
-    view = as->current_map;
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
     flatview_ref(view);
-    qemu_mutex_unlock(&flat_view_mutex);
+    rcu_read_unlock();
     return view;
 }
 
@@ -696,8 +815,10 @@ static void address_space_update_ioeventfds(AddressSpace *as)
 }
 
 static void address_space_update_topology_pass(AddressSpace *as,
-                                               const FlatView *old_view,
-                                               const FlatView *new_view,
+                                               FlatRange *old_ranges,
+                                               unsigned old_nr,
+                                               FlatRange *new_ranges,
+                                               unsigned new_nr,
                                                bool adding)
 {
     unsigned iold, inew;
@@ -707,14 +828,14 @@ static void address_space_update_topology_pass(AddressSpace *as,
      * Kill ranges in the old map, and instantiate ranges in the new map.
      */
     iold = inew = 0;
-    while (iold < old_view->nr || inew < new_view->nr) {
-        if (iold < old_view->nr) {
-            frold = &old_view->ranges[iold];
+    while (iold < old_nr || inew < new_nr) {
+        if (iold < old_nr) {
+            frold = &old_ranges[iold];
         } else {
             frold = NULL;
         }
-        if (inew < new_view->nr) {
-            frnew = &new_view->ranges[inew];
+        if (inew < new_nr) {
+            frnew = &new_ranges[inew];
         } else {
             frnew = NULL;
         }
@@ -760,24 +881,64 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *old_view, *new_view;
+    AddrRange dirty;
+    unsigned old_first, old_last, new_first, new_last, i;
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    if (int128_ge(as->dirty_start, as->dirty_end)) {
+        /* Nothing visible in this address space changed; listeners keep
+         * what they built for the current map.
+         */
+        if (ioeventfd_update_pending) {
+            address_space_update_ioeventfds(as);
+        }
+        return;
+    }
 
-    qemu_mutex_lock(&flat_view_mutex);
-    flatview_unref(as->current_map);
-    as->current_map = new_view;
-    qemu_mutex_unlock(&flat_view_mutex);
+    dirty = addrrange_make(as->dirty_start,
+                           int128_sub(as->dirty_end, as->dirty_start));
+    old_view = as->current_map;
+    new_view = generate_memory_topology(as->root, old_view, dirty);
 
-    /* Note that all the old MemoryRegions are still alive up to this
+    /* Outside the window the two views are identical, so ranges there are
+     * only reported as unchanged.
+     */
+    flatview_find_window(old_view, as->dirty_start, as->dirty_end,
+                         &old_first, &old_last);
+    flatview_find_window(new_view, as->dirty_start, as->dirty_end,
+                         &new_first, &new_last);
+
+    address_space_update_topology_pass(as,
+                                       old_view->ranges + old_first,
+                                       old_last - old_first,
+                                       new_view->ranges + new_first,
+                                       new_last - new_first, false);
+    for (i = 0; i < new_first; i++) {
+        MEMORY_LISTENER_UPDATE_REGION(&new_view->ranges[i], as, Forward,
+                                      region_nop);
+    }
+    address_space_update_topology_pass(as,
+                                       old_view->ranges + old_first,
+                                       old_last - old_first,
+                                       new_view->ranges + new_first,
+                                       new_last - new_first, true);
+    for (i = new_last; i < new_view->nr; i++) {
+        MEMORY_LISTENER_UPDATE_REGION(&new_view->ranges[i], as, Forward,
+                                      region_nop);
+    }
+
+    /* Writes are protected by the BQL, so the old view can be read here
+     * without a reference.  Readers that may still be looking at it keep
+     * it alive until the end of the grace period.
+     *
+     * Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
      * ref/unref the MemoryRegions they get---unless they use them
      * outside the iothread mutex, in which case precise reference
      * counting is necessary.
      */
-    flatview_unref(old_view);
+    atomic_rcu_set(&as->current_map, new_view);
+    call_rcu(old_view, flatview_unref, rcu);
 
     address_space_update_ioeventfds(as);
 }
@@ -790,8 +951,13 @@ void memory_region_transaction_begin(void)
 
 static void memory_region_clear_pending(void)
 {
+    AddressSpace *as;
+
     memory_region_update_pending = false;
     ioeventfd_update_pending = false;
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        as->dirty_start = as->dirty_end = int128_zero();
+    }
 }
 
 void memory_region_transaction_commit(void)
@@ -829,6 +995,7 @@ static void memory_region_destructor_ram(MemoryRegion *mr)
 
 static void memory_region_destructor_alias(MemoryRegion *mr)
 {
+    QTAILQ_REMOVE(&mr->alias->aliases, mr, aliases_link);
     memory_region_unref(mr->alias);
 }
 
@@ -966,9 +1133,11 @@ static void memory_region_initfn(Object *obj)
 
     mr->ops = &unassigned_mem_ops;
     mr->enabled = true;
+    mr->global_locking = true;
     mr->romd_mode = true;
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
+    QTAILQ_INIT(&mr->aliases);
     QTAILQ_INIT(&mr->coalesced);
 
     op = object_property_add(OBJECT(mr), "container",
@@ -1202,6 +1371,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     mr->destructor = memory_region_destructor_alias;
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1354,6 +1524,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    memory_region_mark_all_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1375,13 +1546,9 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client)
 {
-    bool ret;
     assert(mr->terminates);
-    ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
-    if (ret) {
-        cpu_physical_memory_reset_dirty(mr->ram_addr + addr, size, client);
-    }
-    return ret;
+    return cpu_physical_memory_test_and_clear_dirty(mr->ram_addr + addr,
+                                                    size, client);
 }
 
 
@@ -1401,11 +1568,66 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection section;
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    AddrRange range, tmp;
+
+    range = addrrange_make(int128_make64(start), int128_make64(len));
+
+    /* This runs in the migration thread without the iothread mutex */
+    qemu_mutex_lock(&memory_listeners_lock);
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        as = listener->address_space_filter;
+        if (!listener->log_clear || !as) {
+            continue;
+        }
+
+        rcu_read_lock();
+        view = atomic_rcu_read(&as->current_map);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr != mr) {
+                continue;
+            }
+
+            /* The part of the flat range within @range, as offsets
+             * into @mr.
+             */
+            tmp = addrrange_make(int128_make64(fr->offset_in_region),
+                                 fr->addr.size);
+            if (!addrrange_intersects(tmp, range)) {
+                continue;
+            }
+            tmp = addrrange_intersection(tmp, range);
+
+            section = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = int128_get64(tmp.start),
+                .size = tmp.size,
+                .offset_within_address_space =
+                    int128_get64(fr->addr.start) + int128_get64(tmp.start)
+                    - fr->offset_in_region,
+                .readonly = fr->readonly,
+            };
+            listener->log_clear(listener, &section);
+        }
+        rcu_read_unlock();
+    }
+    qemu_mutex_unlock(&memory_listeners_lock);
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        memory_region_mark_all_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1416,6 +1638,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        memory_region_mark_all_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1547,6 +1770,11 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1651,6 +1879,8 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    memory_region_mark_dirty(mr, addrrange_make(int128_make64(offset),
+                                                subregion->size));
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -1689,6 +1919,8 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    memory_region_mark_dirty(mr, addrrange_make(int128_make64(subregion->addr),
+                                                subregion->size));
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
@@ -1703,11 +1935,15 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
+    memory_region_mark_all_dirty(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
 
-static void memory_region_readd_subregion(MemoryRegion *mr)
+/* Move @mr to @addr within its container.  Removing it first marks the
+ * range it leaves dirty, re-adding it marks the range it moves to.
+ */
+static void memory_region_readd_subregion(MemoryRegion *mr, hwaddr addr)
 {
     MemoryRegion *container = mr->container;
 
@@ -1716,17 +1952,19 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
         memory_region_ref(mr);
         memory_region_del_subregion(container, mr);
         mr->container = container;
+        mr->addr = addr;
         memory_region_update_container_subregions(mr);
         memory_region_unref(mr);
         memory_region_transaction_commit();
+    } else {
+        mr->addr = addr;
     }
 }
 
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
-        mr->addr = addr;
-        memory_region_readd_subregion(mr);
+        memory_region_readd_subregion(mr, addr);
     }
 }
 
@@ -1740,6 +1978,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    memory_region_mark_all_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1810,11 +2049,11 @@ MemoryRegionSection memory_region_find(MemoryRegion *mr,
     }
     range = addrrange_make(int128_make64(addr), int128_make64(size));
 
-    view = address_space_get_flatview(as);
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
     fr = flatview_lookup(view, range);
     if (!fr) {
-        flatview_unref(view);
-        return ret;
+        goto out;
     }
 
     while (fr > view->ranges && addrrange_intersects(fr[-1].addr, range)) {
@@ -1832,10 +2071,78 @@ MemoryRegionSection memory_region_find(MemoryRegion *mr,
     ret.readonly = fr->readonly;
     memory_region_ref(ret.mr);
 
-    flatview_unref(view);
+out:
+    rcu_read_unlock();
     return ret;
 }
 
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write)
+{
+    AddrRange range = addrrange_make(int128_make64(addr), int128_make64(len));
+    MemoryRegion *mr = NULL;
+    hwaddr offset = 0;
+    FlatView *view;
+    FlatRange *fr;
+    uint64_t val;
+
+    if (len != 1 && len != 2 && len != 4 && len != 8) {
+        return false;
+    }
+
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
+    fr = flatview_lookup(view, range);
+    if (fr && !fr->mr->global_locking && !fr->mr->flush_coalesced_mmio
+        && int128_ge(range.start, fr->addr.start)
+        && int128_le(addrrange_end(range), addrrange_end(fr->addr))) {
+        mr = fr->mr;
+        offset = addr - int128_get64(fr->addr.start) + fr->offset_in_region;
+        memory_region_ref(mr);
+    }
+    rcu_read_unlock();
+
+    if (!mr) {
+        return false;
+    }
+
+    if (is_write) {
+        switch (len) {
+        case 1:
+            val = ldub_p(buf);
+            break;
+        case 2:
+            val = lduw_p(buf);
+            break;
+        case 4:
+            val = ldl_p(buf);
+            break;
+        default:
+            val = ldq_p(buf);
+            break;
+        }
+        memory_region_dispatch_write(mr, offset, val, len);
+    } else {
+        memory_region_dispatch_read(mr, offset, &val, len);
+        switch (len) {
+        case 1:
+            stb_p(buf, val);
+            break;
+        case 2:
+            stw_p(buf, val);
+            break;
+        case 4:
+            stl_p(buf, val);
+            break;
+        default:
+            stq_p(buf, val);
+            break;
+        }
+    }
+    memory_region_unref(mr);
+    return true;
+}
+
 void address_space_sync_dirty_bitmap(AddressSpace *as)
 {
     FlatView *view;
@@ -1848,10 +2155,30 @@ void address_space_sync_dirty_bitmap(AddressSpace *as)
     flatview_unref(view);
 }
 
-void memory_global_dirty_log_start(void)
+void memory_global_dirty_log_start(Error **errp)
 {
+    MemoryListener *listener;
+    Error *local_err = NULL;
+
     global_dirty_log = true;
-    MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_global_start) {
+            listener->log_global_start(listener, &local_err);
+            if (local_err) {
+                break;
+            }
+        }
+    }
+
+    if (local_err) {
+        while ((listener = QTAILQ_PREV(listener, memory_listeners, link))) {
+            if (listener->log_global_stop) {
+                listener->log_global_stop(listener);
+            }
+        }
+        global_dirty_log = false;
+        error_propagate(errp, local_err);
+    }
 }
 
 void memory_global_dirty_log_stop(void)
@@ -1873,7 +2200,7 @@ static void listener_add_address_space(MemoryListener *listener,
 
     if (global_dirty_log) {
         if (listener->log_global_start) {
-            listener->log_global_start(listener);
+            listener->log_global_start(listener, &error_abort);
         }
     }
 
@@ -1900,6 +2227,7 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
     AddressSpace *as;
 
     listener->address_space_filter = filter;
+    qemu_mutex_lock(&memory_listeners_lock);
     if (QTAILQ_EMPTY(&memory_listeners)
         || listener->priority >= QTAILQ_LAST(&memory_listeners,
                                              memory_listeners)->priority) {
@@ -1912,6 +2240,7 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
         }
         QTAILQ_INSERT_BEFORE(other, listener, link);
     }
+    qemu_mutex_unlock(&memory_listeners_lock);
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         listener_add_address_space(listener, as);
@@ -1920,15 +2249,13 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
 
 void memory_listener_unregister(MemoryListener *listener)
 {
+    qemu_mutex_lock(&memory_listeners_lock);
     QTAILQ_REMOVE(&memory_listeners, listener, link);
+    qemu_mutex_unlock(&memory_listeners_lock);
 }
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 {
-    if (QTAILQ_EMPTY(&address_spaces)) {
-        memory_init();
-    }
-
     memory_region_transaction_begin();
     as->root = root;
     as->current_map = g_new(FlatView, 1);
@@ -1938,6 +2265,8 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
+    as->dirty_start = as->dirty_end = int128_zero();
+    address_space_mark_all_dirty(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
 }
@@ -1949,6 +2278,7 @@ void address_space_destroy(AddressSpace *as)
     /* Flush out anything from MemoryListeners listening in on this */
     memory_region_transaction_begin();
     as->root = NULL;
+    address_space_mark_all_dirty(as);
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_destroy_dispatch(as);
@@ -1957,7 +2287,7 @@ void address_space_destroy(AddressSpace *as)
         assert(listener->address_space_filter != as);
     }
 
-    flatview_unref(as->current_map);
+    call_rcu(as->current_map, flatview_unref, rcu);
     g_free(as->name);
     g_free(as->ioeventfds);
 }
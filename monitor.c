@@ -5039,7 +5039,8 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, QObject *request,
+                               Error *local_err)
 {
     int err;
     QObject *obj;
@@ -5050,16 +5051,15 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
-    if (!obj) {
-        // FIXME: should be triggered in json_parser_parse()
+    if (!request) {
+        error_free(local_err);
         qerror_report(QERR_JSON_PARSING);
         goto err_out;
     }
 
-    input = qmp_check_input_obj(obj);
+    input = qmp_check_input_obj(request);
     if (!input) {
-        qobject_decref(obj);
+        qobject_decref(request);
         goto err_out;
     }
 
@@ -5197,7 +5197,7 @@ static void monitor_control_event(void *opaque, int event)
         break;
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
-        json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        json_message_parser_init(&mon->mc->parser, handle_qmp_command, NULL);
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -5336,7 +5336,7 @@ void monitor_init(CharDriverState *chr, int flags)
                               monitor_control_event, mon);
         qemu_chr_fe_set_echo(chr, true);
 
-        json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        json_message_parser_init(&mon->mc->parser, handle_qmp_command, NULL);
     } else {
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_read,
                               monitor_event, mon);
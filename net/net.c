@@ -38,6 +38,7 @@
 #include "hw/qdev.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 #include "qapi-visit.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/dealloc-visitor.h"
@@ -202,14 +203,52 @@ static void qemu_net_client_destructor(NetClientState *nc)
     g_free(nc);
 }
 
+static const StatsField net_client_stats_fields[] = {
+    { "rx-packets", STATS_KIND_CUMULATIVE },
+    { "rx-bytes", STATS_KIND_CUMULATIVE },
+};
+
+static void net_client_stats_collect(void *opaque, uint64_t *values)
+{
+    NetClientState *nc = opaque;
+
+    values[0] = atomic_read(&nc->rx_packets);
+    values[1] = atomic_read(&nc->rx_bytes);
+}
+
+/* Count a packet of @len bytes received by @nc.  Dataplane code calls
+ * this from an iothread, hence the atomics.
+ */
+void qemu_net_client_count_rx(NetClientState *nc, size_t len)
+{
+    atomic_inc(&nc->rx_packets);
+    atomic_add(&nc->rx_bytes, len);
+}
+
+/* Queues of a multiqueue client share a name; tell them apart by index */
+static void net_client_stats_register(NetClientState *nc)
+{
+    char *prefix;
+
+    prefix = nc->queue_index
+             ? g_strdup_printf("net.%s.%u", nc->name, nc->queue_index)
+             : g_strdup_printf("net.%s", nc->name);
+    nc->stats = stats_register(prefix, net_client_stats_fields,
+                               ARRAY_SIZE(net_client_stats_fields),
+                               net_client_stats_collect, nc);
+    g_free(prefix);
+}
+
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
                                   NetClientState *peer,
                                   const char *model,
                                   const char *name,
+                                  unsigned int queue_index,
                                   NetClientDestructor *destructor)
 {
     nc->info = info;
+    nc->queue_index = queue_index;
     nc->model = g_strdup(model);
     if (name) {
         nc->name = g_strdup(name);
@@ -223,27 +262,38 @@ static void qemu_net_client_setup(NetClientState *nc,
         peer->peer = nc;
     }
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
+    net_client_stats_register(nc);
 
     nc->incoming_queue = qemu_new_net_queue(nc);
     nc->destructor = destructor;
 }
 
-NetClientState *qemu_new_net_client(NetClientInfo *info,
-                                    NetClientState *peer,
-                                    const char *model,
-                                    const char *name)
+/* Create queue @queue_index of a multiqueue backend */
+NetClientState *qemu_new_net_subqueue(NetClientInfo *info,
+                                      NetClientState *peer,
+                                      const char *model,
+                                      const char *name,
+                                      unsigned int queue_index)
 {
     NetClientState *nc;
 
     assert(info->size >= sizeof(NetClientState));
 
     nc = g_malloc0(info->size);
-    qemu_net_client_setup(nc, info, peer, model, name,
+    qemu_net_client_setup(nc, info, peer, model, name, queue_index,
                           qemu_net_client_destructor);
 
     return nc;
 }
 
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    return qemu_new_net_subqueue(info, peer, model, name, 0);
+}
+
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
@@ -263,9 +313,8 @@ NICState *qemu_new_nic(NetClientInfo *info,
     nic->opaque = opaque;
 
     for (i = 0; i < queues; i++) {
-        qemu_net_client_setup(&nic->ncs[i], info, peers[i], model, name,
+        qemu_net_client_setup(&nic->ncs[i], info, peers[i], model, name, i,
                               NULL);
-        nic->ncs[i].queue_index = i;
     }
 
     return nic;
@@ -298,6 +347,8 @@ void *qemu_get_nic_opaque(NetClientState *nc)
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
+    stats_unregister(nc->stats);
+    nc->stats = NULL;
 
     if (nc->info->cleanup) {
         nc->info->cleanup(nc);
@@ -452,6 +503,53 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * Zero-copy receive: borrow the receive buffers of @nc's peer so that a
+ * packet can be written into them directly instead of being copied by
+ * the peer's receive callback.
+ *
+ * The caller promises to write @hdr_len bytes of virtio-net header
+ * followed by the frame.  @size is a hint of how many bytes to lend.
+ * Returns the number of @iov entries filled, or 0 if the peer cannot
+ * lend buffers right now; the packet must then be sent the usual way.
+ *
+ * Every successful call must be followed by qemu_peer_put_rx_buffers(),
+ * before any other packet is sent to the peer.
+ */
+int qemu_peer_get_rx_buffers(NetClientState *nc, size_t hdr_len, size_t size,
+                             struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer || peer->receive_disabled || !peer->info->get_rx_buffers) {
+        return 0;
+    }
+
+    /* qemu_deliver_packet() would drop the packet */
+    if (nc->link_down || peer->link_down) {
+        return 0;
+    }
+
+    return peer->info->get_rx_buffers(peer, hdr_len, size, iov, iovcnt);
+}
+
+/*
+ * Complete a zero-copy receive started with qemu_peer_get_rx_buffers().
+ * @len is the number of bytes written, 0 to give the buffers back.  Data
+ * that did not fit in the lent buffers was written to @spill, starting at
+ * its beginning.
+ */
+void qemu_peer_put_rx_buffers(NetClientState *nc, size_t len,
+                              const uint8_t *spill)
+{
+    NetClientState *peer = nc->peer;
+
+    peer->info->put_rx_buffers(peer, len, spill);
+    if (len > 0) {
+        qemu_net_client_count_rx(peer, len);
+    }
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -498,6 +596,8 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        qemu_net_client_count_rx(nc, ret);
     }
 
     return ret;
@@ -614,6 +714,8 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        qemu_net_client_count_rx(nc, ret);
     }
 
     return ret;
@@ -1115,6 +1217,35 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+NetQueueInfoList *qmp_query_net_queues(Error **errp)
+{
+    NetClientState *nc;
+    NetQueueInfoList *head = NULL, **last = &head;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfoList *entry;
+        NetQueueInfo *info;
+        uint32_t len, maxlen;
+        uint64_t dropped;
+
+        qemu_net_queue_get_stats(nc->incoming_queue, &len, &maxlen,
+                                 &dropped);
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        info->length = len;
+        info->max_length = maxlen;
+        info->dropped = dropped;
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *last = entry;
+        last = &entry->next;
+    }
+
+    return head;
+}
+
 void do_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -39,11 +39,32 @@
  * unbounded queueing.
  */
 
+/* Queued packets are copied into buffers of a few fixed sizes.  Once
+ * delivered, a packet is kept on a free list of its queue for the next
+ * packet of the same size class, so that a queue which keeps filling up
+ * under backpressure does not go through the allocator for every packet.
+ */
+enum {
+    NET_PACKET_POOL_NONE = -1,      /* too large, allocated on its own */
+    NET_PACKET_POOL_SMALL,          /* up to a standard MTU frame */
+    NET_PACKET_POOL_LARGE,          /* up to a GSO packet */
+    NET_PACKET_POOL_MAX,
+};
+
+static const struct {
+    size_t size;                    /* bytes of packet data */
+    uint32_t max_free;              /* free packets kept per queue */
+} net_packet_pools[NET_PACKET_POOL_MAX] = {
+    [NET_PACKET_POOL_SMALL] = { 2048, 256 },
+    [NET_PACKET_POOL_LARGE] = { NET_BUFSIZE, 16 },
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    int pool;
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
@@ -52,8 +73,11 @@ struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
+    uint64_t nq_dropped;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_packets[NET_PACKET_POOL_MAX];
+    uint32_t nr_free_packets[NET_PACKET_POOL_MAX];
 
     unsigned delivering : 1;
 };
@@ -61,6 +85,7 @@ struct NetQueue {
 NetQueue *qemu_new_net_queue(void *opaque)
 {
     NetQueue *queue;
+    int i;
 
     queue = g_malloc0(sizeof(NetQueue));
 
@@ -69,6 +94,9 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    for (i = 0; i < NET_PACKET_POOL_MAX; i++) {
+        QTAILQ_INIT(&queue->free_packets[i]);
+    }
 
     queue->delivering = 0;
 
@@ -78,15 +106,74 @@ NetQueue *qemu_new_net_queue(void *opaque)
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
+    int i;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
 
+    for (i = 0; i < NET_PACKET_POOL_MAX; i++) {
+        QTAILQ_FOREACH_SAFE(packet, &queue->free_packets[i], entry, next) {
+            QTAILQ_REMOVE(&queue->free_packets[i], packet, entry);
+            g_free(packet);
+        }
+    }
+
     g_free(queue);
 }
 
+void qemu_net_queue_get_stats(NetQueue *queue, uint32_t *len,
+                              uint32_t *maxlen, uint64_t *dropped)
+{
+    *len = queue->nq_count;
+    *maxlen = queue->nq_maxlen;
+    *dropped = queue->nq_dropped;
+}
+
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int pool;
+
+    for (pool = 0; pool < NET_PACKET_POOL_MAX; pool++) {
+        if (size <= net_packet_pools[pool].size) {
+            break;
+        }
+    }
+
+    if (pool == NET_PACKET_POOL_MAX) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pool = NET_PACKET_POOL_NONE;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&queue->free_packets[pool]);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->free_packets[pool], packet, entry);
+        queue->nr_free_packets[pool]--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + net_packet_pools[pool].size);
+        packet->pool = pool;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    int pool = packet->pool;
+
+    if (pool == NET_PACKET_POOL_NONE ||
+        queue->nr_free_packets[pool] >= net_packet_pools[pool].max_free) {
+        g_free(packet);
+        return;
+    }
+
+    /* Most recently used first, it is more likely to be cache hot */
+    QTAILQ_INSERT_HEAD(&queue->free_packets[pool], packet, entry);
+    queue->nr_free_packets[pool]++;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -97,9 +184,10 @@ static void qemu_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -122,13 +210,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -233,10 +322,11 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
             queue->nq_count--;
+            queue->nq_dropped++;
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -266,7 +356,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
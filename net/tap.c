@@ -185,13 +185,73 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Maximum number of packets read per tap_send() call */
+#define TAP_SEND_BATCH 64
+
+/* Guest buffers asked for when reading straight into the peer */
+#define TAP_ZEROCOPY_SIZE 1518
+#define TAP_ZEROCOPY_IOV  64
+
+/*
+ * Read one packet directly into buffers lent by the peer.  Whatever does
+ * not fit (e.g. a large GSO packet) lands in s->buf.  Returns false if
+ * the peer did not lend buffers, otherwise stores the result of the read
+ * in @size.
+ */
+static bool tap_read_zerocopy(TAPState *s, ssize_t *size)
+{
+#ifdef __sun__
+    return false;
+#else
+    struct iovec iov[TAP_ZEROCOPY_IOV + 1];
+    size_t hdr_len;
+    ssize_t len;
+    int cnt;
+
+    /* The peer gets exactly what is read from the fd */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        return false;
+    }
+    hdr_len = s->using_vnet_hdr ? s->host_vnet_hdr_len : 0;
+
+    cnt = qemu_peer_get_rx_buffers(&s->nc, hdr_len,
+                                   hdr_len + TAP_ZEROCOPY_SIZE,
+                                   iov, TAP_ZEROCOPY_IOV);
+    if (!cnt) {
+        return false;
+    }
+    iov[cnt].iov_base = s->buf;
+    iov[cnt].iov_len = sizeof(s->buf);
+
+    do {
+        len = readv(s->fd, iov, cnt + 1);
+    } while (len == -1 && errno == EINTR);
+
+    qemu_peer_put_rx_buffers(&s->nc, len > 0 ? len : 0, s->buf);
+    *size = len;
+    return true;
+#endif
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
+    int packets = 0;
 
     while (qemu_can_send_packet(&s->nc)) {
         uint8_t *buf = s->buf;
+        ssize_t len;
+
+        if (tap_read_zerocopy(s, &len)) {
+            if (len <= 0) {
+                break;
+            }
+            if (++packets >= TAP_SEND_BATCH) {
+                break;
+            }
+            continue;
+        }
 
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
@@ -210,6 +270,17 @@ static void tap_send(void *opaque)
         } else if (size < 0) {
             break;
         }
+
+        /*
+         * When the host keeps receiving more packets while tap_send() is
+         * running we can hog the QEMU global mutex, and the peer cannot
+         * complete the batch (e.g. virtio-net delays the guest
+         * notification until we return).  Stop after a bounded number of
+         * packets; the fd is still readable and we will be called again.
+         */
+        if (++packets >= TAP_SEND_BATCH) {
+            break;
+        }
     }
 }
 
@@ -328,13 +399,14 @@ static NetClientInfo net_tap_info = {
 static TAPState *net_tap_fd_init(NetClientState *peer,
                                  const char *model,
                                  const char *name,
+                                 unsigned int queue_index,
                                  int fd,
                                  int vnet_hdr)
 {
     NetClientState *nc;
     TAPState *s;
 
-    nc = qemu_new_net_client(&net_tap_info, peer, model, name);
+    nc = qemu_new_net_subqueue(&net_tap_info, peer, model, name, queue_index);
 
     s = DO_UPCAST(TAPState, nc, nc);
 
@@ -542,7 +614,7 @@ int net_init_bridge(const NetClientOptions *opts, const char *name,
 
     vnet_hdr = tap_probe_vnet_hdr(fd);
 
-    s = net_tap_fd_init(peer, "bridge", name, fd, vnet_hdr);
+    s = net_tap_fd_init(peer, "bridge", name, 0, fd, vnet_hdr);
     if (!s) {
         close(fd);
         return -1;
@@ -591,12 +663,12 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                             const char *model, const char *name,
                             const char *ifname, const char *script,
                             const char *downscript, const char *vhostfdname,
-                            int vnet_hdr, int fd)
+                            unsigned int queue_index, int vnet_hdr, int fd)
 {
     TAPState *s;
     int vhostfd;
 
-    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
+    s = net_tap_fd_init(peer, model, name, queue_index, fd, vnet_hdr);
     if (!s) {
         return -1;
     }
@@ -728,7 +800,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         if (net_init_tap_one(tap, peer, "tap", name, NULL,
                              script, downscript,
-                             vhostfdname, vnet_hdr, fd)) {
+                             vhostfdname, 0, vnet_hdr, fd)) {
             return -1;
         }
     } else if (tap->has_fds) {
@@ -773,7 +845,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
             if (net_init_tap_one(tap, peer, "tap", name, ifname,
                                  script, downscript,
                                  tap->has_vhostfds ? vhost_fds[i] : NULL,
-                                 vnet_hdr, fd)) {
+                                 i, vnet_hdr, fd)) {
                 return -1;
             }
         }
@@ -795,7 +867,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         if (net_init_tap_one(tap, peer, "bridge", name, ifname,
                              script, downscript, vhostfdname,
-                             vnet_hdr, fd)) {
+                             0, vnet_hdr, fd)) {
             close(fd);
             return -1;
         }
@@ -832,7 +904,7 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
             if (net_init_tap_one(tap, peer, "tap", name, ifname,
                                  i >= 1 ? "no" : script,
                                  i >= 1 ? "no" : downscript,
-                                 vhostfdname, vnet_hdr, fd)) {
+                                 vhostfdname, i, vnet_hdr, fd)) {
                 close(fd);
                 return -1;
             }
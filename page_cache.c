@@ -41,18 +41,53 @@ struct CacheItem {
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set associative: a page address is hashed to a set of
+ * num_ways consecutive items and can be stored in any of them.  When
+ * the set is full, the item that was least recently inserted or looked
+ * up is replaced.
+ */
+#define PAGE_CACHE_WAYS 4
+
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static bool cache_alloc_sets(PageCache *cache, int64_t num_pages)
 {
     int64_t i;
 
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(PAGE_CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->num_ways;
+
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
+
+    /* We prefer not to abort if there is no memory */
+    cache->page_cache = g_try_malloc((cache->max_num_items) *
+                                     sizeof(*cache->page_cache));
+    if (!cache->page_cache) {
+        DPRINTF("Failed to allocate cache->page_cache\n");
+        return false;
+    }
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_addr = -1;
+    }
+    return true;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -74,25 +109,12 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
-
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    if (!cache_alloc_sets(cache, num_pages)) {
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
@@ -112,43 +134,80 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set that addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
+    uint64_t page = address / cache->page_size;
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+
+    /*
+     * Guest memory is usually dirtied in regular strides, which would all
+     * end up in the same few sets if only the low bits were used.
+     */
+    pos = ((page * 0x9e3779b97f4a7c15ULL) >> 32) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+/* Returns the item caching addr, or NULL if addr is not cached */
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the item to store addr in: its current one, a free one or the
+ * oldest one of its set.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set, *victim;
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    victim = cache_get_by_addr(cache, addr);
+    if (victim) {
+        return victim;
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+    return victim;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
@@ -160,7 +219,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     g_assert(cache->page_cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_victim(cache, addr);
 
     /* allocate page */
     if (!it->it_data) {
@@ -182,7 +241,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
+    PageCache old_cache;
     int64_t i;
 
     CacheItem *old_it, *new_it;
@@ -199,39 +258,45 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    old_cache = *cache;
+    if (!cache_alloc_sets(cache, pow2floor(new_num_pages))) {
         DPRINTF("Error creating new cache\n");
+        *cache = old_cache;
         return -1;
     }
+    cache->num_items = 0;
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+    /*
+     * Move all pages from the old sets.  Only the pointers move, the page
+     * data itself is not copied.  If a new set overflows, the least
+     * recently used pages are dropped.
+     */
+    for (i = 0; i < old_cache.max_num_items; i++) {
+        old_it = &old_cache.page_cache[i];
+        if (old_it->it_data == NULL) {
+            continue;
+        }
+        new_it = cache_get_victim(cache, old_it->it_addr);
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            /* keep the MRU page */
+            g_free(old_it->it_data);
+        } else {
+            if (!new_it->it_data) {
+                cache->num_items++;
             }
+            g_free(new_it->it_data);
+            new_it->it_data = old_it->it_data;
+            new_it->it_age = old_it->it_age;
+            new_it->it_addr = old_it->it_addr;
         }
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    g_free(old_cache.page_cache);
 
     return cache->max_num_items;
 }
+
+int64_t cache_num_items(const PageCache *cache)
+{
+    return cache->num_items;
+}
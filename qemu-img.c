@@ -915,7 +915,13 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
-    for(i = 1; i < n; i++) {
+    i = 1;
+    if (is_zero && can_use_buffer_find_nonzero_offset(buf, n * 512)) {
+        /* Skip the whole zero run in one go instead of sector by sector */
+        i = MAX(buffer_find_nonzero_offset(buf, n * 512) / 512, 1);
+        buf += (i - 1) * 512;
+    }
+    for(; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
             break;
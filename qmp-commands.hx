@@ -704,6 +704,80 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-period:i?",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its memory, without
+migrating it.  Migration is blocked until the measurement is complete.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds (json-int)
+- "sample-period": interval between two collections of the dirty pages in
+                   milliseconds, defaults to 1000 (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 5 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the status and result of the last dirty page rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "calc-time": length of the measurement in seconds (json-int, optional)
+- "sample-period": interval between two collections of the dirty pages in
+                   milliseconds (json-int, optional)
+- "dirty-pages-rate": pages dirtied by second (json-int, optional)
+- "page-size": size of a page in bytes (json-int, optional)
+- "blocks": per RAMBlock statistics (json-array of json-object, optional)
+     - "id": RAMBlock identifier (json-string)
+     - "size": RAMBlock size in bytes (json-int)
+     - "dirty-pages": pages found dirty over all sample periods (json-int)
+     - "dirty-pages-rate": pages dirtied by second (json-int)
+- "histogram": element i is the number of pages that were found dirty in
+               i + 1 sample periods, the last element also counts pages
+               dirty in more periods (json-array of json-int, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "calc-time": 5,
+        "sample-period": 1000,
+        "dirty-pages-rate": 2400,
+        "page-size": 4096,
+        "blocks": [ { "id": "pc.ram", "size": 1073741824,
+                      "dirty-pages": 11980, "dirty-pages-rate": 2396 },
+                    { "id": "vga.vram", "size": 16777216,
+                      "dirty-pages": 20, "dirty-pages-rate": 4 } ],
+        "histogram": [ 1830, 412, 96, 40, 2200, 0, 0 ]
+     }
+   }
+
 EQMP
 
     {
@@ -3527,6 +3601,50 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-net-queues",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_queues,
+    },
+
+SQMP
+query-net-queues
+----------------
+
+Show statistics about the queue of packets waiting to be delivered to
+each net client.
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "length": number of packets currently queued (json-int)
+- "max-length": queue length above which packets are dropped, unless
+                their sender waits for them to be delivered (json-int)
+- "dropped": number of packets dropped because the queue was full, or
+             discarded because their sender or receiver went away
+             (json-int)
+
+Example:
+
+-> { "execute": "query-net-queues" }
+<- { "return": [
+        {
+            "name": "hostnet0",
+            "length": 0,
+            "max-length": 10000,
+            "dropped": 0
+        },
+        {
+            "name": "net0",
+            "length": 17,
+            "max-length": 10000,
+            "dropped": 1024
+        }
+      ]
+   }
+
 EQMP
 
     {
@@ -3853,4 +3971,113 @@ Move mouse pointer to absolute coordinates (20000, 400).
                { "type": "abs", "data" : { "axis": "Y", "value" : 400 } } ] } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-stats-schema",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_stats_schema,
+    },
+
+SQMP
+query-stats-schema
+------------------
+
+Describe the statistics counters returned by query-stats.
+
+Return a json-object with the following information:
+
+- "generation": changes whenever counters are added or removed (json-int)
+- "fields": json-array of json-objects, in the order of the values
+  returned by query-stats, with:
+  - "name": counter name (json-string)
+  - "kind": "cumulative" or "instant" (json-string)
+
+Example:
+
+-> { "execute": "query-stats-schema" }
+<- { "return": { "generation": 3,
+                 "fields": [ { "name": "migration.ram.transferred",
+                               "kind": "cumulative" },
+                             ...
+                             { "name": "block.virtio0.rd_bytes",
+                               "kind": "cumulative" },
+                             ... ] } }
+
+EQMP
+
+    {
+        .name       = "query-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_stats,
+    },
+
+SQMP
+query-stats
+-----------
+
+Read every statistics counter in one go.
+
+Return a json-object with the following information:
+
+- "generation": the generation of the schema that describes "values"
+  (json-int)
+- "values": the counters as an array of little-endian 64-bit integers,
+  in the order given by query-stats-schema, encoded in base64
+  (json-string)
+
+Example:
+
+-> { "execute": "query-stats" }
+<- { "return": { "generation": 3,
+                 "values": "AAAAAAAAAAAAAAAAAAAAAA..." } }
+
+EQMP
+
+    {
+        .name       = "stats-shm-start",
+        .args_type  = "path:s,interval:i?",
+        .mhandler.cmd_new = qmp_marshal_input_stats_shm_start,
+    },
+
+SQMP
+stats-shm-start
+---------------
+
+Publish the statistics counters, with their description, in a file that
+other processes can map and read without sending any command.  The layout
+of the file is described in docs/stats.txt.
+
+Arguments:
+
+- "path": the file to create, typically under /dev/shm (json-string)
+- "interval": how often to update the file, in milliseconds, default 1000
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "stats-shm-start",
+     "arguments": { "path": "/dev/shm/qemu-stats-vm1" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "stats-shm-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_stats_shm_stop,
+    },
+
+SQMP
+stats-shm-stop
+--------------
+
+Stop updating the file set up by stats-shm-start.  The file is left in
+place.
+
+Example:
+
+-> { "execute": "stats-shm-stop" }
+<- { "return": {} }
+
 EQMP
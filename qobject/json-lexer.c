@@ -20,6 +20,9 @@
 
 #define MAX_TOKEN_SIZE (64ULL << 20)
 
+/* Token buffers up to this size are reused for the next token */
+#define MAX_REUSED_TOKEN_SIZE 4096
+
 /*
  * \"([^\\\"]|(\\\"\\'\\\\\\/\\b\\f\\n\\r\\t\\u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F]))*\"
  * '([^\\']|(\\\"\\'\\\\\\/\\b\\f\\n\\r\\t\\u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F]))*'
@@ -276,6 +279,20 @@ void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
     lexer->x = lexer->y = 0;
 }
 
+/* The emitter only borrows the token, so its buffer can be reused unless
+ * a long string made it grow too much.
+ */
+static void json_lexer_reset_token(JSONLexer *lexer)
+{
+    if (lexer->token->capacity > MAX_REUSED_TOKEN_SIZE) {
+        QDECREF(lexer->token);
+        lexer->token = qstring_new();
+    } else {
+        lexer->token->length = 0;
+        lexer->token->string[0] = 0;
+    }
+}
+
 static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
 {
     int char_consumed, new_state;
@@ -303,8 +320,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_reset_token(lexer);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +338,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_reset_token(lexer);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -338,8 +353,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
      */
     if (lexer->token->length > MAX_TOKEN_SIZE) {
         lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
+        json_lexer_reset_token(lexer);
         lexer->state = IN_START;
     }
 
@@ -24,93 +24,46 @@
 #include "qapi/qmp/json-lexer.h"
 #include "qapi/qmp/qerror.h"
 
-typedef struct JSONParserContext
-{
-    Error *err;
-    struct {
-        QObject **buf;
-        size_t pos;
-        size_t count;
-    } tokens;
-} JSONParserContext;
+struct JSONParserFrame {
+    QObject *container;         /* QDict or QList being filled */
+    QString *key;               /* key of the pending pair, for a QDict */
+};
+
+enum {
+    JSON_PARSER_VALUE,          /* a value must follow */
+    JSON_PARSER_VALUE_OR_END,   /* after '[' */
+    JSON_PARSER_KEY,            /* after ',' in an object */
+    JSON_PARSER_KEY_OR_END,     /* after '{' */
+    JSON_PARSER_COLON,
+    JSON_PARSER_COMMA_OR_END,
+    JSON_PARSER_DONE,
+};
 
 #define BUG_ON(cond) assert(!(cond))
 
-/**
- * TODO
- *
- * 0) make errors meaningful again
- * 1) add geometry information to tokens
- * 3) should we return a parsed size?
- * 4) deal with premature EOI
- */
-
-static QObject *parse_value(JSONParserContext *ctxt, va_list *ap);
-
-/**
- * Token manipulators
- *
- * tokens are dictionaries that contain a type, a string value, and geometry information
- * about a token identified by the lexer.  These are routines that make working with
- * these objects a bit easier.
- */
-static const char *token_get_value(QObject *obj)
-{
-    return qdict_get_str(qobject_to_qdict(obj), "token");
-}
-
-static JSONTokenType token_get_type(QObject *obj)
-{
-    return qdict_get_int(qobject_to_qdict(obj), "type");
-}
-
-static int token_is_operator(QObject *obj, char op)
-{
-    const char *val;
-
-    if (token_get_type(obj) != JSON_OPERATOR) {
-        return 0;
-    }
-
-    val = token_get_value(obj);
-
-    return (val[0] == op) && (val[1] == 0);
-}
-
-static int token_is_keyword(QObject *obj, const char *value)
+static int token_is_operator(const QString *token, JSONTokenType type, char op)
 {
-    if (token_get_type(obj) != JSON_KEYWORD) {
-        return 0;
-    }
-
-    return strcmp(token_get_value(obj), value) == 0;
-}
-
-static int token_is_escape(QObject *obj, const char *value)
-{
-    if (token_get_type(obj) != JSON_ESCAPE) {
-        return 0;
-    }
+    const char *val = qstring_get_str(token);
 
-    return (strcmp(token_get_value(obj), value) == 0);
+    return type == JSON_OPERATOR && val[0] == op && val[1] == 0;
 }
 
 /**
  * Error handler
  */
-static void GCC_FMT_ATTR(3, 4) parse_error(JSONParserContext *ctxt,
-                                           QObject *token, const char *msg, ...)
+static void GCC_FMT_ATTR(2, 3) parse_error(JSONParser *parser,
+                                           const char *msg, ...)
 {
     va_list ap;
     char message[1024];
     va_start(ap, msg);
     vsnprintf(message, sizeof(message), msg, ap);
     va_end(ap);
-    if (ctxt->err) {
-        error_free(ctxt->err);
-        ctxt->err = NULL;
+    if (parser->err) {
+        error_free(parser->err);
+        parser->err = NULL;
     }
-    error_setg(&ctxt->err, "JSON parse error, %s", message);
+    error_setg(&parser->err, "JSON parse error, %s", message);
 }
 
 /**
@@ -177,60 +130,60 @@ static int hex2decimal(char ch)
  *      \t
  *      \u four-hex-digits 
  */
-static QString *qstring_from_escaped_str(JSONParserContext *ctxt, QObject *token)
+static QString *qstring_from_escaped_str(JSONParser *parser,
+                                         const QString *token)
 {
-    const char *ptr = token_get_value(token);
+    const char *ptr = qstring_get_str(token);
+    const char *run;
     QString *str;
-    int double_quote = 1;
-
-    if (*ptr == '"') {
-        double_quote = 1;
-    } else {
-        double_quote = 0;
-    }
-    ptr++;
+    char quote = *ptr++;
 
     str = qstring_new();
-    while (*ptr && 
-           ((double_quote && *ptr != '"') || (!double_quote && *ptr != '\''))) {
+    while (*ptr && *ptr != quote) {
+        /* Copy everything up to the next escape or the end in one go */
+        for (run = ptr; *ptr && *ptr != quote && *ptr != '\\'; ptr++) {
+            /* nothing */
+        }
+        qstring_append_len(str, run, ptr - run);
+
         if (*ptr == '\\') {
             ptr++;
 
             switch (*ptr) {
             case '"':
-                qstring_append(str, "\"");
+                qstring_append_chr(str, '"');
                 ptr++;
                 break;
             case '\'':
-                qstring_append(str, "'");
+                qstring_append_chr(str, '\'');
                 ptr++;
                 break;
             case '\\':
-                qstring_append(str, "\\");
+                qstring_append_chr(str, '\\');
                 ptr++;
                 break;
             case '/':
-                qstring_append(str, "/");
+                qstring_append_chr(str, '/');
                 ptr++;
                 break;
             case 'b':
-                qstring_append(str, "\b");
+                qstring_append_chr(str, '\b');
                 ptr++;
                 break;
             case 'f':
-                qstring_append(str, "\f");
+                qstring_append_chr(str, '\f');
                 ptr++;
                 break;
             case 'n':
-                qstring_append(str, "\n");
+                qstring_append_chr(str, '\n');
                 ptr++;
                 break;
             case 'r':
-                qstring_append(str, "\r");
+                qstring_append_chr(str, '\r');
                 ptr++;
                 break;
             case 't':
-                qstring_append(str, "\t");
+                qstring_append_chr(str, '\t');
                 ptr++;
                 break;
             case 'u': {
@@ -244,7 +197,7 @@ static QString *qstring_from_escaped_str(JSONParserContext *ctxt, QObject *token
                     if (qemu_isxdigit(*ptr)) {
                         unicode_char |= hex2decimal(*ptr) << ((3 - i) * 4);
                     } else {
-                        parse_error(ctxt, token,
+                        parse_error(parser,
                                     "invalid hex escape sequence in string");
                         goto out;
                     }
@@ -255,16 +208,9 @@ static QString *qstring_from_escaped_str(JSONParserContext *ctxt, QObject *token
                 qstring_append(str, utf8_char);
             }   break;
             default:
-                parse_error(ctxt, token, "invalid escape sequence in string");
+                parse_error(parser, "invalid escape sequence in string");
                 goto out;
             }
-        } else {
-            char dummy[2];
-
-            dummy[0] = *ptr++;
-            dummy[1] = 0;
-
-            qstring_append(str, dummy);
         }
     }
 
@@ -275,439 +221,294 @@ out:
     return NULL;
 }
 
-static QObject *parser_context_pop_token(JSONParserContext *ctxt)
+static QObject *parse_escape(JSONParser *parser, const char *val)
 {
-    QObject *token;
-    g_assert(ctxt->tokens.pos < ctxt->tokens.count);
-    token = ctxt->tokens.buf[ctxt->tokens.pos];
-    ctxt->tokens.pos++;
-    return token;
-}
+    va_list *ap = parser->ap;
 
-/* Note: parser_context_{peek|pop}_token do not increment the
- * token object's refcount. In both cases the references will continue
- * to be tracked and cleaned up in parser_context_free(), so do not
- * attempt to free the token object.
- */
-static QObject *parser_context_peek_token(JSONParserContext *ctxt)
-{
-    QObject *token;
-    g_assert(ctxt->tokens.pos < ctxt->tokens.count);
-    token = ctxt->tokens.buf[ctxt->tokens.pos];
-    return token;
-}
-
-static JSONParserContext parser_context_save(JSONParserContext *ctxt)
-{
-    JSONParserContext saved_ctxt = {0};
-    saved_ctxt.tokens.pos = ctxt->tokens.pos;
-    saved_ctxt.tokens.count = ctxt->tokens.count;
-    saved_ctxt.tokens.buf = ctxt->tokens.buf;
-    return saved_ctxt;
-}
-
-static void parser_context_restore(JSONParserContext *ctxt,
-                                   JSONParserContext saved_ctxt)
-{
-    ctxt->tokens.pos = saved_ctxt.tokens.pos;
-    ctxt->tokens.count = saved_ctxt.tokens.count;
-    ctxt->tokens.buf = saved_ctxt.tokens.buf;
-}
-
-static void tokens_append_from_iter(QObject *obj, void *opaque)
-{
-    JSONParserContext *ctxt = opaque;
-    g_assert(ctxt->tokens.pos < ctxt->tokens.count);
-    ctxt->tokens.buf[ctxt->tokens.pos++] = obj;
-    qobject_incref(obj);
-}
-
-static JSONParserContext *parser_context_new(QList *tokens)
-{
-    JSONParserContext *ctxt;
-    size_t count;
-
-    if (!tokens) {
+    if (ap == NULL) {
         return NULL;
     }
 
-    count = qlist_size(tokens);
-    if (count == 0) {
-        return NULL;
+    if (!strcmp(val, "%p")) {
+        return va_arg(*ap, QObject *);
+    } else if (!strcmp(val, "%i")) {
+        return QOBJECT(qbool_from_int(va_arg(*ap, int)));
+    } else if (!strcmp(val, "%d")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, int)));
+    } else if (!strcmp(val, "%ld")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, long)));
+    } else if (!strcmp(val, "%lld") || !strcmp(val, "%I64d")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, long long)));
+    } else if (!strcmp(val, "%s")) {
+        return QOBJECT(qstring_from_str(va_arg(*ap, const char *)));
+    } else if (!strcmp(val, "%f")) {
+        return QOBJECT(qfloat_from_double(va_arg(*ap, double)));
     }
 
-    ctxt = g_malloc0(sizeof(JSONParserContext));
-    ctxt->tokens.pos = 0;
-    ctxt->tokens.count = count;
-    ctxt->tokens.buf = g_malloc(count * sizeof(QObject *));
-    qlist_iter(tokens, tokens_append_from_iter, ctxt);
-    ctxt->tokens.pos = 0;
-
-    return ctxt;
+    return NULL;
 }
 
-/* to support error propagation, ctxt->err must be freed separately */
-static void parser_context_free(JSONParserContext *ctxt)
+/* Return the value of a token that is not an operator, or NULL */
+static QObject *parse_scalar(JSONParser *parser, const QString *token,
+                             JSONTokenType type)
 {
-    int i;
-    if (ctxt) {
-        for (i = 0; i < ctxt->tokens.count; i++) {
-            qobject_decref(ctxt->tokens.buf[i]);
+    const char *val = qstring_get_str(token);
+
+    switch (type) {
+    case JSON_STRING:
+        return QOBJECT(qstring_from_escaped_str(parser, token));
+    case JSON_ESCAPE:
+        return parse_escape(parser, val);
+    case JSON_KEYWORD:
+        if (!strcmp(val, "true")) {
+            return QOBJECT(qbool_from_int(true));
+        } else if (!strcmp(val, "false")) {
+            return QOBJECT(qbool_from_int(false));
+        }
+        parse_error(parser, "invalid keyword `%s'", val);
+        return NULL;
+    case JSON_INTEGER: {
+        /* A possibility exists that this is a whole-valued float where the
+         * fractional part was left out due to being 0 (.0). It's not a big
+         * deal to treat these as ints in the parser, so long as users of the
+         * resulting QObject know to expect a QInt in place of a QFloat in
+         * cases like these.
+         *
+         * However, in some cases these values will overflow/underflow a
+         * QInt/int64 container, thus we should assume these are to be handled
+         * as QFloats/doubles rather than silently changing their values.
+         *
+         * strtoll() indicates these instances by setting errno to ERANGE
+         */
+        int64_t value;
+
+        errno = 0; /* strtoll doesn't set errno on success */
+        value = strtoll(val, NULL, 10);
+        if (errno != ERANGE) {
+            return QOBJECT(qint_from_int(value));
         }
-        g_free(ctxt->tokens.buf);
-        g_free(ctxt);
+        /* fall through to JSON_FLOAT */
+    }
+    case JSON_FLOAT:
+        /* FIXME dependent on locale */
+        return QOBJECT(qfloat_from_double(strtod(val, NULL)));
+    case JSON_ERROR:
+        parse_error(parser, "invalid token");
+        return NULL;
+    default:
+        return NULL;
     }
 }
 
 /**
  * Parsing rules
+ *
+ * Open containers are kept on parser->stack; a complete value is stored
+ * into the innermost one, or becomes the result at the top level.
  */
-static int parse_pair(JSONParserContext *ctxt, QDict *dict, va_list *ap)
+static void parser_push(JSONParser *parser, QObject *container)
 {
-    QObject *key = NULL, *token = NULL, *value, *peek;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    key = parse_value(ctxt, ap);
-    if (!key || qobject_type(key) != QTYPE_QSTRING) {
-        parse_error(ctxt, peek, "key is not a string in object");
-        goto out;
-    }
+    JSONParserFrame *frame;
 
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
+    if (parser->depth == parser->stack_size) {
+        parser->stack_size = MAX(parser->stack_size * 2, 16);
+        parser->stack = g_renew(JSONParserFrame, parser->stack,
+                                parser->stack_size);
     }
 
-    if (!token_is_operator(token, ':')) {
-        parse_error(ctxt, token, "missing : in object pair");
-        goto out;
-    }
-
-    value = parse_value(ctxt, ap);
-    if (value == NULL) {
-        parse_error(ctxt, token, "Missing value in dict");
-        goto out;
-    }
-
-    qdict_put_obj(dict, qstring_get_str(qobject_to_qstring(key)), value);
-
-    qobject_decref(key);
-
-    return 0;
-
-out:
-    parser_context_restore(ctxt, saved_ctxt);
-    qobject_decref(key);
-
-    return -1;
+    frame = &parser->stack[parser->depth++];
+    frame->container = container;
+    frame->key = NULL;
 }
 
-static QObject *parse_object(JSONParserContext *ctxt, va_list *ap)
+static void parser_add_value(JSONParser *parser, QObject *obj)
 {
-    QDict *dict = NULL;
-    QObject *token, *peek;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
+    JSONParserFrame *frame;
 
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        goto out;
+    if (parser->depth == 0) {
+        parser->result = obj;
+        parser->state = JSON_PARSER_DONE;
+        return;
     }
 
-    if (!token_is_operator(token, '{')) {
-        goto out;
-    }
-
-    dict = qdict_new();
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    if (!token_is_operator(peek, '}')) {
-        if (parse_pair(ctxt, dict, ap) == -1) {
-            goto out;
-        }
-
-        token = parser_context_pop_token(ctxt);
-        if (token == NULL) {
-            parse_error(ctxt, NULL, "premature EOI");
-            goto out;
-        }
-
-        while (!token_is_operator(token, '}')) {
-            if (!token_is_operator(token, ',')) {
-                parse_error(ctxt, token, "expected separator in dict");
-                goto out;
-            }
-
-            if (parse_pair(ctxt, dict, ap) == -1) {
-                goto out;
-            }
-
-            token = parser_context_pop_token(ctxt);
-            if (token == NULL) {
-                parse_error(ctxt, NULL, "premature EOI");
-                goto out;
-            }
-        }
+    frame = &parser->stack[parser->depth - 1];
+    if (frame->key) {
+        qdict_put_obj(qobject_to_qdict(frame->container),
+                      qstring_get_str(frame->key), obj);
+        QDECREF(frame->key);
+        frame->key = NULL;
     } else {
-        (void)parser_context_pop_token(ctxt);
+        qlist_append_obj(qobject_to_qlist(frame->container), obj);
     }
-
-    return QOBJECT(dict);
-
-out:
-    parser_context_restore(ctxt, saved_ctxt);
-    QDECREF(dict);
-    return NULL;
+    parser->state = JSON_PARSER_COMMA_OR_END;
 }
 
-static QObject *parse_array(JSONParserContext *ctxt, va_list *ap)
+static void parser_pop(JSONParser *parser)
 {
-    QList *list = NULL;
-    QObject *token, *peek;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
-
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        goto out;
-    }
-
-    if (!token_is_operator(token, '[')) {
-        goto out;
-    }
-
-    list = qlist_new();
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    if (!token_is_operator(peek, ']')) {
-        QObject *obj;
-
-        obj = parse_value(ctxt, ap);
-        if (obj == NULL) {
-            parse_error(ctxt, token, "expecting value");
-            goto out;
-        }
-
-        qlist_append_obj(list, obj);
-
-        token = parser_context_pop_token(ctxt);
-        if (token == NULL) {
-            parse_error(ctxt, NULL, "premature EOI");
-            goto out;
-        }
-
-        while (!token_is_operator(token, ']')) {
-            if (!token_is_operator(token, ',')) {
-                parse_error(ctxt, token, "expected separator in list");
-                goto out;
-            }
+    QObject *container = parser->stack[--parser->depth].container;
 
-            obj = parse_value(ctxt, ap);
-            if (obj == NULL) {
-                parse_error(ctxt, token, "expecting value");
-                goto out;
-            }
+    parser_add_value(parser, container);
+}
 
-            qlist_append_obj(list, obj);
+static void parse_value(JSONParser *parser, const QString *token,
+                        JSONTokenType type)
+{
+    QObject *obj;
 
-            token = parser_context_pop_token(ctxt);
-            if (token == NULL) {
-                parse_error(ctxt, NULL, "premature EOI");
-                goto out;
-            }
-        }
+    if (token_is_operator(token, type, '{')) {
+        parser_push(parser, QOBJECT(qdict_new()));
+        parser->state = JSON_PARSER_KEY_OR_END;
+    } else if (token_is_operator(token, type, '[')) {
+        parser_push(parser, QOBJECT(qlist_new()));
+        parser->state = JSON_PARSER_VALUE_OR_END;
     } else {
-        (void)parser_context_pop_token(ctxt);
+        obj = parse_scalar(parser, token, type);
+        if (obj) {
+            parser_add_value(parser, obj);
+        } else if (!parser->err) {
+            parse_error(parser, "expecting value");
+        }
     }
-
-    return QOBJECT(list);
-
-out:
-    parser_context_restore(ctxt, saved_ctxt);
-    QDECREF(list);
-    return NULL;
 }
 
-static QObject *parse_keyword(JSONParserContext *ctxt)
+static void parse_key(JSONParser *parser, const QString *token,
+                      JSONTokenType type)
 {
-    QObject *token, *ret;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
+    QObject *key = parse_scalar(parser, token, type);
 
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        goto out;
+    if (parser->err) {
+        qobject_decref(key);
+        return;
     }
-
-    if (token_get_type(token) != JSON_KEYWORD) {
-        goto out;
-    }
-
-    if (token_is_keyword(token, "true")) {
-        ret = QOBJECT(qbool_from_int(true));
-    } else if (token_is_keyword(token, "false")) {
-        ret = QOBJECT(qbool_from_int(false));
-    } else {
-        parse_error(ctxt, token, "invalid keyword `%s'", token_get_value(token));
-        goto out;
+    if (!key || qobject_type(key) != QTYPE_QSTRING) {
+        qobject_decref(key);
+        parse_error(parser, "key is not a string in object");
+        return;
     }
 
-    return ret;
-
-out: 
-    parser_context_restore(ctxt, saved_ctxt);
-
-    return NULL;
+    parser->stack[parser->depth - 1].key = qobject_to_qstring(key);
+    parser->state = JSON_PARSER_COLON;
 }
 
-static QObject *parse_escape(JSONParserContext *ctxt, va_list *ap)
+static void parse_separator(JSONParser *parser, const QString *token,
+                            JSONTokenType type)
 {
-    QObject *token = NULL, *obj;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
+    QObject *container = parser->stack[parser->depth - 1].container;
 
-    if (ap == NULL) {
-        goto out;
-    }
-
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        goto out;
-    }
-
-    if (token_is_escape(token, "%p")) {
-        obj = va_arg(*ap, QObject *);
-    } else if (token_is_escape(token, "%i")) {
-        obj = QOBJECT(qbool_from_int(va_arg(*ap, int)));
-    } else if (token_is_escape(token, "%d")) {
-        obj = QOBJECT(qint_from_int(va_arg(*ap, int)));
-    } else if (token_is_escape(token, "%ld")) {
-        obj = QOBJECT(qint_from_int(va_arg(*ap, long)));
-    } else if (token_is_escape(token, "%lld") ||
-               token_is_escape(token, "%I64d")) {
-        obj = QOBJECT(qint_from_int(va_arg(*ap, long long)));
-    } else if (token_is_escape(token, "%s")) {
-        obj = QOBJECT(qstring_from_str(va_arg(*ap, const char *)));
-    } else if (token_is_escape(token, "%f")) {
-        obj = QOBJECT(qfloat_from_double(va_arg(*ap, double)));
+    if (qobject_type(container) == QTYPE_QDICT) {
+        if (token_is_operator(token, type, '}')) {
+            parser_pop(parser);
+        } else if (token_is_operator(token, type, ',')) {
+            parser->state = JSON_PARSER_KEY;
+        } else {
+            parse_error(parser, "expected separator in dict");
+        }
     } else {
-        goto out;
+        if (token_is_operator(token, type, ']')) {
+            parser_pop(parser);
+        } else if (token_is_operator(token, type, ',')) {
+            parser->state = JSON_PARSER_VALUE;
+        } else {
+            parse_error(parser, "expected separator in list");
+        }
     }
-
-    return obj;
-
-out:
-    parser_context_restore(ctxt, saved_ctxt);
-
-    return NULL;
 }
 
-static QObject *parse_literal(JSONParserContext *ctxt)
+void json_parser_feed(JSONParser *parser, const QString *token,
+                      JSONTokenType type)
 {
-    QObject *token, *obj;
-    JSONParserContext saved_ctxt = parser_context_save(ctxt);
-
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        goto out;
+    if (parser->err) {
+        return;
     }
 
-    switch (token_get_type(token)) {
-    case JSON_STRING:
-        obj = QOBJECT(qstring_from_escaped_str(ctxt, token));
+    switch (parser->state) {
+    case JSON_PARSER_VALUE_OR_END:
+        if (token_is_operator(token, type, ']')) {
+            parser_pop(parser);
+            break;
+        }
+        /* fall through */
+    case JSON_PARSER_VALUE:
+        parse_value(parser, token, type);
         break;
-    case JSON_INTEGER: {
-        /* A possibility exists that this is a whole-valued float where the
-         * fractional part was left out due to being 0 (.0). It's not a big
-         * deal to treat these as ints in the parser, so long as users of the
-         * resulting QObject know to expect a QInt in place of a QFloat in
-         * cases like these.
-         *
-         * However, in some cases these values will overflow/underflow a
-         * QInt/int64 container, thus we should assume these are to be handled
-         * as QFloats/doubles rather than silently changing their values.
-         *
-         * strtoll() indicates these instances by setting errno to ERANGE
-         */
-        int64_t value;
-
-        errno = 0; /* strtoll doesn't set errno on success */
-        value = strtoll(token_get_value(token), NULL, 10);
-        if (errno != ERANGE) {
-            obj = QOBJECT(qint_from_int(value));
+    case JSON_PARSER_KEY_OR_END:
+        if (token_is_operator(token, type, '}')) {
+            parser_pop(parser);
             break;
         }
-        /* fall through to JSON_FLOAT */
-    }
-    case JSON_FLOAT:
-        /* FIXME dependent on locale */
-        obj = QOBJECT(qfloat_from_double(strtod(token_get_value(token), NULL)));
+        /* fall through */
+    case JSON_PARSER_KEY:
+        parse_key(parser, token, type);
+        break;
+    case JSON_PARSER_COLON:
+        if (token_is_operator(token, type, ':')) {
+            parser->state = JSON_PARSER_VALUE;
+        } else {
+            parse_error(parser, "missing : in object pair");
+        }
+        break;
+    case JSON_PARSER_COMMA_OR_END:
+        parse_separator(parser, token, type);
+        break;
+    case JSON_PARSER_DONE:
+        parse_error(parser, "unexpected token after value");
         break;
     default:
-        goto out;
+        BUG_ON(true);
     }
-
-    return obj;
-
-out:
-    parser_context_restore(ctxt, saved_ctxt);
-
-    return NULL;
 }
 
-static QObject *parse_value(JSONParserContext *ctxt, va_list *ap)
+static void parser_reset(JSONParser *parser)
 {
-    QObject *obj;
+    while (parser->depth) {
+        JSONParserFrame *frame = &parser->stack[--parser->depth];
 
-    obj = parse_object(ctxt, ap);
-    if (obj == NULL) {
-        obj = parse_array(ctxt, ap);
-    }
-    if (obj == NULL) {
-        obj = parse_escape(ctxt, ap);
-    }
-    if (obj == NULL) {
-        obj = parse_keyword(ctxt);
-    } 
-    if (obj == NULL) {
-        obj = parse_literal(ctxt);
+        qobject_decref(frame->container);
+        QDECREF(frame->key);
     }
 
-    return obj;
+    qobject_decref(parser->result);
+    parser->result = NULL;
+    error_free(parser->err);
+    parser->err = NULL;
+    parser->state = JSON_PARSER_VALUE;
 }
 
-QObject *json_parser_parse(QList *tokens, va_list *ap)
+void json_parser_init(JSONParser *parser, va_list *ap)
 {
-    return json_parser_parse_err(tokens, ap, NULL);
+    parser->ap = ap;
+    parser->err = NULL;
+    parser->result = NULL;
+    parser->stack = NULL;
+    parser->depth = 0;
+    parser->stack_size = 0;
+    parser->state = JSON_PARSER_VALUE;
 }
 
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp)
+QObject *json_parser_finish(JSONParser *parser, Error **errp)
 {
-    JSONParserContext *ctxt = parser_context_new(tokens);
-    QObject *result;
+    QObject *result = NULL;
 
-    if (!ctxt) {
-        return NULL;
+    if (!parser->err && parser->state != JSON_PARSER_DONE) {
+        parse_error(parser, "premature EOI");
     }
 
-    result = parse_value(ctxt, ap);
-
-    error_propagate(errp, ctxt->err);
-
-    parser_context_free(ctxt);
+    if (parser->err) {
+        error_propagate(errp, parser->err);
+        parser->err = NULL;
+    } else {
+        result = parser->result;
+        parser->result = NULL;
+    }
 
+    parser_reset(parser);
     return result;
 }
+
+void json_parser_destroy(JSONParser *parser)
+{
+    parser_reset(parser);
+    g_free(parser->stack);
+    parser->stack = NULL;
+    parser->stack_size = 0;
+}
@@ -11,11 +11,9 @@
  *
  */
 
-#include "qapi/qmp/qlist.h"
-#include "qapi/qmp/qint.h"
-#include "qapi/qmp/qdict.h"
 #include "qemu-common.h"
 #include "qapi/qmp/json-lexer.h"
+#include "qapi/qmp/json-parser.h"
 #include "qapi/qmp/json-streamer.h"
 
 #define MAX_TOKEN_SIZE (64ULL << 20)
@@ -24,7 +22,8 @@
 static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTokenType type, int x, int y)
 {
     JSONMessageParser *parser = container_of(lexer, JSONMessageParser, lexer);
-    QDict *dict;
+    Error *err = NULL;
+    QObject *obj;
 
     if (type == JSON_OPERATOR) {
         switch (qstring_get_str(token)[0]) {
@@ -45,19 +44,12 @@ static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTok
         }
     }
 
-    dict = qdict_new();
-    qdict_put(dict, "type", qint_from_int(type));
-    QINCREF(token);
-    qdict_put(dict, "token", token);
-    qdict_put(dict, "x", qint_from_int(x));
-    qdict_put(dict, "y", qint_from_int(y));
-
     parser->token_size += token->length;
 
-    qlist_append(parser->tokens, dict);
+    json_parser_feed(&parser->parser, token, type);
 
     if (type == JSON_ERROR) {
-        goto out_emit_bad;
+        goto out_emit;
     } else if (parser->brace_count < 0 ||
         parser->bracket_count < 0 ||
         (parser->brace_count == 0 &&
@@ -67,40 +59,34 @@ static void json_message_process_token(JSONLexer *lexer, QString *token, JSONTok
                parser->bracket_count > MAX_NESTING ||
                parser->brace_count > MAX_NESTING) {
         /* Security consideration, we limit total memory allocated per object
-         * and the maximum recursion depth that a message can force.
+         * and the maximum recursion depth that a message can force.  The
+         * truncated message is reported as an error.
          */
         goto out_emit;
     }
 
     return;
 
-out_emit_bad:
-    /* clear out token list and tell the parser to emit and error
-     * indication by passing it a NULL list
-     */
-    QDECREF(parser->tokens);
-    parser->tokens = NULL;
 out_emit:
-    /* send current list of tokens to parser and reset tokenizer */
+    /* hand the value or the error to the user and reset for the next one */
     parser->brace_count = 0;
     parser->bracket_count = 0;
-    parser->emit(parser, parser->tokens);
-    if (parser->tokens) {
-        QDECREF(parser->tokens);
-    }
-    parser->tokens = qlist_new();
     parser->token_size = 0;
+    obj = json_parser_finish(&parser->parser, &err);
+    parser->emit(parser, obj, err);
 }
 
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *))
+                              void (*func)(JSONMessageParser *, QObject *,
+                                           Error *),
+                              va_list *ap)
 {
     parser->emit = func;
     parser->brace_count = 0;
     parser->bracket_count = 0;
-    parser->tokens = qlist_new();
     parser->token_size = 0;
 
+    json_parser_init(&parser->parser, ap);
     json_lexer_init(&parser->lexer, json_message_process_token);
 }
 
@@ -118,5 +104,5 @@ int json_message_parser_flush(JSONMessageParser *parser)
 void json_message_parser_destroy(JSONMessageParser *parser)
 {
     json_lexer_destroy(&parser->lexer);
-    QDECREF(parser->tokens);
+    json_parser_destroy(&parser->parser);
 }
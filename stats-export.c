@@ -0,0 +1,241 @@
+/*
+ * Statistics export
+ *
+ * QMP access to the statistics registry, and a shared memory file that
+ * a monitoring agent can read without talking to QEMU at all.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/stats.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+#define STATS_SHM_DEFAULT_INTERVAL  1000
+
+static void stats_schema_add_field(const char *prefix, const StatsField *field,
+                                   void *opaque)
+{
+    StatsFieldInfoList ***tail = opaque;
+    StatsFieldInfoList *entry = g_new0(StatsFieldInfoList, 1);
+
+    entry->value = g_new0(StatsFieldInfo, 1);
+    entry->value->name = g_strdup_printf("%s.%s", prefix, field->name);
+    entry->value->kind = field->kind;
+
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+StatsSchema *qmp_query_stats_schema(Error **errp)
+{
+    StatsSchema *schema = g_new0(StatsSchema, 1);
+    StatsFieldInfoList **tail = &schema->fields;
+
+    schema->generation = stats_generation();
+    stats_foreach_field(stats_schema_add_field, &tail);
+    return schema;
+}
+
+StatsValues *qmp_query_stats(Error **errp)
+{
+    StatsValues *info = g_new0(StatsValues, 1);
+    int i, nr = stats_nr_fields();
+    uint64_t *values = g_new(uint64_t, nr);
+
+    stats_collect(values);
+    for (i = 0; i < nr; i++) {
+        cpu_to_le64s(&values[i]);
+    }
+
+    info->generation = stats_generation();
+    info->values = g_base64_encode((const guchar *)values,
+                                   nr * sizeof(*values));
+    g_free(values);
+    return info;
+}
+
+#ifndef _WIN32
+#include <sys/mman.h>
+
+typedef struct StatsShm {
+    int fd;
+    void *map;
+    size_t size;
+    bool laid_out;
+    uint64_t generation;
+    int64_t interval;
+    QEMUTimer *timer;
+} StatsShm;
+
+static StatsShm *stats_shm;
+
+static size_t stats_shm_size(int nr)
+{
+    return sizeof(StatsShmHeader) +
+           nr * (sizeof(StatsShmField) + sizeof(uint64_t));
+}
+
+static void stats_shm_add_field(const char *prefix, const StatsField *field,
+                                void *opaque)
+{
+    StatsShmField **next = opaque;
+    StatsShmField *f = (*next)++;
+
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s.%s", prefix, field->name);
+    f->kind = field->kind;
+}
+
+/* Lay out the file for the current schema, growing it if needed.  Called
+ * with the header's seq odd; the file is left alone on error.
+ */
+static int stats_shm_relayout(StatsShm *shm)
+{
+    StatsShmHeader *hdr;
+    StatsShmField *fields;
+    int nr = stats_nr_fields();
+    size_t size = stats_shm_size(nr);
+    void *map;
+
+    if (size > shm->size) {
+        size = MAX(size, shm->size * 2);
+        if (ftruncate(shm->fd, size) < 0) {
+            return -errno;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+        if (map == MAP_FAILED) {
+            return -errno;
+        }
+        munmap(shm->map, shm->size);
+        shm->map = map;
+        shm->size = size;
+    }
+
+    hdr = shm->map;
+    hdr->nr_fields = nr;
+    hdr->generation = stats_generation();
+    hdr->size = shm->size;
+    hdr->fields_offset = sizeof(StatsShmHeader);
+    hdr->values_offset = hdr->fields_offset + nr * sizeof(StatsShmField);
+
+    fields = shm->map + hdr->fields_offset;
+    stats_foreach_field(stats_shm_add_field, &fields);
+
+    shm->generation = hdr->generation;
+    shm->laid_out = true;
+    return 0;
+}
+
+static void stats_shm_update(void *opaque)
+{
+    StatsShm *shm = opaque;
+    StatsShmHeader *hdr = shm->map;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    atomic_set(&hdr->seq, hdr->seq + 1);
+    smp_wmb();
+
+    /* If the file cannot grow, readers keep the last complete snapshot */
+    if (!shm->laid_out || shm->generation != stats_generation()) {
+        if (stats_shm_relayout(shm) < 0) {
+            goto out;
+        }
+        hdr = shm->map;
+    }
+
+    stats_collect(shm->map + hdr->values_offset);
+    hdr->timestamp_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+out:
+    smp_wmb();
+    atomic_set(&hdr->seq, hdr->seq + 1);
+
+    timer_mod(shm->timer, now + shm->interval);
+}
+
+void qmp_stats_shm_start(const char *path, bool has_interval, int64_t interval,
+                         Error **errp)
+{
+    StatsShm *shm;
+    StatsShmHeader *hdr;
+
+    if (stats_shm) {
+        error_setg(errp, "Statistics are already published");
+        return;
+    }
+
+    if (!has_interval) {
+        interval = STATS_SHM_DEFAULT_INTERVAL;
+    } else if (interval <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                  "a positive number of milliseconds");
+        return;
+    }
+
+    shm = g_new0(StatsShm, 1);
+    shm->interval = interval;
+    shm->fd = qemu_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (shm->fd < 0) {
+        error_setg_file_open(errp, errno, path);
+        g_free(shm);
+        return;
+    }
+
+    shm->size = stats_shm_size(stats_nr_fields());
+    if (ftruncate(shm->fd, shm->size) < 0) {
+        error_setg_errno(errp, errno, "Could not resize '%s'", path);
+        goto fail;
+    }
+    shm->map = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    shm->fd, 0);
+    if (shm->map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto fail;
+    }
+
+    hdr = shm->map;
+    hdr->magic = STATS_SHM_MAGIC;
+    hdr->version = STATS_SHM_VERSION;
+
+    shm->timer = timer_new_ms(QEMU_CLOCK_REALTIME, stats_shm_update, shm);
+    stats_shm = shm;
+    stats_shm_update(shm);
+    return;
+
+fail:
+    qemu_close(shm->fd);
+    g_free(shm);
+}
+
+void qmp_stats_shm_stop(Error **errp)
+{
+    StatsShm *shm = stats_shm;
+
+    if (!shm) {
+        return;
+    }
+
+    timer_del(shm->timer);
+    timer_free(shm->timer);
+    munmap(shm->map, shm->size);
+    qemu_close(shm->fd);
+    g_free(shm);
+    stats_shm = NULL;
+}
+#else
+void qmp_stats_shm_start(const char *path, bool has_interval, int64_t interval,
+                         Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_stats_shm_stop(Error **errp)
+{
+}
+#endif
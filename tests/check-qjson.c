@@ -1472,6 +1472,110 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/* Something shaped like a large query-blockstats or query-block reply */
+static QObject *make_document(int entries)
+{
+    QList *list = qlist_new();
+    QDict *dict, *stats;
+    char name[32];
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        snprintf(name, sizeof(name), "drive-virtio-disk%d", i);
+        stats = qdict_new();
+        qdict_put(stats, "rd_bytes", qint_from_int(i * 4096LL));
+        qdict_put(stats, "wr_bytes", qint_from_int(i * 8192LL));
+        qdict_put(stats, "rd_operations", qint_from_int(i));
+        qdict_put(stats, "wr_highest_offset", qint_from_int(1LL << 40));
+        qdict_put(stats, "rd_total_time_ns", qint_from_int(-1));
+
+        dict = qdict_new();
+        qdict_put(dict, "device", qstring_from_str(name));
+        qdict_put(dict, "file", qstring_from_str("/var/lib/images/\"vm\"\t"
+                                                 "disk \xc3\xa9t\xc3\xa9.qcow2"));
+        qdict_put(dict, "locked", qbool_from_int(i & 1));
+        qdict_put(dict, "stats", stats);
+        qlist_append(list, dict);
+    }
+
+    return QOBJECT(list);
+}
+
+static void nested_round_trip(void)
+{
+    QObject *doc, *obj;
+    QString *str, *str2;
+
+    doc = make_document(100);
+    str = qobject_to_json(doc);
+    obj = qobject_from_json(qstring_get_str(str));
+    g_assert(obj != NULL);
+    g_assert(qobject_type(obj) == QTYPE_QLIST);
+    g_assert_cmpint(qlist_size(qobject_to_qlist(obj)), ==, 100);
+
+    str2 = qobject_to_json(obj);
+    g_assert_cmpstr(qstring_get_str(str), ==, qstring_get_str(str2));
+
+    QDECREF(str2);
+    qobject_decref(obj);
+    QDECREF(str);
+    qobject_decref(doc);
+}
+
+static void nested_errors(void)
+{
+    QObject *obj;
+
+    /* Errors deep inside a value must not leak the containers around it */
+    obj = qobject_from_json("{'a': [1, {'b': [2, 3 4]}]}");
+    g_assert(obj == NULL);
+    obj = qobject_from_json("[[[[{'a': 1, 2: 3}]]]]");
+    g_assert(obj == NULL);
+    obj = qobject_from_json("[{'a' 1}]");
+    g_assert(obj == NULL);
+    obj = qobject_from_json("[1, 2, %d]");
+    g_assert(obj == NULL);
+}
+
+#define PERF_ENTRIES    1000
+#define PERF_LOOPS      100
+
+static void perf_json(void)
+{
+    QObject *doc, *obj;
+    QString *str;
+    double duration;
+    size_t len;
+    int i;
+
+    doc = make_document(PERF_ENTRIES);
+    str = qobject_to_json(doc);
+    len = qstring_get_length(str);
+    QDECREF(str);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_LOOPS; i++) {
+        str = qobject_to_json(doc);
+        QDECREF(str);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("qobject_to_json: %zu bytes, %f MB/s",
+                   len, len * PERF_LOOPS / duration / 1e6);
+
+    str = qobject_to_json(doc);
+    g_test_timer_start();
+    for (i = 0; i < PERF_LOOPS; i++) {
+        obj = qobject_from_json(qstring_get_str(str));
+        qobject_decref(obj);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("qobject_from_json: %zu bytes, %f MB/s",
+                   len, len * PERF_LOOPS / duration / 1e6);
+
+    QDECREF(str);
+    qobject_decref(doc);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1491,6 +1595,7 @@ int main(int argc, char **argv)
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
     g_test_add_func("/lists/simple_list", simple_list);
+    g_test_add_func("/lists/nested_round_trip", nested_round_trip);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
 
@@ -1507,6 +1612,11 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_array_comma", invalid_array_comma);
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
+    g_test_add_func("/errors/nested", nested_errors);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/json", perf_json);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,163 @@
+/*
+ * QTest testcase for the dirty page rate measurement
+ *
+ * Under qtest no vCPU runs, so the only pages dirtied are those written
+ * by the test through the qtest protocol.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+
+#define TEST_ADDR               0x100000
+#define DIRTY_RATE_TIMEOUT_US   (30 * 1000 * 1000)
+
+static QDict *query_dirty_rate(void)
+{
+    QDict *rsp, *ret;
+
+    rsp = qmp("{ 'execute': 'query-dirty-rate' }");
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(ret);
+    QINCREF(ret);
+    QDECREF(rsp);
+    return ret;
+}
+
+static void calc_dirty_rate(int calc_time, int sample_period)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "  'arguments': { 'calc-time': %d, 'sample-period': %d } }",
+              calc_time, sample_period);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+static QDict *wait_measured(void)
+{
+    gint64 start_time = g_get_monotonic_time();
+    QDict *info;
+
+    for (;;) {
+        info = query_dirty_rate();
+        if (!strcmp(qdict_get_str(info, "status"), "measured")) {
+            return info;
+        }
+        g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measuring");
+        QDECREF(info);
+        g_assert(g_get_monotonic_time() - start_time <= DIRTY_RATE_TIMEOUT_US);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void test_states(void)
+{
+    QDict *rsp, *info;
+
+    qtest_start("-m 64");
+
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(info, "calc-time"));
+    QDECREF(info);
+
+    /* Invalid arguments leave the state alone */
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "  'arguments': { 'calc-time': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "unstarted");
+    QDECREF(info);
+
+    calc_dirty_rate(2, 1000);
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measuring");
+    g_assert(!qdict_haskey(info, "calc-time"));
+    QDECREF(info);
+
+    /* Only one measurement runs at a time */
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    info = wait_measured();
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 2);
+    g_assert_cmpint(qdict_get_int(info, "sample-period"), ==, 1000);
+    QDECREF(info);
+
+    /* A finished measurement can be started again */
+    calc_dirty_rate(1, 500);
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measuring");
+    QDECREF(info);
+
+    info = wait_measured();
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "sample-period"), ==, 500);
+    QDECREF(info);
+
+    qtest_end();
+}
+
+/* A page dirtied in two sample periods is counted once in each of them,
+ * however often it was written, and not again in the periods after.
+ */
+static void test_redirty(void)
+{
+    QDict *info;
+    QList *list;
+    QListEntry *entry;
+    int64_t dirty_pages = 0;
+    int i = 0;
+
+    qtest_start("-m 64");
+
+    calc_dirty_rate(1, 100);
+    writeb(TEST_ADDR, 1);
+    writeb(TEST_ADDR + 1, 2);
+    g_usleep(250 * 1000);
+    writeb(TEST_ADDR, 3);
+
+    info = wait_measured();
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "sample-period"), ==, 100);
+
+    list = qdict_get_qlist(info, "blocks");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *block = qobject_to_qdict(qlist_entry_obj(entry));
+
+        dirty_pages += qdict_get_int(block, "dirty-pages");
+    }
+    g_assert_cmpint(dirty_pages, ==, 2);
+
+    list = qdict_get_qlist(info, "histogram");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        int64_t pages = qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+
+        g_assert_cmpint(pages, ==, i == 1 ? 1 : 0);
+        i++;
+    }
+    g_assert_cmpint(i, >, 1);
+
+    QDECREF(info);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/dirty-rate/states", test_states);
+    qtest_add_func("/dirty-rate/redirty", test_redirty);
+
+    return g_test_run();
+}
@@ -281,6 +281,94 @@ static void test_i440fx_pam(gconstpointer opaque)
     qtest_end();
 }
 
+#define PIIX4_PM_PMBA    0x40
+#define PIIX4_PM_PMREGMISC 0x80
+#define PM1_CNT          0x04
+
+/* Moving an enabled region must unmap it at its old address */
+static void test_i440fx_move_region(gconstpointer opaque)
+{
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+
+    bus = test_start_get_bus(s);
+    dev = qpci_device_find(bus, QPCI_DEVFN(1, 3));
+    g_assert(dev != NULL);
+
+    /* Map the PIIX4 power management registers at 0xb000 */
+    qpci_config_writel(dev, PIIX4_PM_PMBA, 0xb000);
+    qpci_config_writeb(dev, PIIX4_PM_PMREGMISC, 1);
+    g_assert_cmphex(inw(0xb000 + PM1_CNT), !=, 0xffff);
+
+    /* Move them while enabled */
+    qpci_config_writel(dev, PIIX4_PM_PMBA, 0xb100);
+    g_assert_cmphex(inw(0xb100 + PM1_CNT), !=, 0xffff);
+    g_assert_cmphex(inw(0xb000 + PM1_CNT), ==, 0xffff);
+
+    /* And back, over the range that was just unmapped */
+    qpci_config_writel(dev, PIIX4_PM_PMBA, 0xb000);
+    g_assert_cmphex(inw(0xb000 + PM1_CNT), !=, 0xffff);
+    g_assert_cmphex(inw(0xb100 + PM1_CNT), ==, 0xffff);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+#define PERF_PAM_UPDATES 2000
+
+/* Cost of a memory map update (one PAM register write) as the number of
+ * mapped regions grows.  Each e1000 adds an MMIO and a PIO BAR.
+ */
+static void perf_i440fx_pam(gconstpointer opaque)
+{
+    static const int num_nics[] = { 0, 8, 24 };
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    GString *cmdline;
+    double duration;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(num_nics); i++) {
+        cmdline = g_string_new(NULL);
+        g_string_printf(cmdline, "-smp %d", s->num_cpus);
+        for (j = 0; j < num_nics[i]; j++) {
+            g_string_append_printf(cmdline, " -device e1000,addr=0x%x", 3 + j);
+        }
+        qtest_start(cmdline->str);
+        g_string_free(cmdline, true);
+        bus = qpci_init_pc();
+
+        for (j = 0; j < num_nics[i]; j++) {
+            dev = qpci_device_find(bus, QPCI_DEVFN(3 + j, 0));
+            g_assert(dev != NULL);
+            qpci_iomap(dev, 0, NULL);
+            qpci_iomap(dev, 1, NULL);
+            qpci_device_enable(dev);
+            g_free(dev);
+        }
+
+        dev = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+        g_assert(dev != NULL);
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_PAM_UPDATES; j++) {
+            pam_set(dev, 1, j & 1 ? PAM_RE : PAM_RE | PAM_WE);
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("%d NICs: %d updates in %f s, %f us/update\n",
+                       num_nics[i], PERF_PAM_UPDATES, duration,
+                       duration * 1000000 / PERF_PAM_UPDATES);
+
+        g_free(dev);
+        qpci_free_pc(bus);
+        qtest_end();
+    }
+}
+
 #define BLOB_SIZE ((size_t)65536)
 #define ISA_BIOS_MAXSZ ((size_t)(128 * 1024))
 
@@ -409,9 +497,15 @@ int main(int argc, char **argv)
 
     g_test_add_data_func("/i440fx/defaults", &data, test_i440fx_defaults);
     g_test_add_data_func("/i440fx/pam", &data, test_i440fx_pam);
+    g_test_add_data_func("/i440fx/move-region", &data,
+                         test_i440fx_move_region);
     add_firmware_test("/i440fx/firmware/bios", request_bios);
     add_firmware_test("/i440fx/firmware/pflash", request_pflash);
 
+    if (g_test_perf()) {
+        g_test_add_data_func("/perf/i440fx/pam", &data, perf_i440fx_pam);
+    }
+
     ret = g_test_run();
     return ret;
 }
@@ -341,14 +341,13 @@ typedef struct {
     QDict *response;
 } QMPResponseParser;
 
-static void qmp_response(JSONMessageParser *parser, QList *tokens)
+static void qmp_response(JSONMessageParser *parser, QObject *obj, Error *err)
 {
     QMPResponseParser *qmp = container_of(parser, QMPResponseParser, parser);
-    QObject *obj;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
-        fprintf(stderr, "QMP JSON response parsing failed\n");
+        fprintf(stderr, "QMP JSON response parsing failed: %s\n",
+                error_get_pretty(err));
         exit(1);
     }
 
@@ -363,7 +362,7 @@ QDict *qtest_qmp_receive(QTestState *s)
     bool log = getenv("QTEST_LOG") != NULL;
 
     qmp.response = NULL;
-    json_message_parser_init(&qmp.parser, qmp_response);
+    json_message_parser_init(&qmp.parser, qmp_response, NULL);
     while (!qmp.response) {
         ssize_t len;
         char c;
@@ -0,0 +1,209 @@
+/*
+ * QTest testcase for pipelined QMP requests
+ *
+ * Checks that pipelined requests are answered in order, and that a client
+ * that disconnects with requests still pending does not leave its monitor
+ * stuck.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/json-streamer.h"
+
+static char *qmp_path;
+
+typedef struct {
+    JSONMessageParser parser;
+    QDict *response;
+} ResponseParser;
+
+static void response_cb(JSONMessageParser *parser, QObject *obj, Error *err)
+{
+    ResponseParser *rp = container_of(parser, ResponseParser, parser);
+
+    g_assert(obj);
+    g_assert(qobject_type(obj) == QTYPE_QDICT);
+    g_assert(!rp->response);
+    rp->response = qobject_to_qdict(obj);
+}
+
+static int monitor_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), qmp_path);
+    do {
+        ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } while (ret < 0 && errno == EINTR);
+    g_assert_cmpint(ret, ==, 0);
+
+    return fd;
+}
+
+static void monitor_send(int fd, const char *str)
+{
+    size_t len = strlen(str);
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, str, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        str += ret;
+        len -= ret;
+    }
+}
+
+static QDict *monitor_receive(int fd)
+{
+    ResponseParser rp;
+    ssize_t len;
+    char c;
+
+    rp.response = NULL;
+    json_message_parser_init(&rp.parser, response_cb, NULL);
+    while (!rp.response) {
+        len = read(fd, &c, 1);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(len, ==, 1);
+        json_message_parser_feed(&rp.parser, &c, 1);
+    }
+    json_message_parser_destroy(&rp.parser);
+
+    return rp.response;
+}
+
+/* Read the next response, skipping events, and check its id */
+static void monitor_expect(int fd, int64_t id)
+{
+    QDict *rsp;
+
+    do {
+        rsp = monitor_receive(fd);
+        if (qdict_haskey(rsp, "event")) {
+            QDECREF(rsp);
+            rsp = NULL;
+        }
+    } while (!rsp);
+
+    g_assert(qdict_haskey(rsp, "return"));
+    if (id < 0) {
+        g_assert(!qdict_haskey(rsp, "id"));
+    } else {
+        g_assert_cmpint(qdict_get_int(rsp, "id"), ==, id);
+    }
+    QDECREF(rsp);
+}
+
+static int monitor_open(void)
+{
+    QDict *greeting;
+    int fd;
+
+    fd = monitor_connect();
+    greeting = monitor_receive(fd);
+    g_assert(qdict_haskey(greeting, "QMP"));
+    QDECREF(greeting);
+
+    return fd;
+}
+
+static void test_order(void)
+{
+    int fd = monitor_open();
+
+    /* Responses carry the id of their request, or none if it had none */
+    monitor_send(fd,
+                 "{ 'execute': 'qmp_capabilities' }"
+                 "{ 'execute': 'query-name', 'id': 1 }"
+                 "{ 'execute': 'query-status', 'id': 2 }"
+                 "{ 'execute': 'query-kvm', 'id': 3 }"
+                 "{ 'execute': 'query-status' }"
+                 "{ 'execute': 'query-name', 'id': 4 }");
+
+    monitor_expect(fd, -1);
+    monitor_expect(fd, 1);
+    monitor_expect(fd, 2);
+    monitor_expect(fd, 3);
+    monitor_expect(fd, -1);
+    monitor_expect(fd, 4);
+
+    close(fd);
+}
+
+static void test_disconnect(void)
+{
+    GString *burst;
+    QDict *rsp;
+    int fd, i;
+
+    /* Send a burst of requests and hang up right away */
+    burst = g_string_new("{ 'execute': 'qmp_capabilities' }");
+    for (i = 0; i < 64; i++) {
+        g_string_append_printf(burst,
+                               "{ 'execute': 'query-name', 'id': %d }", i);
+    }
+    fd = monitor_open();
+    monitor_send(fd, burst->str);
+    close(fd);
+    g_string_free(burst, true);
+
+    /* The other monitor must not have been held up */
+    rsp = qmp("{ 'execute': 'query-status' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* A new client must be served */
+    fd = monitor_open();
+    monitor_send(fd,
+                 "{ 'execute': 'qmp_capabilities' }"
+                 "{ 'execute': 'query-name', 'id': 100 }");
+    monitor_expect(fd, -1);
+    monitor_expect(fd, 100);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    char *args;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    qmp_path = g_strdup_printf("/tmp/qmp-queue-test-%d.sock", getpid());
+    args = g_strdup_printf("-qmp unix:%s,server,nowait", qmp_path);
+    qtest_start(args);
+
+    qtest_add_func("/qmp/queue/order", test_order);
+    qtest_add_func("/qmp/queue/disconnect", test_disconnect);
+
+    ret = g_test_run();
+
+    qtest_end();
+    unlink(qmp_path);
+    g_free(qmp_path);
+    g_free(args);
+
+    return ret;
+}
@@ -0,0 +1,221 @@
+/*
+ * Bitmap tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+
+#define TEST_BITS   (BITS_PER_LONG * 8)
+
+/* Ranges that start and end in the middle of words, on word boundaries,
+ * and within a single word.
+ */
+static const struct {
+    long start;
+    long nr;
+} test_ranges[] = {
+    { 0, 1 },
+    { 0, BITS_PER_LONG },
+    { 0, TEST_BITS },
+    { 3, 5 },
+    { 5, BITS_PER_LONG - 5 },
+    { 7, BITS_PER_LONG },
+    { BITS_PER_LONG - 1, 2 },
+    { BITS_PER_LONG, 3 * BITS_PER_LONG },
+    { 13, 5 * BITS_PER_LONG + 17 },
+    { TEST_BITS - 1, 1 },
+};
+
+static void test_set_atomic(void)
+{
+    unsigned long *expected = bitmap_new(TEST_BITS);
+    unsigned long *map = bitmap_new(TEST_BITS);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ranges); i++) {
+        bitmap_zero(expected, TEST_BITS);
+        bitmap_zero(map, TEST_BITS);
+
+        bitmap_set(expected, test_ranges[i].start, test_ranges[i].nr);
+        bitmap_set_atomic(map, test_ranges[i].start, test_ranges[i].nr);
+        g_assert(bitmap_equal(map, expected, TEST_BITS));
+    }
+
+    g_free(expected);
+    g_free(map);
+}
+
+static void test_test_and_clear_atomic(void)
+{
+    unsigned long *expected = bitmap_new(TEST_BITS);
+    unsigned long *map = bitmap_new(TEST_BITS);
+    long start, nr;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ranges); i++) {
+        start = test_ranges[i].start;
+        nr = test_ranges[i].nr;
+
+        /* Everything set */
+        bitmap_fill(expected, TEST_BITS);
+        bitmap_fill(map, TEST_BITS);
+        bitmap_clear(expected, start, nr);
+        g_assert(bitmap_test_and_clear_atomic(map, start, nr));
+        g_assert(bitmap_equal(map, expected, TEST_BITS));
+
+        /* Only the last bit of the range set */
+        bitmap_zero(map, TEST_BITS);
+        set_bit(start + nr - 1, map);
+        g_assert(bitmap_test_and_clear_atomic(map, start, nr));
+        g_assert(bitmap_empty(map, TEST_BITS));
+
+        /* Only bits outside the range set */
+        bitmap_fill(map, TEST_BITS);
+        bitmap_clear(map, start, nr);
+        bitmap_copy(expected, map, TEST_BITS);
+        g_assert(!bitmap_test_and_clear_atomic(map, start, nr));
+        g_assert(bitmap_equal(map, expected, TEST_BITS));
+    }
+
+    g_free(expected);
+    g_free(map);
+}
+
+static void test_merge_and_clear_atomic(void)
+{
+    unsigned long *src = bitmap_new(TEST_BITS);
+    unsigned long *dst = bitmap_new(TEST_BITS);
+    unsigned long *expected_src = bitmap_new(TEST_BITS);
+    unsigned long *expected_dst = bitmap_new(TEST_BITS);
+    GRand *rand = g_rand_new_with_seed(0);
+    long start, nr, bit, count;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ranges); i++) {
+        start = test_ranges[i].start;
+        nr = test_ranges[i].nr;
+
+        bitmap_zero(src, TEST_BITS);
+        bitmap_zero(dst, TEST_BITS);
+        for (bit = 0; bit < TEST_BITS; bit++) {
+            if (g_rand_boolean(rand)) {
+                set_bit(bit, src);
+            }
+            if (g_rand_boolean(rand)) {
+                set_bit(bit, dst);
+            }
+        }
+        bitmap_copy(expected_src, src, TEST_BITS);
+        bitmap_copy(expected_dst, dst, TEST_BITS);
+
+        count = 0;
+        for (bit = start; bit < start + nr; bit++) {
+            if (test_and_clear_bit(bit, expected_src) &&
+                !test_and_set_bit(bit, expected_dst)) {
+                count++;
+            }
+        }
+
+        g_assert_cmpint(bitmap_merge_and_clear_atomic(dst, src, start, nr),
+                        ==, count);
+        g_assert(bitmap_equal(src, expected_src, TEST_BITS));
+        g_assert(bitmap_equal(dst, expected_dst, TEST_BITS));
+    }
+
+    g_rand_free(rand);
+    g_free(src);
+    g_free(dst);
+    g_free(expected_src);
+    g_free(expected_dst);
+}
+
+/* One bit per 4 KiB page of a 1 TiB guest */
+#define PERF_BITS       (1L << 28)
+#define PERF_ITERATIONS 10
+
+/* Dirty a sparse scattering of pages plus one densely written region,
+ * roughly what a migration bitmap sync sees from a busy guest.
+ */
+static void perf_dirty_pages(unsigned long *src)
+{
+    long bit;
+
+    for (bit = 0; bit < PERF_BITS; bit += 4099) {
+        set_bit(bit, src);
+    }
+    bitmap_set(src, PERF_BITS / 2 + 7, 1L << 20);
+}
+
+static void perf_sync(const char *name, bool word_at_a_time)
+{
+    unsigned long *src = bitmap_try_new(PERF_BITS);
+    unsigned long *dst = bitmap_try_new(PERF_BITS);
+    double duration = 0;
+    long bit, count = 0;
+    int i;
+
+    if (!src || !dst) {
+        g_test_message("%s: not enough memory, skipped", name);
+        g_free(src);
+        g_free(dst);
+        return;
+    }
+
+    for (i = 0; i < PERF_ITERATIONS; i++) {
+        perf_dirty_pages(src);
+        bitmap_zero(dst, PERF_BITS);
+
+        g_test_timer_start();
+        if (word_at_a_time) {
+            /* Start off a word boundary, like a misaligned RAM block */
+            count = bitmap_merge_and_clear_atomic(dst, src, 1, PERF_BITS - 1);
+        } else {
+            count = 0;
+            for (bit = 1; bit < PERF_BITS; bit++) {
+                if (test_bit(bit, src)) {
+                    clear_bit(bit, src);
+                    if (!test_and_set_bit(bit, dst)) {
+                        count++;
+                    }
+                }
+            }
+        }
+        duration += g_test_timer_elapsed();
+    }
+
+    g_test_message("%s: %d syncs of a 1 TiB map (%ld dirty pages) "
+                   "in %f s, %f ms/sync", name, PERF_ITERATIONS, count,
+                   duration, duration * 1000 / PERF_ITERATIONS);
+
+    g_free(src);
+    g_free(dst);
+}
+
+static void perf_sync_words(void)
+{
+    perf_sync("word-at-a-time", true);
+}
+
+static void perf_sync_pages(void)
+{
+    perf_sync("page-at-a-time", false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bitmap/set_atomic", test_set_atomic);
+    g_test_add_func("/bitmap/test_and_clear_atomic",
+                    test_test_and_clear_atomic);
+    g_test_add_func("/bitmap/merge_and_clear_atomic",
+                    test_merge_and_clear_atomic);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/bitmap/sync-words", perf_sync_words);
+        g_test_add_func("/perf/bitmap/sync-pages", perf_sync_pages);
+    }
+    return g_test_run();
+}
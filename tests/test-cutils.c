@@ -226,6 +226,105 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_is_zero(void)
+{
+    size_t len = 64 * 1024;
+    uint8_t *buf = g_malloc0(len);
+    size_t i;
+
+    g_assert(buffer_is_zero(buf, len));
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+    /* Every position of a single non-zero byte must be found */
+    for (i = 0; i < len; i += 7) {
+        size_t offset;
+
+        buf[i] = 0x80;
+        g_assert(!buffer_is_zero(buf, len));
+        offset = buffer_find_nonzero_offset(buf, len);
+        g_assert_cmpint(offset, <=, i);
+        g_assert_cmpint(i - offset, <, BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                                       * sizeof(VECTYPE));
+        buf[i] = 0;
+    }
+
+    /* Lengths that cannot use the vector implementation */
+    buf[4 * sizeof(long)] = 1;
+    g_assert(buffer_is_zero(buf, 4 * sizeof(long)));
+    g_assert(!buffer_is_zero(buf, 8 * sizeof(long)));
+
+    g_free(buf);
+}
+
+/* What buffer_find_nonzero_offset() returns for a single non-zero byte */
+static size_t nonzero_offset(size_t pos, size_t len)
+{
+    size_t chunk = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE);
+
+    if (pos >= len) {
+        return len;
+    } else if (pos < chunk) {
+        return pos - pos % sizeof(VECTYPE);
+    } else {
+        return pos - pos % chunk;
+    }
+}
+
+static void test_buffer_find_nonzero_offset_impls(void)
+{
+    size_t chunk = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE);
+    size_t max_len = 8 * chunk;
+    uint8_t *raw = g_malloc0(max_len + chunk + 128);
+    uint8_t *line = (uint8_t *)ROUND_UP((uintptr_t)raw, 64);
+    unsigned int accel;
+    size_t misalign, len, pos;
+
+    /* Each implementation must give the same results for buffers at every
+     * allowed offset into a cache line, which wider vectors than VECTYPE
+     * see as misaligned, and whatever follows them.  The loop ends on the
+     * first implementation the host lacks, leaving the fastest selected.
+     */
+    for (accel = 0; test_buffer_find_nonzero_offset_accel(accel); accel++) {
+        for (misalign = 0; misalign < 64; misalign += sizeof(VECTYPE)) {
+            uint8_t *buf = line + misalign;
+
+            for (len = chunk; len <= max_len; len += chunk) {
+                g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+                for (pos = 0; pos < len + chunk; pos++) {
+                    buf[pos] = 1;
+                    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==,
+                                    nonzero_offset(pos, len));
+                    buf[pos] = 0;
+                }
+            }
+        }
+    }
+
+    g_free(raw);
+}
+
+static void perf_buffer_is_zero(void)
+{
+    size_t len = 4096;
+    size_t total = 1024 * 1024 * 1024;
+    uint8_t *buf = g_malloc0(len);
+    unsigned int i, max;
+    double duration;
+
+    max = total / len;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert(buffer_is_zero(buf, len));
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("buffer_is_zero %u x %zu bytes: %f s, %f MB/s\n",
+                   max, len, duration, total / duration / (1024 * 1024));
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +345,13 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_is_zero", test_buffer_is_zero);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset/impls",
+                    test_buffer_find_nonzero_offset_impls);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/buffer_is_zero", perf_buffer_is_zero);
+    }
 
     return g_test_run();
 }
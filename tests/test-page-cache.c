@@ -0,0 +1,176 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * A cache of four pages has a single set, so every page competes with
+ * every other one for the same four ways.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static uint8_t page[PAGE_SIZE];
+
+/* Fill the page with a pattern that identifies @addr */
+static const uint8_t *page_for(uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE + 1, sizeof(page));
+    return page;
+}
+
+static void insert(PageCache *cache, uint64_t addr)
+{
+    g_assert_cmpint(cache_insert(cache, addr, page_for(addr)), ==, 0);
+}
+
+/* Check that @addr is cached with the data inserted for it */
+static void check_cached(PageCache *cache, uint64_t addr)
+{
+    uint8_t *data;
+
+    g_assert(cache_is_cached(cache, addr));
+    data = get_cached_data(cache, addr);
+    g_assert(data);
+    g_assert(!memcmp(data, page_for(addr), PAGE_SIZE));
+}
+
+static void test_hit_miss(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(!get_cached_data(cache, 0));
+
+    insert(cache, 0);
+    check_cached(cache, 0);
+    g_assert(!cache_is_cached(cache, PAGE_SIZE));
+    g_assert(!get_cached_data(cache, PAGE_SIZE));
+
+    /* Inserting again overwrites the data in place */
+    g_assert_cmpint(cache_insert(cache, 0, page_for(PAGE_SIZE)), ==, 0);
+    g_assert(!memcmp(get_cached_data(cache, 0), page_for(PAGE_SIZE),
+                     PAGE_SIZE));
+    g_assert_cmpint(cache_num_items(cache), ==, 1);
+
+    cache_fini(cache);
+}
+
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        insert(cache, i * PAGE_SIZE);
+    }
+
+    /* A lookup makes page 0 more recent than page 1 */
+    g_assert(get_cached_data(cache, 0));
+    insert(cache, 4 * PAGE_SIZE);
+    g_assert(!cache_is_cached(cache, 1 * PAGE_SIZE));
+    check_cached(cache, 0);
+    check_cached(cache, 2 * PAGE_SIZE);
+    check_cached(cache, 3 * PAGE_SIZE);
+    check_cached(cache, 4 * PAGE_SIZE);
+
+    /* Re-inserting a page also counts as a use */
+    insert(cache, 2 * PAGE_SIZE);
+    insert(cache, 5 * PAGE_SIZE);
+    g_assert(!cache_is_cached(cache, 0));
+    check_cached(cache, 2 * PAGE_SIZE);
+
+    cache_fini(cache);
+}
+
+static void test_num_items(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint64_t i;
+
+    g_assert_cmpint(cache_num_items(cache), ==, 0);
+    for (i = 0; i < 4; i++) {
+        insert(cache, i * PAGE_SIZE);
+        g_assert_cmpint(cache_num_items(cache), ==, i + 1);
+    }
+
+    /* Neither overwriting nor evicting a page changes the count */
+    insert(cache, 0);
+    g_assert_cmpint(cache_num_items(cache), ==, 4);
+    for (i = 4; i < 16; i++) {
+        insert(cache, i * PAGE_SIZE);
+        g_assert_cmpint(cache_num_items(cache), ==, 4);
+    }
+
+    cache_fini(cache);
+}
+
+/* Count the pages among the first @n that are cached, checking their data */
+static int64_t count_cached(PageCache *cache, uint64_t n)
+{
+    int64_t count = 0;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        if (cache_is_cached(cache, i * PAGE_SIZE)) {
+            check_cached(cache, i * PAGE_SIZE);
+            count++;
+        }
+    }
+    return count;
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint64_t mru = 5 * PAGE_SIZE;
+    uint64_t i;
+
+    for (i = 0; i < 32; i++) {
+        insert(cache, i * PAGE_SIZE);
+    }
+    g_assert_cmpint(cache_num_items(cache), ==, count_cached(cache, 32));
+    insert(cache, mru);
+
+    g_assert_cmpint(cache_resize(cache, 16), ==, 16);
+    check_cached(cache, mru);
+
+    /* Shrinking keeps the most recently used pages, with their data */
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    g_assert_cmpint(cache_num_items(cache), ==, 4);
+    g_assert_cmpint(count_cached(cache, 32), ==, 4);
+    check_cached(cache, mru);
+
+    /* Growing loses nothing */
+    g_assert_cmpint(cache_resize(cache, 64), ==, 64);
+    g_assert_cmpint(cache_num_items(cache), ==, 4);
+    g_assert_cmpint(count_cached(cache, 32), ==, 4);
+    check_cached(cache, mru);
+
+    /* The resized cache can be filled up and freed normally */
+    for (i = 32; i < 128; i++) {
+        insert(cache, i * PAGE_SIZE);
+    }
+    g_assert_cmpint(cache_num_items(cache), <=, 64);
+    check_cached(cache, 127 * PAGE_SIZE);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/page-cache/hit-miss", test_hit_miss);
+    g_test_add_func("/page-cache/lru", test_lru);
+    g_test_add_func("/page-cache/num-items", test_num_items);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -0,0 +1,218 @@
+/*
+ * RCU tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+
+#define NR_READERS     4
+#define NR_UPDATES     2000
+
+#define ITEM_ALIVE     0x600dbeefU
+#define ITEM_DEAD      0xdeadbeefU
+
+typedef struct Item {
+    struct rcu_head rcu;
+    unsigned magic;
+    unsigned long ref;
+} Item;
+
+static Item *shared_item;
+static QemuMutex shared_lock;
+static bool stop;
+static unsigned long reader_errors;
+static unsigned long nr_freed;
+
+static Item *item_new(void)
+{
+    Item *item = g_new0(Item, 1);
+
+    item->magic = ITEM_ALIVE;
+    item->ref = 1;
+    return item;
+}
+
+static void item_free(Item *item)
+{
+    item->magic = ITEM_DEAD;
+    atomic_inc(&nr_freed);
+    g_free(item);
+}
+
+static void *rcu_reader_thread(void *opaque)
+{
+    unsigned long *count = opaque;
+    Item *item;
+
+    while (!atomic_read(&stop)) {
+        rcu_read_lock();
+        item = atomic_rcu_read(&shared_item);
+        if (atomic_read(&item->magic) != ITEM_ALIVE) {
+            atomic_inc(&reader_errors);
+        }
+        rcu_read_unlock();
+        (*count)++;
+    }
+    return NULL;
+}
+
+static void start_readers(QemuThread *threads, unsigned long *counts,
+                          int nr, void *(*fn)(void *))
+{
+    int i;
+
+    atomic_set(&stop, false);
+    for (i = 0; i < nr; i++) {
+        counts[i] = 0;
+        qemu_thread_create(&threads[i], "reader", fn, &counts[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static unsigned long stop_readers(QemuThread *threads, unsigned long *counts,
+                                  int nr)
+{
+    unsigned long total = 0;
+    int i;
+
+    atomic_set(&stop, true);
+    for (i = 0; i < nr; i++) {
+        qemu_thread_join(&threads[i]);
+        total += counts[i];
+    }
+    return total;
+}
+
+static void test_synchronize(void)
+{
+    QemuThread threads[NR_READERS];
+    unsigned long counts[NR_READERS];
+    Item *old;
+    int i;
+
+    reader_errors = 0;
+    shared_item = item_new();
+    start_readers(threads, counts, NR_READERS, rcu_reader_thread);
+
+    for (i = 0; i < NR_UPDATES; i++) {
+        old = shared_item;
+        atomic_rcu_set(&shared_item, item_new());
+        synchronize_rcu();
+        item_free(old);
+    }
+
+    stop_readers(threads, counts, NR_READERS);
+    item_free(shared_item);
+    shared_item = NULL;
+
+    g_assert_cmpint(reader_errors, ==, 0);
+}
+
+static void test_call_rcu(void)
+{
+    QemuThread threads[NR_READERS];
+    unsigned long counts[NR_READERS];
+    unsigned long freed_before;
+    Item *old;
+    int i;
+
+    reader_errors = 0;
+    freed_before = atomic_read(&nr_freed);
+    shared_item = item_new();
+    start_readers(threads, counts, NR_READERS, rcu_reader_thread);
+
+    for (i = 0; i < NR_UPDATES; i++) {
+        old = shared_item;
+        atomic_rcu_set(&shared_item, item_new());
+        call_rcu(old, item_free, rcu);
+    }
+
+    while (atomic_read(&nr_freed) - freed_before < NR_UPDATES) {
+        g_usleep(1000);
+    }
+
+    stop_readers(threads, counts, NR_READERS);
+    item_free(shared_item);
+    shared_item = NULL;
+
+    g_assert_cmpint(reader_errors, ==, 0);
+}
+
+/* The same lookup as rcu_reader_thread(), done the way FlatView readers
+ * used to: take a reference under a lock shared by all readers.
+ */
+static void *mutex_reader_thread(void *opaque)
+{
+    unsigned long *count = opaque;
+    Item *item;
+
+    while (!atomic_read(&stop)) {
+        qemu_mutex_lock(&shared_lock);
+        item = shared_item;
+        item->ref++;
+        qemu_mutex_unlock(&shared_lock);
+
+        if (item->magic != ITEM_ALIVE) {
+            atomic_inc(&reader_errors);
+        }
+
+        qemu_mutex_lock(&shared_lock);
+        item->ref--;
+        qemu_mutex_unlock(&shared_lock);
+        (*count)++;
+    }
+    return NULL;
+}
+
+static void perf_readers(const char *name, void *(*fn)(void *))
+{
+    QemuThread threads[NR_READERS];
+    unsigned long counts[NR_READERS];
+    unsigned long total;
+    double duration;
+
+    shared_item = item_new();
+
+    g_test_timer_start();
+    start_readers(threads, counts, NR_READERS, fn);
+    g_usleep(G_USEC_PER_SEC);
+    total = stop_readers(threads, counts, NR_READERS);
+    duration = g_test_timer_elapsed();
+
+    item_free(shared_item);
+    shared_item = NULL;
+
+    g_test_message("%s: %d threads, %lu lookups in %f s (%f ns/lookup)",
+                   name, NR_READERS, total, duration,
+                   duration * 1e9 * NR_READERS / total);
+}
+
+static void perf_rcu_read(void)
+{
+    perf_readers("rcu_read_lock", rcu_reader_thread);
+}
+
+static void perf_mutex_read(void)
+{
+    perf_readers("mutex+refcount", mutex_reader_thread);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_mutex_init(&shared_lock);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/synchronize", test_synchronize);
+    g_test_add_func("/rcu/call_rcu", test_call_rcu);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/rcu/read", perf_rcu_read);
+        g_test_add_func("/perf/rcu/mutex-read", perf_mutex_read);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,175 @@
+/*
+ * Statistics registry tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/stats.h"
+#include "qapi/qmp/types.h"
+#include "qapi/qmp/qjson.h"
+
+static const StatsField test_fields[] = {
+    { "ops", STATS_KIND_CUMULATIVE },
+    { "bytes", STATS_KIND_CUMULATIVE },
+    { "depth", STATS_KIND_INSTANT },
+};
+
+typedef struct TestDev {
+    uint64_t ops, bytes, depth;
+} TestDev;
+
+static void test_dev_collect(void *opaque, uint64_t *values)
+{
+    TestDev *dev = opaque;
+
+    values[0] = dev->ops;
+    values[1] = dev->bytes;
+    values[2] = dev->depth;
+}
+
+static void add_name(const char *prefix, const StatsField *field,
+                     void *opaque)
+{
+    GString *names = opaque;
+
+    g_string_append_printf(names, "%s.%s:%s ", prefix, field->name,
+                           StatsKind_lookup[field->kind]);
+}
+
+static char *schema_names(void)
+{
+    GString *names = g_string_new("");
+
+    stats_foreach_field(add_name, names);
+    return g_string_free(names, false);
+}
+
+static void test_register(void)
+{
+    TestDev a = { 1, 2, 3 }, b = { 4, 5, 6 };
+    StatsSource *sa, *sb;
+    uint64_t values[6], gen;
+    char *names;
+
+    gen = stats_generation();
+    sa = stats_register("dev.a", test_fields, ARRAY_SIZE(test_fields),
+                        test_dev_collect, &a);
+    sb = stats_register("dev.b", test_fields, ARRAY_SIZE(test_fields),
+                        test_dev_collect, &b);
+    g_assert_cmpint(stats_generation(), !=, gen);
+    g_assert_cmpint(stats_nr_fields(), ==, 6);
+
+    names = schema_names();
+    g_assert_cmpstr(names, ==,
+                    "dev.a.ops:cumulative dev.a.bytes:cumulative "
+                    "dev.a.depth:instant dev.b.ops:cumulative "
+                    "dev.b.bytes:cumulative dev.b.depth:instant ");
+    g_free(names);
+
+    stats_collect(values);
+    g_assert_cmpint(values[0], ==, 1);
+    g_assert_cmpint(values[2], ==, 3);
+    g_assert_cmpint(values[3], ==, 4);
+    g_assert_cmpint(values[5], ==, 6);
+
+    /* Values are read when collected, not when registered */
+    a.ops = 100;
+    b.depth = 0;
+    stats_collect(values);
+    g_assert_cmpint(values[0], ==, 100);
+    g_assert_cmpint(values[5], ==, 0);
+
+    gen = stats_generation();
+    stats_unregister(sa);
+    g_assert_cmpint(stats_generation(), !=, gen);
+    g_assert_cmpint(stats_nr_fields(), ==, 3);
+
+    stats_collect(values);
+    g_assert_cmpint(values[0], ==, 4);
+    g_assert_cmpint(values[2], ==, 0);
+
+    stats_unregister(sb);
+    g_assert_cmpint(stats_nr_fields(), ==, 0);
+}
+
+/* A host with many disks, polled the way a telemetry agent does */
+#define PERF_DEVS       64
+#define PERF_POLLS      10000
+
+static void perf_collect(void)
+{
+    TestDev devs[PERF_DEVS] = { };
+    StatsSource *srcs[PERF_DEVS];
+    uint64_t *values;
+    double duration;
+    char name[32];
+    int i;
+
+    for (i = 0; i < PERF_DEVS; i++) {
+        snprintf(name, sizeof(name), "block.disk%d", i);
+        srcs[i] = stats_register(name, test_fields, ARRAY_SIZE(test_fields),
+                                 test_dev_collect, &devs[i]);
+    }
+    values = g_new(uint64_t, stats_nr_fields());
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_POLLS; i++) {
+        stats_collect(values);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("stats_collect: %d devices, %f us/poll",
+                   PERF_DEVS, duration * 1e6 / PERF_POLLS);
+
+    for (i = 0; i < PERF_DEVS; i++) {
+        stats_unregister(srcs[i]);
+    }
+    g_free(values);
+}
+
+/* The same counters, returned the way query-blockstats does */
+static void perf_json(void)
+{
+    TestDev devs[PERF_DEVS] = { };
+    QString *json;
+    QList *list;
+    QDict *dict;
+    double duration;
+    char name[32];
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_POLLS; i++) {
+        list = qlist_new();
+        for (j = 0; j < PERF_DEVS; j++) {
+            snprintf(name, sizeof(name), "disk%d", j);
+            dict = qdict_new();
+            qdict_put(dict, "device", qstring_from_str(name));
+            qdict_put(dict, "ops", qint_from_int(devs[j].ops));
+            qdict_put(dict, "bytes", qint_from_int(devs[j].bytes));
+            qdict_put(dict, "depth", qint_from_int(devs[j].depth));
+            qlist_append(list, dict);
+        }
+        json = qobject_to_json(QOBJECT(list));
+        QDECREF(json);
+        QDECREF(list);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("QDict + JSON: %d devices, %f us/poll",
+                   PERF_DEVS, duration * 1e6 / PERF_POLLS);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/stats/register", test_register);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/stats/collect", perf_collect);
+        g_test_add_func("/perf/stats/json", perf_json);
+    }
+    return g_test_run();
+}
@@ -179,6 +179,130 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Straightforward byte at a time encoder, used as a reference for the
+ * wire format produced by the optimized xbzrle_encode_buffer().
+ */
+static int reference_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (i - start == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        if (d + i - start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+static void encode_decode_random(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *reference = g_malloc(PAGE_SIZE);
+    int changes = g_test_rand_int_range(0, 64);
+    int max_run = g_test_rand_int_range(1, 128);
+    int slen = PAGE_SIZE - sizeof(long) * g_test_rand_int_range(0, 4);
+    int dlen = g_test_rand_int_range(slen / 8, slen + 1);
+    int i, j, pos, len, rc, ref;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int_range(0, 4);
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    for (i = 0; i < changes; i++) {
+        pos = g_test_rand_int_range(0, slen);
+        len = g_test_rand_int_range(1, max_run + 1);
+        for (j = pos; j < pos + len && j < slen; j++) {
+            new_buf[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+
+    rc = xbzrle_encode_buffer(old_buf, new_buf, slen, compressed, dlen);
+    ref = reference_encode(old_buf, new_buf, slen, reference, dlen);
+    g_assert_cmpint(rc, ==, ref);
+
+    if (rc > 0) {
+        g_assert(memcmp(compressed, reference, rc) == 0);
+        rc = xbzrle_decode_buffer(compressed, rc, old_buf, slen);
+        g_assert_cmpint(rc, <=, slen);
+        g_assert(memcmp(old_buf, new_buf, slen) == 0);
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(reference);
+}
+
+static void test_encode_decode_random(void)
+{
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        encode_decode_random();
+    }
+}
+
+static void perf_encode(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    unsigned int i, max;
+    double duration;
+
+    /* A sparsely modified page, the common case for XBZRLE */
+    for (i = 0; i < PAGE_SIZE; i += 512) {
+        new_buf[i] = 1;
+        new_buf[i + 1] = 2;
+    }
+
+    max = 1000000;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                             PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Encode %u pages: %f s, %f MB/s\n", max, duration,
+                   (double)max * PAGE_SIZE / duration / (1024 * 1024));
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +315,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_random",
+                    test_encode_decode_random);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/xbzrle/encode", perf_encode);
+    }
 
     return g_test_run();
 }
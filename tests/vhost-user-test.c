@@ -40,8 +40,9 @@
 #define QEMU_CMD_MEM    " -m 512 -object memory-backend-file,id=mem,size=512M,"\
                         "mem-path=%s,share=on -numa node,memdev=mem"
 #define QEMU_CMD_CHR    " -chardev socket,id=chr0,path=%s"
-#define QEMU_CMD_NETDEV " -netdev vhost-user,id=net0,chardev=chr0,vhostforce"
-#define QEMU_CMD_NET    " -device virtio-net-pci,netdev=net0 "
+#define QEMU_CMD_NETDEV " -netdev vhost-user,id=net0,chardev=chr0,vhostforce,"\
+                        "queues=2"
+#define QEMU_CMD_NET    " -device virtio-net-pci,netdev=net0,mq=on "
 #define QEMU_CMD_ROM    " -option-rom ../pc-bios/pxe-virtio.rom"
 
 #define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
@@ -52,6 +53,10 @@
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ        0
+#define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -69,6 +74,9 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -85,6 +93,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -97,6 +110,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserLog log;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -111,8 +125,12 @@ static VhostUserMsg m __attribute__ ((unused));
 #define VHOST_USER_VERSION    (0x1)
 /*****************************************************************************/
 
+#define QUEUE_PAIRS_MAX 2
+
 int fds_num = 0, fds[VHOST_MEMORY_MAX_NREGIONS];
 static VhostUserMemory memory;
+static int log_fd = -1;
+static VhostUserLog log_desc;
 static GMutex *data_mutex;
 static GCond *data_cond;
 
@@ -255,6 +273,112 @@ static void read_guest_mem(void)
     g_mutex_unlock(data_mutex);
 }
 
+static void wait_for_log_fd(void)
+{
+    gint64 end_time;
+
+    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
+    while (log_fd < 0) {
+        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert_cmpint(log_fd, >=, 0);
+            break;
+        }
+    }
+}
+
+static void test_migrate_log(void)
+{
+    QDict *rsp, *ret;
+    QList *blocks;
+    QListEntry *entry;
+    const char *status;
+    int64_t dirty_pages;
+    gint64 end_time;
+    uint8_t *log;
+
+    /* throttle migration so that it is still running when we look */
+    qmp_discard_response("{ 'execute': 'migrate_set_speed',"
+                         " 'arguments': { 'value': 1 } }");
+    rsp = qmp("{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': 'exec:cat > /dev/null' } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    g_mutex_lock(data_mutex);
+    wait_for_log_fd();
+
+    /* one bit per guest page must cover at least all of guest RAM */
+    g_assert_cmpint(log_desc.mmap_size, >=, (512 << 20) / 4096 / 8);
+
+    /* forget this log, dirty logging is restarted below */
+    close(log_fd);
+    log_fd = -1;
+    g_mutex_unlock(data_mutex);
+
+    qmp_discard_response("{ 'execute': 'migrate_cancel' }");
+    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
+    do {
+        g_assert_cmpint(_get_time(), <, end_time);
+        rsp = qmp("{ 'execute': 'query-migrate' }");
+        ret = qdict_get_qdict(rsp, "return");
+        status = qdict_get_try_str(ret, "status");
+        if (status && !strcmp(status, "cancelled")) {
+            QDECREF(rsp);
+            break;
+        }
+        QDECREF(rsp);
+        g_usleep(10000);
+    } while (true);
+
+    /* measure the dirty rate, which enables dirty logging again */
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              " 'arguments': { 'calc-time': 2, 'sample-period': 100 } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    g_mutex_lock(data_mutex);
+    wait_for_log_fd();
+
+    log = mmap(0, log_desc.mmap_size + log_desc.mmap_offset,
+               PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, 0);
+    g_assert(log != MAP_FAILED);
+
+    /*
+     * Mark the upper 256 MiB of guest RAM dirty, like a slave writing to
+     * it would.  The guest itself only runs the option ROM and does not
+     * come close to dirtying that many pages.
+     */
+    memset(log + log_desc.mmap_offset + (256 << 20) / 4096 / 8, 0xff,
+           (256 << 20) / 4096 / 8);
+
+    munmap(log, log_desc.mmap_size + log_desc.mmap_offset);
+    g_mutex_unlock(data_mutex);
+
+    end_time = _get_time() + 10 * G_TIME_SPAN_SECOND;
+    do {
+        g_assert_cmpint(_get_time(), <, end_time);
+        rsp = qmp("{ 'execute': 'query-dirty-rate' }");
+        ret = qdict_get_qdict(rsp, "return");
+        if (!strcmp(qdict_get_str(ret, "status"), "measured")) {
+            break;
+        }
+        QDECREF(rsp);
+        g_usleep(100000);
+    } while (true);
+
+    /* QEMU must have picked up every page the slave marked dirty */
+    dirty_pages = 0;
+    blocks = qdict_get_qlist(ret, "blocks");
+    QLIST_FOREACH_ENTRY(blocks, entry) {
+        QDict *block = qobject_to_qdict(qlist_entry_obj(entry));
+
+        dirty_pages += qdict_get_int(block, "dirty-pages");
+    }
+    QDECREF(rsp);
+    g_assert_cmpint(dirty_pages, >=, (256 << 20) / 4096);
+}
+
 static void *thread_function(void *data)
 {
     GMainLoop *loop;
@@ -293,7 +417,27 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.u64);
-        msg.u64 = 0;
+        msg.u64 = (1ULL << VHOST_F_LOG_ALL) |
+                  (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        /* send back protocol features to qemu */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                  (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD);
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_GET_QUEUE_NUM:
+        /* send back the number of queue pairs to qemu */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = QUEUE_PAIRS_MAX;
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
@@ -316,6 +460,25 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         g_cond_signal(data_cond);
         break;
 
+    case VHOST_USER_SET_LOG_BASE:
+        /* received the dirty log, a new one replaces the old */
+        if (log_fd >= 0) {
+            close(log_fd);
+        }
+        memcpy(&log_desc, &msg.log, sizeof(msg.log));
+        qemu_chr_fe_get_msgfds(chr, &log_fd, 1);
+
+        /* ack so that qemu may release the previous log */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = 0;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+
+        /* signal the test that it can continue */
+        g_cond_signal(data_cond);
+        break;
+
     case VHOST_USER_SET_VRING_KICK:
     case VHOST_USER_SET_VRING_CALL:
         /* consume the fd */
@@ -404,6 +567,7 @@ int main(int argc, char **argv)
     g_free(qemu_cmd);
 
     qtest_add_func("/vhost-user/read-guest-mem", read_guest_mem);
+    qtest_add_func("/vhost-user/migrate-log", test_migrate_log);
 
     ret = g_test_run();
 
@@ -20,6 +20,7 @@
 #include "libqos/malloc.h"
 #include "libqos/malloc-pc.h"
 #include "qemu/bswap.h"
+#include "hw/pci/pci_regs.h"
 
 #define QVIRTIO_BLK_F_BARRIER       0x00000001
 #define QVIRTIO_BLK_F_SIZE_MAX      0x00000002
@@ -47,6 +48,16 @@
 
 #define PCI_SLOT_HP             0x06
 
+/* PAM register of the i440FX for 0xd0000-0xd7fff, and its attributes */
+#define I440FX_PAM_D0000        0x5c
+#define PAM_RO                  0x1
+#define PAM_RW                  0x3
+#define PAM_RING_ADDR           0xd0000
+
+/* Interrupt coalescing delay, in the units of the property and of the clock */
+#define COALESCE_USECS          1000
+#define COALESCE_NS             (COALESCE_USECS * 1000)
+
 typedef struct QVirtioBlkReq {
     uint32_t type;
     uint32_t ioprio;
@@ -55,7 +66,7 @@ typedef struct QVirtioBlkReq {
     uint8_t status;
 } QVirtioBlkReq;
 
-static QPCIBus *test_start(void)
+static QPCIBus *test_start_args(const char *device_args)
 {
     char *cmdline;
     char tmp_path[] = "/tmp/qtest.XXXXXX";
@@ -71,8 +82,8 @@ static QPCIBus *test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s "
                               "-drive if=none,id=drive1,file=/dev/null "
                               "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                              "addr=%x.%x",
-                              tmp_path, PCI_SLOT, PCI_FN);
+                              "addr=%x.%x%s",
+                              tmp_path, PCI_SLOT, PCI_FN, device_args);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(cmdline);
@@ -80,6 +91,11 @@ static QPCIBus *test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *test_start(void)
+{
+    return test_start_args("");
+}
+
 static void test_end(void)
 {
     qtest_end();
@@ -642,6 +658,357 @@ static void pci_idx(void)
     test_end();
 }
 
+static void pam_set(QPCIBus *bus, uint8_t attr)
+{
+    QPCIDevice *host;
+
+    host = qpci_device_find(bus, 0);
+    g_assert(host != NULL);
+    qpci_config_writeb(host, I440FX_PAM_D0000, attr | (attr << 4));
+    g_free(host);
+}
+
+/* The device keeps host mappings of the vrings; they must follow changes
+ * to the memory map under the rings.
+ */
+static void pci_remap(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    uint16_t avail_idx;
+    uint8_t status;
+    char *data;
+
+    bus = test_start();
+
+    dev = virtio_blk_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    /* Move the rings to the PAM segment at 0xd0000, mapped to RAM */
+    pam_set(bus, PAM_RW);
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+    guest_free(alloc, vqpci->vq.desc);
+    qvring_init(alloc, &vqpci->vq, PAM_RING_ADDR);
+    qvirtio_pci.queue_select(&dev->vdev, 0);
+    qvirtio_pci.set_queue_address(&dev->vdev,
+                                  PAM_RING_ADDR / QVIRTIO_PCI_ALIGN);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Write request */
+    req.type = QVIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 528, false, true);
+    qvirtqueue_add(&vqpci->vq, req_addr + 528, 1, true, false);
+
+    /* Make the request available while the segment is writable, then
+     * make the segment read-only: the update of the used ring must be
+     * dropped rather than written through a stale host mapping.
+     */
+    avail_idx = readw(vqpci->vq.avail + 2);
+    writew(vqpci->vq.avail + 4 + 2 * (avail_idx % vqpci->vq.size),
+           free_head);
+    writew(vqpci->vq.avail + 2, avail_idx + 1);
+    pam_set(bus, PAM_RO);
+    qvirtio_pci.virtqueue_kick(&dev->vdev, &vqpci->vq);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+    g_assert_cmpint(readw(vqpci->vq.used + 2), ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    /* Back to RAM, requests complete again */
+    pam_set(bus, PAM_RW);
+
+    req.type = QVIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 16, false, true);
+    qvirtqueue_add(&vqpci->vq, req_addr + 16, 513, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+    g_assert_cmpint(readw(vqpci->vq.used + 2), ==, 1);
+    g_assert_cmpint(readl(vqpci->vq.used + 4), ==, free_head);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+
+    /* End test */
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    test_end();
+}
+
+/* Without ioeventfd, every register access and queue notification goes
+ * through the handlers of the legacy BAR.
+ */
+static void pci_ioeventfd_off(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    uint8_t status;
+    char *data;
+
+    bus = test_start_args(",ioeventfd=off");
+
+    dev = virtio_blk_init(bus, PCI_SLOT);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    g_assert_cmphex(qpci_io_readl(dev->pdev, dev->addr +
+                                  QVIRTIO_GUEST_FEATURES), ==, features);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+    g_assert_cmpint(qpci_io_readw(dev->pdev, dev->addr + QVIRTIO_QUEUE_SIZE),
+                    ==, vqpci->vq.size);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+    g_assert_cmphex(qpci_io_readb(dev->pdev, dev->addr +
+                                  QVIRTIO_DEVICE_STATUS), ==,
+                    QVIRTIO_ACKNOWLEDGE | QVIRTIO_DRIVER | QVIRTIO_DRIVER_OK);
+
+    /* Notifications for queues that are not set up are ignored */
+    qpci_io_writew(dev->pdev, dev->addr + QVIRTIO_QUEUE_NOTIFY, 1);
+    qpci_io_writew(dev->pdev, dev->addr + QVIRTIO_QUEUE_NOTIFY, 0xffff);
+    g_assert_cmphex(qpci_io_readb(dev->pdev, dev->addr +
+                                  QVIRTIO_ISR_STATUS), ==, 0);
+
+    /* Write request */
+    req.type = QVIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 528, false, true);
+    qvirtqueue_add(&vqpci->vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    /* Reading the ISR cleared it */
+    g_assert_cmphex(qpci_io_readb(dev->pdev, dev->addr +
+                                  QVIRTIO_ISR_STATUS), ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    /* Read request */
+    req.type = QVIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 16, false, true);
+    qvirtqueue_add(&vqpci->vq, req_addr + 16, 513, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+
+    /* End test */
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    test_end();
+}
+
+static void msix_mask(QPCIDevice *pdev, uint16_t entry, bool mask)
+{
+    void *addr = pdev->msix_table + entry * PCI_MSIX_ENTRY_SIZE +
+                 PCI_MSIX_ENTRY_VECTOR_CTRL;
+    uint32_t control = qpci_io_readl(pdev, addr);
+
+    if (mask) {
+        control |= PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    } else {
+        control &= ~PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    }
+    qpci_io_writel(pdev, addr, control);
+}
+
+/* Queue a one sector write request, without kicking the device */
+static uint64_t coalesce_write(QGuestAllocator *alloc, QVirtQueuePCI *vqpci,
+                               uint64_t sector)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = QVIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    qvirtqueue_add(&vqpci->vq, req_addr, 528, false, true);
+    qvirtqueue_add(&vqpci->vq, req_addr + 528, 1, true, false);
+    return req_addr;
+}
+
+/* Wait for requests to complete without advancing the virtual clock, on
+ * which held back interrupts are timed.
+ */
+static void coalesce_wait_used(QVirtQueuePCI *vqpci, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vqpci->vq.used + 2) != idx) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+}
+
+static void pci_msix_coalesce(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint64_t req_addr[4];
+    uint32_t features;
+    uint32_t free_head;
+    int i;
+
+    bus = test_start_args(",irq-coalesce-usecs=1000,irq-coalesce-frames=2");
+    alloc = pc_alloc_init();
+
+    dev = virtio_blk_init(bus, PCI_SLOT);
+    qpci_msix_enable(dev->pdev);
+
+    qvirtio_pci_set_msix_configuration_vector(dev, alloc, 0);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX | QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+    qvirtqueue_pci_msix_setup(dev, vqpci, alloc, 1);
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* A lone completion is signalled once the delay has expired */
+    free_head = vqpci->vq.free_head;
+    req_addr[0] = coalesce_write(alloc, vqpci, 0);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+    coalesce_wait_used(vqpci, 1);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, 0);
+    clock_step(COALESCE_NS - 1);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, 0);
+    clock_step(1);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, vqpci->msix_data);
+    writel(vqpci->msix_addr, 0);
+
+    /* Reaching irq-coalesce-frames signals at once */
+    free_head = vqpci->vq.free_head;
+    req_addr[1] = coalesce_write(alloc, vqpci, 1);
+    req_addr[2] = coalesce_write(alloc, vqpci, 2);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+    coalesce_wait_used(vqpci, 3);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, vqpci->msix_data);
+    writel(vqpci->msix_addr, 0);
+
+    /* A held back interrupt that fires while its vector is masked stays
+     * pending and is delivered on unmask.
+     */
+    msix_mask(dev->pdev, 1, true);
+    free_head = vqpci->vq.free_head;
+    req_addr[3] = coalesce_write(alloc, vqpci, 3);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+    coalesce_wait_used(vqpci, 4);
+    clock_step(COALESCE_NS);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, 0);
+    g_assert(qpci_msix_pending(dev->pdev, 1));
+    msix_mask(dev->pdev, 1, false);
+    g_assert_cmphex(readl(vqpci->msix_addr), ==, vqpci->msix_data);
+
+    for (i = 0; i < ARRAY_SIZE(req_addr); i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* End test */
+    guest_free(alloc, vqpci->vq.desc);
+    qpci_msix_disable(dev->pdev);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    test_end();
+}
+
 static void hotplug(void)
 {
     QPCIBus *bus;
@@ -673,7 +1040,10 @@ int main(int argc, char **argv)
     g_test_add_func("/virtio/blk/pci/indirect", pci_indirect);
     g_test_add_func("/virtio/blk/pci/config", pci_config);
     g_test_add_func("/virtio/blk/pci/msix", pci_msix);
+    g_test_add_func("/virtio/blk/pci/msix-coalesce", pci_msix_coalesce);
     g_test_add_func("/virtio/blk/pci/idx", pci_idx);
+    g_test_add_func("/virtio/blk/pci/remap", pci_remap);
+    g_test_add_func("/virtio/blk/pci/ioeventfd-off", pci_ioeventfd_off);
     g_test_add_func("/virtio/blk/pci/hotplug", hotplug);
 
     ret = g_test_run();
@@ -8,36 +8,653 @@
  */
 
 #include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
 
 #define PCI_SLOT_HP             0x06
 
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+#define VNET_HDR_SIZE           10
+#define RX_BATCH                4
+#define TX_BATCH                40
+
+/* sv[0] is our end of the "tap device", sv[1] is passed to QEMU */
+static int sv[2];
+
+static void test_start(const char *extra_args, const char *device_args)
+{
+    char *cmdline;
+    int ret;
+
+    /* A sequenced packet socket keeps packet boundaries, like a tap
+     * device, and unlike a datagram socket it does not limit how many
+     * packets can be queued.
+     */
+    ret = socketpair(PF_UNIX, SOCK_SEQPACKET, 0, sv);
+    g_assert_cmpint(ret, ==, 0);
+
+    cmdline = g_strdup_printf("%s -netdev tap,id=hs0,fd=%d "
+                              "-device virtio-net-pci,netdev=hs0,id=net0%s",
+                              extra_args, sv[1], device_args);
+    qtest_start(cmdline);
+    g_free(cmdline);
+}
+
+static void test_end(void)
+{
+    qtest_end();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static QVirtioPCIDevice *virtio_net_init(QPCIBus *bus)
+{
+    QVirtioPCIDevice *dev;
+
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(dev != NULL);
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, 0);
+
+    return dev;
+}
+
+/* A broadcast frame passes the receive filter */
+static void make_frame(uint8_t *frame, size_t len, const char *payload)
+{
+    memset(frame, 0, len);
+    memset(frame, 0xff, 6);
+    strcpy((char *)frame + 14, payload);
+}
+
+/* Wait for the device to return buffers up to used index @idx */
+static void wait_used(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vq->used + offsetof(QVRingUsed, idx)) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+/* Wait for QEMU to read everything we wrote to the "tap device" */
+static void wait_tap_drained(void)
+{
+    gint64 start_time = g_get_monotonic_time();
+    struct pollfd pfd = { .fd = sv[1], .events = POLLIN };
+
+    while (poll(&pfd, 1, 0) > 0) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+static void set_link(bool up)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'set_link',"
+              "  'arguments': { 'name': 'net0', 'up': %i } }", up);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    test_start("", "");
+    test_end();
+}
+
+/* Look up a counter by name in query-stats-schema and read it */
+static uint64_t stats_get(const char *name)
+{
+    QDict *rsp, *ret;
+    QList *fields;
+    QListEntry *entry;
+    guchar *values;
+    gsize len;
+    uint64_t val;
+    int i = 0, index = -1;
+
+    rsp = qmp("{ 'execute': 'query-stats-schema' }");
+    ret = qdict_get_qdict(rsp, "return");
+    fields = qdict_get_qlist(ret, "fields");
+    QLIST_FOREACH_ENTRY(fields, entry) {
+        QDict *field = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(field, "name"), name)) {
+            index = i;
+        }
+        i++;
+    }
+    QDECREF(rsp);
+    g_assert_cmpint(index, >=, 0);
+
+    rsp = qmp("{ 'execute': 'query-stats' }");
+    ret = qdict_get_qdict(rsp, "return");
+    values = g_base64_decode(qdict_get_str(ret, "values"), &len);
+    g_assert_cmpint(len, >=, (index + 1) * sizeof(val));
+    memcpy(&val, values + index * sizeof(val), sizeof(val));
+    g_free(values);
+    QDECREF(rsp);
+
+    return le64_to_cpu(val);
+}
+
+static void rx_stats(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint8_t frame[60], buf[60];
+    uint64_t req_addr;
+    uint32_t free_head;
+    ssize_t ret;
+
+    test_start("", "");
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    req_addr = guest_alloc(alloc, 2048);
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 2048, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    g_assert_cmpint(stats_get("net.net0.rx-packets"), ==, 0);
+
+    make_frame(frame, sizeof(frame), "TEST");
+    ret = write(sv[0], frame, sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buf, sizeof(buf));
+    g_assert(!memcmp(buf, frame, sizeof(frame)));
+
+    g_assert_cmpint(stats_get("net.net0.rx-packets"), ==, 1);
+    g_assert_cmpint(stats_get("net.net0.rx-bytes"), ==, sizeof(frame));
+    g_assert_cmpint(stats_get("virtio.net0.0.notifications"), ==, 1);
+    g_assert_cmpint(stats_get("virtio.net0.0.descriptors"), ==, 1);
+
+    guest_free(alloc, req_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* Wait for the counter @name to reach @value */
+static void wait_stat(const char *name, uint64_t value)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (stats_get(name) != value) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+/* Frames read by the tap backend in one go reach the guest with a single
+ * interrupt.  While the VM is stopped nothing is read, so all of them are
+ * waiting when it runs again.
+ */
+static void rx_batch(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint8_t frame[60], buf[60];
+    char payload[16];
+    uint64_t req_addr;
+    uint32_t free_head;
+    ssize_t ret;
+    int i;
+
+    test_start("", "");
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    req_addr = guest_alloc(alloc, RX_BATCH * 2048);
+    for (i = 0; i < RX_BATCH; i++) {
+        free_head = qvirtqueue_add(&vqpci->vq, req_addr + i * 2048, 2048,
+                                   true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+    }
+
+    qmp_discard_response("{ 'execute': 'stop' }");
+    for (i = 0; i < RX_BATCH; i++) {
+        snprintf(payload, sizeof(payload), "BATCH%d", i);
+        make_frame(frame, sizeof(frame), payload);
+        ret = write(sv[0], frame, sizeof(frame));
+        g_assert_cmpint(ret, ==, sizeof(frame));
+    }
+    qmp_discard_response("{ 'execute': 'cont' }");
+
+    wait_used(&vqpci->vq, RX_BATCH);
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    for (i = 0; i < RX_BATCH; i++) {
+        snprintf(payload, sizeof(payload), "BATCH%d", i);
+        make_frame(frame, sizeof(frame), payload);
+        memread(req_addr + i * 2048 + VNET_HDR_SIZE, buf, sizeof(buf));
+        g_assert(!memcmp(buf, frame, sizeof(frame)));
+    }
+
+    g_assert_cmpint(stats_get("virtio.net0.0.descriptors"), ==, RX_BATCH);
+    g_assert_cmpint(stats_get("virtio.net0.0.interrupts"), ==, 1);
+
+    guest_free(alloc, req_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* Whether an rx interrupt was still pending on the source is not migrated,
+ * so the destination raises one for every queue when it starts running.
+ * The rings keep working there.
+ */
+static void migrate_rx_notify(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint8_t frame[60], buf[60];
+    char tmp_path[] = "/tmp/qtest-virtio-net.XXXXXX";
+    char *args;
+    uint64_t req_addr;
+    uint32_t free_head;
+    gint64 start_time;
+    QDict *rsp;
+    ssize_t ret;
+    int fd;
+
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    test_start("", "");
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    req_addr = guest_alloc(alloc, 2048);
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 2048, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    rsp = qmp("{ 'execute': 'migrate',"
+              "  'arguments': { 'uri': 'exec:cat > %s' } }", tmp_path);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    start_time = g_get_monotonic_time();
+    for (;;) {
+        const char *status;
+
+        rsp = qmp("{ 'execute': 'query-migrate' }");
+        status = qdict_get_str(qdict_get_qdict(rsp, "return"), "status");
+        if (!strcmp(status, "completed")) {
+            QDECREF(rsp);
+            break;
+        }
+        g_assert_cmpstr(status, !=, "failed");
+        QDECREF(rsp);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        g_usleep(10 * 1000);
+    }
+    g_assert_cmpint(stats_get("virtio.net0.0.interrupts"), ==, 0);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+
+    args = g_strdup_printf("-incoming 'exec:cat %s'", tmp_path);
+    test_start(args, "");
+    g_free(args);
+
+    wait_stat("virtio.net0.0.interrupts", 1);
+
+    make_frame(frame, sizeof(frame), "MIGRATED");
+    ret = write(sv[0], frame, sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    wait_used(&vqpci->vq, 1);
+    memread(req_addr + VNET_HDR_SIZE, buf, sizeof(buf));
+    g_assert(!memcmp(buf, frame, sizeof(frame)));
+    wait_stat("virtio.net0.0.interrupts", 2);
+
+    unlink(tmp_path);
+    test_end();
+}
+
+/* Queue TX_BATCH packets while the VM is stopped, so that the device finds
+ * all of them when it runs, and check how many interrupts it took to
+ * return the buffers.
+ */
+static void tx_batch(const char *device_args, uint64_t interrupts)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint8_t frame[60], buf[VNET_HDR_SIZE + 60];
+    char payload[16];
+    uint64_t tx_addr;
+    uint32_t free_head;
+    ssize_t ret;
+    int i;
+
+    test_start("", device_args);
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 1);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    tx_addr = guest_alloc(alloc, TX_BATCH * sizeof(buf));
+    memset(buf, 0, VNET_HDR_SIZE);
+
+    qmp_discard_response("{ 'execute': 'stop' }");
+    for (i = 0; i < TX_BATCH; i++) {
+        snprintf(payload, sizeof(payload), "BATCH%d", i);
+        make_frame(buf + VNET_HDR_SIZE, sizeof(frame), payload);
+        memwrite(tx_addr + i * sizeof(buf), buf, sizeof(buf));
+        free_head = qvirtqueue_add(&vqpci->vq, tx_addr + i * sizeof(buf),
+                                   sizeof(buf), false, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+    }
+    qmp_discard_response("{ 'execute': 'cont' }");
+
+    wait_used(&vqpci->vq, TX_BATCH);
+    for (i = 0; i < TX_BATCH; i++) {
+        snprintf(payload, sizeof(payload), "BATCH%d", i);
+        make_frame(buf + VNET_HDR_SIZE, sizeof(frame), payload);
+        ret = recv(sv[0], frame, sizeof(frame), MSG_DONTWAIT);
+        g_assert_cmpint(ret, ==, sizeof(frame));
+        g_assert(!memcmp(frame, buf + VNET_HDR_SIZE, sizeof(frame)));
+    }
+
+    g_assert_cmpint(stats_get("virtio.net0.1.descriptors"), ==, TX_BATCH);
+    g_assert_cmpint(stats_get("virtio.net0.1.interrupts"), ==, interrupts);
+
+    guest_free(alloc, tx_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* tx=bh returns the whole burst with one interrupt */
+static void tx_batch_bh(void)
+{
+    tx_batch("", 1);
+}
+
+/* tx=adaptive starts with bursts of TX_BURST_MIN (16) and doubles the next
+ * one when a burst comes back full: 16 packets, then the other 24.
+ */
+static void tx_batch_adaptive(void)
+{
+    tx_batch(",tx=adaptive", 2);
+}
+
+/* Look up the incoming queue of net client @name in query-net-queues */
+static QDict *net_queue_get(const char *name)
+{
+    QDict *rsp, *info = NULL;
+    QListEntry *entry;
+
+    rsp = qmp("{ 'execute': 'query-net-queues' }");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), entry) {
+        QDict *queue = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(queue, "name"), name)) {
+            info = queue;
+            QINCREF(info);
+        }
+    }
+    QDECREF(rsp);
+    g_assert(info);
+
+    return info;
+}
+
+static void net_queue_check(const char *name, int64_t length,
+                            int64_t dropped)
+{
+    QDict *info = net_queue_get(name);
+
+    g_assert_cmpint(qdict_get_int(info, "length"), ==, length);
+    g_assert_cmpint(qdict_get_int(info, "max-length"), >, 0);
+    g_assert_cmpint(qdict_get_int(info, "dropped"), ==, dropped);
+    QDECREF(info);
+}
+
+/* Wait for the packets from the "tap device" to be queued at net0 */
+static void wait_queued(int64_t length)
+{
+    gint64 start_time = g_get_monotonic_time();
+    QDict *info;
+
+    for (;;) {
+        info = net_queue_get("net0");
+        if (qdict_get_int(info, "length") == length) {
+            break;
+        }
+        QDECREF(info);
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+    QDECREF(info);
+}
+
+/* Packets that arrive while the guest has no buffers wait in the queue of
+ * the NIC.  Once delivered, their buffer is reused for the next one.
+ */
+static void queue_stats(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    uint8_t frame[1000], buf[1000];
+    uint64_t req_addr;
+    uint32_t free_head;
+    size_t sizes[] = { 60, sizeof(frame) };
+    QDict *rsp;
+    ssize_t ret;
+    int i;
+
+    test_start("", "");
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+    req_addr = guest_alloc(alloc, 2048);
+
+    net_queue_check("net0", 0, 0);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        make_frame(frame, sizes[i], i ? "REUSED" : "QUEUED");
+        ret = write(sv[0], frame, sizes[i]);
+        g_assert_cmpint(ret, ==, sizes[i]);
+        wait_queued(1);
+
+        free_head = qvirtqueue_add(&vqpci->vq, req_addr, 2048, true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+        wait_used(&vqpci->vq, i + 1);
+        memread(req_addr + VNET_HDR_SIZE, buf, sizes[i]);
+        g_assert(!memcmp(buf, frame, sizes[i]));
+        net_queue_check("net0", 0, 0);
+    }
+
+    /* Removing the backend discards what it left queued */
+    make_frame(frame, sizeof(frame), "PURGED");
+    ret = write(sv[0], frame, sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    wait_queued(1);
+
+    rsp = qmp("{ 'execute': 'netdev_del', 'arguments': { 'id': 'hs0' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    net_queue_check("net0", 0, 1);
+
+    guest_free(alloc, req_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* Packets in either direction are dropped while the link is down, also
+ * when the queues are serviced by an IOThread.
+ */
+static void dataplane_link(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *rxq, *txq;
+    QGuestAllocator *alloc;
+    uint8_t frame[60], buf[VNET_HDR_SIZE + 60];
+    uint64_t rx_addr, tx_addr;
+    uint32_t free_head;
+    ssize_t ret;
+
+    test_start("-object iothread,id=io0", ",iothread=io0");
+    bus = qpci_init_pc();
+    dev = virtio_net_init(bus);
+
+    alloc = pc_alloc_init();
+    rxq = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                            alloc, 0);
+    txq = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                            alloc, 1);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    rx_addr = guest_alloc(alloc, 2048);
+    free_head = qvirtqueue_add(&rxq->vq, rx_addr, 2048, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &rxq->vq, free_head);
+    tx_addr = guest_alloc(alloc, sizeof(buf));
+
+    set_link(false);
+
+    /* The guest gets its tx buffer back, but nothing reaches the tap */
+    memset(buf, 0, VNET_HDR_SIZE);
+    make_frame(buf + VNET_HDR_SIZE, sizeof(frame), "DOWN");
+    memwrite(tx_addr, buf, sizeof(buf));
+    free_head = qvirtqueue_add(&txq->vq, tx_addr, sizeof(buf), false, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &txq->vq, free_head);
+    wait_used(&txq->vq, 1);
+    ret = recv(sv[0], frame, sizeof(frame), MSG_DONTWAIT);
+    g_assert_cmpint(ret, ==, -1);
+
+    /* A packet from the tap is read and dropped */
+    make_frame(frame, sizeof(frame), "DOWN");
+    ret = write(sv[0], frame, sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    wait_tap_drained();
+
+    set_link(true);
+
+    make_frame(buf + VNET_HDR_SIZE, sizeof(frame), "UP");
+    memwrite(tx_addr, buf, sizeof(buf));
+    free_head = qvirtqueue_add(&txq->vq, tx_addr, sizeof(buf), false, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &txq->vq, free_head);
+    wait_used(&txq->vq, 2);
+    ret = recv(sv[0], frame, sizeof(frame), MSG_DONTWAIT);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    g_assert(!memcmp(frame, buf + VNET_HDR_SIZE, sizeof(frame)));
+
+    make_frame(frame, sizeof(frame), "UP");
+    ret = write(sv[0], frame, sizeof(frame));
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    wait_used(&rxq->vq, 1);
+    memread(rx_addr + VNET_HDR_SIZE, buf, sizeof(frame));
+    g_assert(!memcmp(buf, frame, sizeof(frame)));
+
+    g_assert_cmpint(stats_get("net.net0.rx-packets"), ==, 1);
+    g_assert_cmpint(stats_get("net.hs0.rx-packets"), ==, 1);
+    g_assert_cmpint(stats_get("virtio.net0.0.descriptors"), ==, 1);
+    g_assert_cmpint(stats_get("virtio.net0.1.descriptors"), ==, 2);
+
+    guest_free(alloc, tx_addr);
+    guest_free(alloc, rx_addr);
+    guest_free(alloc, txq->vq.desc);
+    guest_free(alloc, rxq->vq.desc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
 }
 
 static void hotplug(void)
 {
+    test_start("", "");
     qpci_plug_device_test("virtio-net-pci", "net1", PCI_SLOT_HP, NULL);
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
+    test_end();
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
-
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/net/pci/nop", pci_nop);
+    qtest_add_func("/virtio/net/pci/rx-stats", rx_stats);
+    qtest_add_func("/virtio/net/pci/queue-stats", queue_stats);
+    qtest_add_func("/virtio/net/pci/rx-batch", rx_batch);
+    qtest_add_func("/virtio/net/pci/migrate-rx-notify", migrate_rx_notify);
+    qtest_add_func("/virtio/net/pci/tx-batch/bh", tx_batch_bh);
+    qtest_add_func("/virtio/net/pci/tx-batch/adaptive", tx_batch_adaptive);
+    qtest_add_func("/virtio/net/pci/dataplane/link", dataplane_link);
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
-    qtest_start("-device virtio-net-pci");
-    ret = g_test_run();
-
-    qtest_end();
-
-    return ret;
+    return g_test_run();
 }
@@ -11,6 +11,7 @@
 
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/atomic.h"
 
 /*
  * bitmaps provide an array of bits, implemented using an an
@@ -155,8 +156,6 @@ int slow_bitmap_andnot(unsigned long *dst, const unsigned long *bitmap1,
     return result != 0;
 }
 
-#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
-
 void bitmap_set(unsigned long *map, long start, long nr)
 {
     unsigned long *p = map + BIT_WORD(start);
@@ -197,6 +196,133 @@ void bitmap_clear(unsigned long *map, long start, long nr)
     }
 }
 
+void bitmap_set_atomic(unsigned long *map, long start, long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const long size = start + nr;
+    int bits_to_set = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_set = BITMAP_FIRST_WORD_MASK(start);
+
+    /* First word */
+    if (nr - bits_to_set > 0) {
+        atomic_or(p, mask_to_set);
+        nr -= bits_to_set;
+        bits_to_set = BITS_PER_LONG;
+        mask_to_set = ~0UL;
+        p++;
+    }
+
+    /* Full words: every bit ends up set whatever other threads do to
+     * the word concurrently, so a plain store is enough.
+     */
+    if (bits_to_set == BITS_PER_LONG) {
+        while (nr >= BITS_PER_LONG) {
+            if (atomic_read(p) != ~0UL) {
+                atomic_set(p, ~0UL);
+            }
+            nr -= BITS_PER_LONG;
+            p++;
+        }
+    }
+
+    /* Last word */
+    if (nr) {
+        mask_to_set &= BITMAP_LAST_WORD_MASK(size);
+        atomic_or(p, mask_to_set);
+    } else {
+        /* The atomic_or() above would have been a full barrier; pairs
+         * with the one in bitmap_test_and_clear_atomic().
+         */
+        smp_mb();
+    }
+}
+
+bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    const long size = start + nr;
+    int bits_to_clear = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask_to_clear = BITMAP_FIRST_WORD_MASK(start);
+    unsigned long dirty = 0;
+    unsigned long old_bits;
+
+    /* First word */
+    if (nr - bits_to_clear > 0) {
+        old_bits = atomic_fetch_and(p, ~mask_to_clear);
+        dirty |= old_bits & mask_to_clear;
+        nr -= bits_to_clear;
+        bits_to_clear = BITS_PER_LONG;
+        mask_to_clear = ~0UL;
+        p++;
+    }
+
+    /* Full words */
+    if (bits_to_clear == BITS_PER_LONG) {
+        while (nr >= BITS_PER_LONG) {
+            if (atomic_read(p)) {
+                old_bits = atomic_xchg(p, 0);
+                dirty |= old_bits;
+            }
+            nr -= BITS_PER_LONG;
+            p++;
+        }
+    }
+
+    /* Last word */
+    if (nr) {
+        mask_to_clear &= BITMAP_LAST_WORD_MASK(size);
+        old_bits = atomic_fetch_and(p, ~mask_to_clear);
+        dirty |= old_bits & mask_to_clear;
+    } else if (!dirty) {
+        /* No atomic operation was done, so order the reads of the bits
+         * before the caller's reads of the data; pairs with
+         * bitmap_set_atomic().
+         */
+        smp_mb();
+    }
+
+    return dirty != 0;
+}
+
+/*
+ * OR bits [start, start + nr) of @src into @dst and clear them in @src,
+ * a word at a time.  @src may be updated concurrently with the atomic
+ * operations above; @dst belongs to the caller.  Returns the number of
+ * bits that were newly set in @dst.
+ */
+long bitmap_merge_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                   long start, long nr)
+{
+    unsigned long *s = src + BIT_WORD(start);
+    unsigned long *d = dst + BIT_WORD(start);
+    const long size = start + nr;
+    int bits = BITS_PER_LONG - (start % BITS_PER_LONG);
+    unsigned long mask = BITMAP_FIRST_WORD_MASK(start);
+    unsigned long old_bits;
+    long count = 0;
+
+    while (nr > 0) {
+        if (nr < bits) {
+            mask &= BITMAP_LAST_WORD_MASK(size);
+        }
+        if (atomic_read(s) & mask) {
+            if (mask == ~0UL) {
+                old_bits = atomic_xchg(s, 0);
+            } else {
+                old_bits = atomic_fetch_and(s, ~mask) & mask;
+            }
+            count += ctpopl(old_bits & ~*d);
+            *d |= old_bits;
+        }
+        nr -= bits;
+        bits = BITS_PER_LONG;
+        mask = ~0UL;
+        s++;
+        d++;
+    }
+    return count;
+}
+
 #define ALIGN_MASK(x,mask)      (((x)+(mask))&~(mask))
 
 /**
@@ -31,6 +31,11 @@
 #include "qemu/iov.h"
 #include "net/net.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -166,34 +171,12 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
-/*
- * Searches for an area with non-zero content in a buffer
- *
- * Attention! The len must be a multiple of
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * and addr must be a multiple of sizeof(VECTYPE) due to
- * restriction of optimizations in this function.
- *
- * can_use_buffer_find_nonzero_offset() can be used to check
- * these requirements.
- *
- * The return value is the offset of the non-zero area rounded
- * down to a multiple of sizeof(VECTYPE) for the first
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
- *
- * If the buffer is all zero the return value is equal to len.
- */
-
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_vec(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -221,6 +204,159 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#ifndef bit_AVX
+#define bit_AVX         (1 << 28)
+#endif
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE     (1 << 27)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2        (1 << 5)
+#endif
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+/*
+ * Same as buffer_find_nonzero_offset_vec, but checks each
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE) = 128 byte
+ * chunk with four 256-bit loads.  The 16 byte alignment guaranteed by
+ * can_use_buffer_find_nonzero_offset() is not enough for aligned AVX
+ * loads, so use unaligned ones; they are as fast on aligned data.
+ */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const VECTYPE *p = buf;
+    const VECTYPE zero = (VECTYPE){0};
+    size_t i;
+
+    QEMU_BUILD_BUG_ON(BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                      * sizeof(VECTYPE) != 4 * sizeof(__m256i));
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!ALL_EQ(p[i], zero)) {
+            return i * sizeof(VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        const __m256i *q = (const __m256i *)&p[i];
+        __m256i tmp01 = _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                                        _mm256_loadu_si256(q + 1));
+        __m256i tmp23 = _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                        _mm256_loadu_si256(q + 3));
+        __m256i tmp = _mm256_or_si256(tmp01, tmp23);
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(VECTYPE);
+}
+
+#pragma GCC pop_options
+
+/*
+ * Returns true if the host CPU supports AVX2 and the OS has enabled
+ * the AVX register state.
+ */
+bool host_cpu_has_avx2(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+
+    /* AVX must be enabled by the OS, i.e. it must save the YMM state */
+    __cpuid(1, a, b, c, d);
+    if ((c & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#endif
+
+static size_t (*buffer_find_nonzero_offset_fn)(const void *buf, size_t len) =
+    buffer_find_nonzero_offset_vec;
+
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (host_cpu_has_avx2()) {
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+}
+
+/*
+ * For tests only: make buffer_find_nonzero_offset() use implementation
+ * number @accel, 0 being the portable vector one and higher numbers
+ * faster ones.  Returns false, leaving the current one in place, if
+ * the host does not support it.
+ */
+bool test_buffer_find_nonzero_offset_accel(unsigned int accel)
+{
+    switch (accel) {
+    case 0:
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_vec;
+        return true;
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    case 1:
+        if (!host_cpu_has_avx2()) {
+            return false;
+        }
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_avx2;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/*
+ * Searches for an area with non-zero content in a buffer
+ *
+ * Attention! The len must be a multiple of
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
+ * and addr must be a multiple of sizeof(VECTYPE) due to
+ * restriction of optimizations in this function.
+ *
+ * can_use_buffer_find_nonzero_offset() can be used to check
+ * these requirements.
+ *
+ * The return value is the offset of the non-zero area rounded
+ * down to a multiple of sizeof(VECTYPE) for the first
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
+ * afterwards.
+ *
+ * If the buffer is all zero the return value is equal to len.
+ *
+ * The fastest implementation supported by the host CPU is picked
+ * at startup.
+ */
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    return buffer_find_nonzero_offset_fn(buf, len);
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
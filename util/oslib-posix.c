@@ -57,6 +57,8 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/bitops.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -344,11 +346,22 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+typedef struct MemsetThread {
+    QemuThread thread;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    /* host NUMA node to touch the pages from, or -1 */
+    int node;
+    sigjmp_buf env;
+    bool failed;
+} MemsetThread;
+
+static __thread sigjmp_buf *sigbus_env;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    siglongjmp(*sigbus_env, 1);
 }
 
 static size_t fd_getpagesize(int fd)
@@ -371,11 +384,86 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+static void touch_pages_bind_node(int node)
 {
-    int ret;
+#ifdef CONFIG_LINUX
+    char *path, *list, *p;
+    cpu_set_t cpus;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &list, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    /* The list looks like "0-7,16-23" */
+    CPU_ZERO(&cpus);
+    p = list;
+    while (qemu_isdigit(*p)) {
+        unsigned long first, last;
+
+        first = last = strtoul(p, &p, 10);
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &cpus);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    g_free(list);
+
+    /* Only a hint for where the kernel places pages, so ignore errors */
+    if (CPU_COUNT(&cpus)) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *t = arg;
+    sigset_t set;
+    size_t i;
+
+    if (t->node >= 0) {
+        touch_pages_bind_node(t->node);
+    }
+
+    /* qemu_thread_create() blocks all signals, but a failed allocation
+     * must reach sigbus_handler() */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(t->env, 1)) {
+        t->failed = true;
+    } else {
+        sigbus_env = &t->env;
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < t->numpages; i++) {
+            memset(t->addr + t->hpagesize * i, 0, 1);
+        }
+    }
+    sigbus_env = NULL;
+    return NULL;
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int nthreads,
+                     const unsigned long *host_nodes, unsigned long maxnode)
+{
+    int ret, i, nnodes = 0;
+    int nodes[MAX_MEM_PREALLOC_THREADS];
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    size_t pages_per_thread, leftover;
+    MemsetThread *threads;
+    bool failed = false;
+    unsigned long node;
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -387,31 +475,48 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    /* Touch the memory of each host node from that node's CPUs, with at
+     * least one thread per node */
+    if (host_nodes) {
+        for (node = find_first_bit(host_nodes, maxnode);
+             node < maxnode && nnodes < MAX_MEM_PREALLOC_THREADS;
+             node = find_next_bit(host_nodes, maxnode, node + 1)) {
+            nodes[nnodes++] = node;
+        }
+    }
+    nthreads = MAX(nthreads, nnodes);
+    nthreads = MIN(MAX(nthreads, 1), MAX_MEM_PREALLOC_THREADS);
+    nthreads = MIN(nthreads, MAX(numpages, 1));
+
+    threads = g_new0(MemsetThread, nthreads);
+    pages_per_thread = numpages / nthreads;
+    leftover = numpages % nthreads;
+    for (i = 0; i < nthreads; i++) {
+        MemsetThread *t = &threads[i];
+
+        t->addr = area;
+        t->numpages = pages_per_thread + (i < leftover);
+        t->hpagesize = hpagesize;
+        t->node = nnodes ? nodes[i % nnodes] : -1;
+        area += t->numpages * hpagesize;
+        qemu_thread_create(&t->thread, "touch_pages", do_touch_pages, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        failed |= threads[i].failed;
+    }
+    g_free(threads);
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-
-        /* MAP_POPULATE silently ignores failures */
-        memory = (memory + hpagesize - 1) & -hpagesize;
-        for (i = 0; i < (memory / hpagesize); i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
@@ -460,7 +460,8 @@ size_t getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory, int nthreads,
+                     const unsigned long *host_nodes, unsigned long maxnode)
 {
     int i;
     size_t pagesize = getpagesize();
@@ -24,8 +24,10 @@
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #endif
+#include <glib.h>
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/rcu.h"
 
 static bool name_threads;
 
@@ -411,6 +413,25 @@ static void qemu_thread_set_name(QemuThread *thread, const char *name)
 #endif
 }
 
+typedef struct QemuThreadArgs {
+    void *(*start_routine)(void *);
+    void *arg;
+} QemuThreadArgs;
+
+static void *qemu_thread_start(void *args)
+{
+    QemuThreadArgs *qemu_thread_args = args;
+    void *(*start_routine)(void *) = qemu_thread_args->start_routine;
+    void *arg = qemu_thread_args->arg;
+    void *ret;
+
+    g_free(qemu_thread_args);
+    rcu_register_thread();
+    ret = start_routine(arg);
+    rcu_unregister_thread();
+    return ret;
+}
+
 void qemu_thread_create(QemuThread *thread, const char *name,
                        void *(*start_routine)(void*),
                        void *arg, int mode)
@@ -418,6 +439,7 @@ void qemu_thread_create(QemuThread *thread, const char *name,
     sigset_t set, oldset;
     int err;
     pthread_attr_t attr;
+    QemuThreadArgs *qemu_thread_args;
 
     err = pthread_attr_init(&attr);
     if (err) {
@@ -433,7 +455,11 @@ void qemu_thread_create(QemuThread *thread, const char *name,
     /* Leave signal handling to the iothread.  */
     sigfillset(&set);
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
-    err = pthread_create(&thread->thread, &attr, start_routine, arg);
+    qemu_thread_args = g_new(QemuThreadArgs, 1);
+    qemu_thread_args->start_routine = start_routine;
+    qemu_thread_args->arg = arg;
+    err = pthread_create(&thread->thread, &attr, qemu_thread_start,
+                         qemu_thread_args);
     if (err)
         error_exit(err, __func__);
 
@@ -458,6 +484,7 @@ bool qemu_thread_is_self(QemuThread *thread)
 
 void qemu_thread_exit(void *retval)
 {
+    rcu_unregister_thread();
     pthread_exit(retval);
 }
 
@@ -0,0 +1,206 @@
+/*
+ * Read-copy-update
+ *
+ * Grace periods are detected with a global counter and one snapshot per
+ * registered thread (the "memory barrier" flavor of userspace RCU): a
+ * reader copies the counter on entry to its outermost critical section
+ * and clears the copy on exit, so synchronize_rcu() only needs to bump
+ * the counter and wait for every snapshot that is older.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+
+unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+
+QemuEvent rcu_gp_event;
+static QemuMutex rcu_gp_lock;
+
+/* The registry of threads that may use rcu_read_lock().  Protected by
+ * rcu_gp_lock, so threads cannot come and go during a grace period.
+ */
+static QLIST_HEAD(, rcu_reader_data) registry =
+    QLIST_HEAD_INITIALIZER(registry);
+
+__thread struct rcu_reader_data rcu_reader;
+
+/* Is the reader with snapshot @ctr still in a critical section that
+ * started before the current grace period?
+ */
+static inline bool rcu_gp_ongoing(unsigned long *ctr)
+{
+    unsigned long v;
+
+    v = atomic_read(ctr);
+    return v && (v != rcu_gp_ctr);
+}
+
+static void wait_for_readers(void)
+{
+    QLIST_HEAD(, rcu_reader_data) qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
+    struct rcu_reader_data *index, *tmp;
+
+    for (;;) {
+        /* Be notified of readers that leave their critical section while
+         * we walk the list.
+         */
+        qemu_event_reset(&rcu_gp_event);
+
+        QLIST_FOREACH(index, &registry, node) {
+            atomic_set(&index->waiting, true);
+        }
+
+        /* Order the stores to index->waiting before the loads of
+         * index->ctr; pairs with the atomic_xchg in rcu_read_unlock().
+         */
+        smp_mb();
+
+        QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
+            if (!rcu_gp_ongoing(&index->ctr)) {
+                QLIST_REMOVE(index, node);
+                QLIST_INSERT_HEAD(&qsreaders, index, node);
+
+                /* At worst this causes a spurious wakeup. */
+                atomic_set(&index->waiting, false);
+            }
+        }
+
+        if (QLIST_EMPTY(&registry)) {
+            break;
+        }
+
+        /* Wait for one reader to leave its critical section, and retry. */
+        qemu_event_wait(&rcu_gp_event);
+    }
+
+    while ((index = QLIST_FIRST(&qsreaders))) {
+        QLIST_REMOVE(index, node);
+        QLIST_INSERT_HEAD(&registry, index, node);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    if (!QLIST_EMPTY(&registry)) {
+        if (sizeof(rcu_gp_ctr) < 8) {
+            /* With 32-bit longs the counter could wrap around while a
+             * reader is preempted, and a stale snapshot would look
+             * current.  Flip a parity bit twice instead, waiting for
+             * readers after each flip.
+             */
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+            wait_for_readers();
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+        } else {
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+        }
+
+        wait_for_readers();
+    }
+
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_register_thread(void)
+{
+    assert(rcu_reader.ctr == 0);
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_unregister_thread(void)
+{
+    assert(rcu_reader.depth == 0);
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_REMOVE(&rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+/* Callbacks queued by call_rcu1(), run in batches by call_rcu_thread()
+ * after one grace period per batch.
+ */
+static QemuMutex rcu_call_lock;
+static QemuEvent rcu_call_ready_event;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_thread_started;
+
+/* Give callbacks that are queued in a burst (e.g. one per address space
+ * by a memory transaction) a chance to share the grace period.
+ */
+#define RCU_CALL_BATCH_US 10000
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *list, *next;
+
+    for (;;) {
+        qemu_event_reset(&rcu_call_ready_event);
+        if (!atomic_read(&rcu_call_head)) {
+            qemu_event_wait(&rcu_call_ready_event);
+            continue;
+        }
+
+        g_usleep(RCU_CALL_BATCH_US);
+
+        qemu_mutex_lock(&rcu_call_lock);
+        list = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        synchronize_rcu();
+
+        qemu_mutex_lock_iothread();
+        for (; list; list = next) {
+            next = list->next;
+            list->func(list);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+void call_rcu1(struct rcu_head *node, RCUCBFunc *func)
+{
+    QemuThread thread;
+
+    node->func = func;
+    node->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = node;
+    rcu_call_tail = &node->next;
+
+    /* Started on first use rather than at startup, so that it does not
+     * get lost when QEMU daemonizes.
+     */
+    if (!rcu_call_thread_started) {
+        rcu_call_thread_started = true;
+        qemu_thread_create(&thread, "call_rcu", call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_mutex_unlock(&rcu_call_lock);
+
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+static void __attribute__((__constructor__)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_event_init(&rcu_gp_event, true);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_event_init(&rcu_call_ready_event, false);
+    rcu_register_thread();
+}
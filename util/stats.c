@@ -0,0 +1,93 @@
+/*
+ * Statistics registry
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qemu/stats.h"
+
+struct StatsSource {
+    char *prefix;
+    const StatsField *fields;
+    int nr_fields;
+    StatsCollectFunc *collect;
+    void *opaque;
+    QTAILQ_ENTRY(StatsSource) next;
+};
+
+static QTAILQ_HEAD(, StatsSource) stats_sources =
+    QTAILQ_HEAD_INITIALIZER(stats_sources);
+static uint64_t stats_gen;
+static int stats_total_fields;
+
+/*
+ * Register @nr_fields counters, named "@prefix.<field name>".  @fields
+ * must stay valid until the source is unregistered; it is usually a
+ * static table shared by all instances of a device.
+ */
+StatsSource *stats_register(const char *prefix, const StatsField *fields,
+                            int nr_fields, StatsCollectFunc *collect,
+                            void *opaque)
+{
+    StatsSource *src = g_new0(StatsSource, 1);
+
+    src->prefix = g_strdup(prefix);
+    src->fields = fields;
+    src->nr_fields = nr_fields;
+    src->collect = collect;
+    src->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&stats_sources, src, next);
+
+    stats_total_fields += nr_fields;
+    stats_gen++;
+    return src;
+}
+
+void stats_unregister(StatsSource *src)
+{
+    if (!src) {
+        return;
+    }
+
+    QTAILQ_REMOVE(&stats_sources, src, next);
+    stats_total_fields -= src->nr_fields;
+    stats_gen++;
+
+    g_free(src->prefix);
+    g_free(src);
+}
+
+uint64_t stats_generation(void)
+{
+    return stats_gen;
+}
+
+int stats_nr_fields(void)
+{
+    return stats_total_fields;
+}
+
+void stats_foreach_field(StatsFieldFunc *fn, void *opaque)
+{
+    StatsSource *src;
+    int i;
+
+    QTAILQ_FOREACH(src, &stats_sources, next) {
+        for (i = 0; i < src->nr_fields; i++) {
+            fn(src->prefix, &src->fields[i], opaque);
+        }
+    }
+}
+
+void stats_collect(uint64_t *values)
+{
+    StatsSource *src;
+
+    QTAILQ_FOREACH(src, &stats_sources, next) {
+        src->collect(src->opaque, values);
+        values += src->nr_fields;
+    }
+}
@@ -11,8 +11,123 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Run detection helpers.  Both return the index of the first byte at or
+ * after i where old_buf and new_buf differ (xbzrle_zrun_end) or are equal
+ * (xbzrle_nzrun_end), or slen if there is none.  Runs are byte granular,
+ * so all implementations produce exactly the same encoding.
+ */
+static inline int xbzrle_zrun_end_long(const uint8_t *old_buf,
+                                       const uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    int res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end_long(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    /* not aligned to sizeof(long) */
+    int res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+/*
+ * 16 bytes at a time: compare both pages and look at the movemask of the
+ * result, which has a bit set for every byte that is unchanged.
+ */
+static inline int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf, int i, int slen)
+{
+    while (slen - i >= 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int ne = ~_mm_movemask_epi8(_mm_cmpeq_epi8(o, n)) & 0xffff;
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+        i += 16;
+    }
+    return xbzrle_zrun_end_long(old_buf, new_buf, i, slen);
+}
+
+static inline int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int i, int slen)
+{
+    while (slen - i >= 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 16;
+    }
+    return xbzrle_nzrun_end_long(old_buf, new_buf, i, slen);
+}
+
+#define xbzrle_zrun_end     xbzrle_zrun_end_sse2
+#define xbzrle_nzrun_end    xbzrle_nzrun_end_sse2
+#else
+#define xbzrle_zrun_end     xbzrle_zrun_end_long
+#define xbzrle_nzrun_end    xbzrle_nzrun_end_long
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,12 +138,16 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static inline __attribute__((always_inline))
+int xbzrle_encode_buffer_common(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                int (*zrun_end)(const uint8_t *,
+                                                const uint8_t *, int, int),
+                                int (*nzrun_end)(const uint8_t *,
+                                                 const uint8_t *, int, int))
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    int d = 0, i = 0, j;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +159,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        j = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
+        i = j;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,42 +175,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        j = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
+        i = j;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -119,12 +193,85 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int xbzrle_encode_buffer_vec(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_common(old_buf, new_buf, slen, dst, dlen,
+                                       xbzrle_zrun_end, xbzrle_nzrun_end);
+}
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+/* Same as the SSE2 helpers, 32 bytes at a time */
+static inline int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf, int i, int slen)
+{
+    while (slen - i >= 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+        i += 32;
+    }
+    return xbzrle_zrun_end_sse2(old_buf, new_buf, i, slen);
+}
+
+static inline int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf, int i, int slen)
+{
+    while (slen - i >= 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    return xbzrle_nzrun_end_sse2(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_common(old_buf, new_buf, slen, dst, dlen,
+                                       xbzrle_zrun_end_avx2,
+                                       xbzrle_nzrun_end_avx2);
+}
+
+#pragma GCC pop_options
+#endif
+
+static int (*xbzrle_encode_buffer_fn)(uint8_t *old_buf, uint8_t *new_buf,
+                                      int slen, uint8_t *dst, int dlen) =
+    xbzrle_encode_buffer_vec;
+
+static void __attribute__((constructor)) init_xbzrle_encode_buffer(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (host_cpu_has_avx2()) {
+        xbzrle_encode_buffer_fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_fn(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;